@@ -17,6 +17,8 @@
  * includes (ordered alphabetically)
  * ------------------------------------------------------------------------
  */
+#include <ctype.h>
+#include <float.h>
 #include <sys/time.h>
 
 #include "postgres.h"
@@ -25,37 +27,70 @@
 #include "access/heapam.h"
 #include "access/itup.h"
 #include "access/nbtree.h"
+#include "access/transam.h"
 #include "access/xact.h"
 #include "index_adviser.h"
 #include "catalog/catalog.h"
 #include "catalog/index.h"
 #include "catalog/indexing.h"
 #include "catalog/namespace.h"
+#include "catalog/pg_am.h"
+#include "catalog/pg_class.h"
+#include "catalog/pg_constraint.h"
+#include "catalog/pg_statistic.h"
+#include "catalog/pg_type.h"
 #include "commands/defrem.h"
 #include "commands/explain.h"
 #include "executor/execdesc.h"
+#include "executor/instrument.h"
 #include "executor/spi.h"
 #include "fmgr.h"									   /* for PG_MODULE_MAGIC */
+#include "funcapi.h"
 #include "miscadmin.h"
+#include "nodes/memnodes.h"
 #include "nodes/pg_list.h"
 #include "nodes/print.h"
+#include "optimizer/clauses.h"
+#include "optimizer/geqo.h"
+#include "optimizer/pathnode.h"
+#include "optimizer/paths.h"
 #include "optimizer/planner.h"
+#include "optimizer/tlist.h"
+#include "optimizer/var.h"
 #include "optimizer/plancat.h"
 #include "parser/parse_coerce.h"
 #include "parser/parsetree.h"
+#include "rewrite/rewriteManip.h"
+#include "pg_trace.h"
+#include "pgstat.h"
+#include "storage/ipc.h"
 #include "storage/lmgr.h"
+#include "storage/lwlock.h"
 #include "storage/proc.h"
+#include "storage/shmem.h"
 #include "tcop/dest.h"
 #include "tcop/tcopprot.h"
+#include "utils/array.h"
 #include "utils/builtins.h"
+#include "utils/datum.h"
 #include "utils/elog.h"
+#include "utils/fmgroids.h"
+#include "utils/guc.h"
+#include "utils/hsearch.h"
+#include "utils/inval.h"
 #include "utils/lsyscache.h"
+#include "utils/memutils.h"
 #include "utils/relcache.h"
 #include "utils/syscache.h"
+#include "utils/timestamp.h"
 
 /* mark this dynamic library to be compatible with PG */
 PG_MODULE_MAGIC;
 
+PG_FUNCTION_INFO_V1( index_adviser_stats );
+PG_FUNCTION_INFO_V1( index_adviser_stats_reset );
+PG_FUNCTION_INFO_V1( index_adviser_memory_top );
+
 #define CREATE_V_INDEXES 1
 
 /* *****************************************************************************
@@ -75,6 +110,28 @@ PG_MODULE_MAGIC;
 /* Index Adviser output table */
 #define IND_ADV_TABL "index_advisory"
 
+/* Index Adviser table for the write profile of DML statements */
+#define IND_ADV_WRITES_TABL "index_advisory_writes"
+
+/* Where the usage of existing indexes is recorded */
+#define IND_ADV_USAGE_TABL "index_advisory_usage"
+
+/* Where the benefit for each sample of parameter values is recorded */
+#define IND_ADV_SAMPLES_TABL "index_advisory_samples"
+
+/* the statements the adviser gave up on, for running out of budget */
+#define IND_ADV_TRUNCATIONS_TABL "index_advisory_truncations"
+
+/* The benefit of each index over all the backends, decayed with time */
+#define IND_ADV_SUMMARY_TABL "index_advisory_summary"
+
+/* and per hour, for the last day */
+#define IND_ADV_HOURLY_TABL "index_advisory_hourly"
+
+/* The functions that add to a row of each of these, or insert it */
+#define IND_ADV_SUMMARY_ADD "index_advisory_summary_add"
+#define IND_ADV_HOURLY_ADD "index_advisory_hourly_add"
+
 /* IND_ADV_TABL does Not Exist */
 #define IND_ADV_ERROR_NE	"relation \""IND_ADV_TABL"\" does not exist."
 
@@ -104,6 +161,30 @@ static List* scan_generic_node(	const Node* const root,
 								List* const opnos,
 								List* const rangeTableStack );
 
+static List* scan_subqueries(	const Node* const root,
+								List* const opnos,
+								List* const rangeTableStack );
+
+struct ScanContext;
+
+static bool scan_clause_walker( Node* node, struct ScanContext* context );
+
+static bool scan_subqueries_walker( Node* node, struct ScanContext* context );
+
+static void scan_row_compare_args( List* args, struct ScanContext* context );
+
+static IndexCandidate* make_var_candidate(	const Var* const expr,
+											struct ScanContext* context );
+
+static List* scan_jointree(	const Node* const jtnode,
+							List* const opnos,
+							List* const rangeTableStack );
+
+static List* scan_foreign_keys( const Query* const query );
+
+static List* scan_ordered_candidates(	const Query* const query,
+										List* const sortList );
+
 static List* scan_group_clause(	List* const groupList,
 								List* const targtList,
 								List* const opnos,
@@ -113,6 +194,20 @@ static List* build_composite_candidates( List* l1, List* l2 );
 
 static List* remove_irrelevant_candidates( List* candidates );
 
+static float4 estimate_selectivity(	const IndexCandidate* const cand,
+									Oid opno,
+									Node* other,
+									bool varonleft );
+
+static int8 range_bound( Oid opno, bool varonleft );
+
+static void combine_range_bounds( List* list1, List* list2 );
+
+static float4 estimate_null_selectivity(	const IndexCandidate* const cand,
+											NullTestType type );
+
+static List* remove_unselective_candidates( List* candidates );
+
 static void mark_used_candidates(	const Node* const plan,
 									List* const candidates );
 
@@ -129,7 +224,139 @@ static void drop_virtual_indexes( List* candidates );
 
 #endif
 
-static void save_advice( List* candidates );
+static void save_advice(	List* candidates, uint64 fingerprint,
+							const char* sample_kinds );
+
+static bool save_advice_weight( uint64 fingerprint, int weight );
+
+static void save_advice_summary( uint64 fingerprint, int weight );
+
+static bool hypothetical_configuration(void);
+
+static WriteProfile* get_write_profile(	const Query* const query,
+										const PlannedStmt* const actual_plan );
+
+static void save_write_profile( WriteProfile* profile, uint64 fingerprint );
+
+static List* get_existing_indexes( const PlannedStmt* const plan );
+
+static List* analyse_existing_indexes(	const Query* const query,
+										int cursorOptions,
+										ParamListInfo boundParams,
+										PlannedStmt* actual_plan );
+
+static Cost droppable_indexes_cost(	const Query* const query,
+									int cursorOptions,
+									ParamListInfo boundParams,
+									List* indexes,
+									PlannedStmt* actual_plan );
+
+static List* check_droppable(	const Query* const query,
+								int cursorOptions,
+								ParamListInfo boundParams,
+								IndexCandidate* cand,
+								List* dropped,
+								PlannedStmt* actual_plan );
+
+static void save_index_usage( List* indexes, uint64 fingerprint );
+
+static uint32 execute_advisory_sql( const char* sql, int expected );
+
+static List* parse_assumed_indexes( const char* config );
+
+static List* parse_hidden_indexes( const char* config );
+
+static List* build_param_samples(	const Query* const query,
+									ParamListInfo boundParams,
+									char* kinds );
+
+static void evaluate_param_samples(	const Query* const query,
+									int cursorOptions,
+									List* candidates,
+									List* samples );
+
+static bool worth_advising( const Query* const query );
+
+static bool user_table_walker( Node* node, void* context );
+
+static void stats_count_unadvised(void);
+
+static void stats_exit_flush( int code, Datum arg );
+
+static void stats_add_memory_hungry(void);
+
+static void* counting_alloc( MemoryContext context, Size size );
+
+static void counting_free( MemoryContext context, void* pointer );
+
+static void* counting_realloc( MemoryContext context, void* pointer,
+								Size size );
+
+static void counting_reset( MemoryContext context );
+
+static int parse_benefit_attribution( const char* config );
+
+static void start_budget(void);
+
+static bool budget_exceeded(void);
+
+static void save_truncation( uint64 fingerprint );
+
+static void replan_in_batches(	const Query* const query,
+								int cursorOptions,
+								ParamListInfo boundParams,
+								List* candidates,
+								const PlannedStmt* const base_plan );
+
+static void plan_batch(	const Query* const query,
+						int cursorOptions,
+						ParamListInfo boundParams,
+						List* candidates,
+						List** batch,
+						const PlannedStmt* const base_plan );
+
+static void split_benefit(	const Query* const query,
+							int cursorOptions,
+							ParamListInfo params,
+							List* candidates,
+							const PlannedStmt* const base_plan,
+							const PlannedStmt* const plan );
+
+static Cost relation_scan_cost( const PlannedStmt* const stmt, Oid reloid );
+
+static Cost scan_cost_walker(	const Plan* const plan,
+								const PlannedStmt* const stmt,
+								Oid reloid,
+								double loops );
+
+static double inner_loops( const Plan* const join );
+
+static List* get_relation_accesses( const PlannedStmt* const stmt );
+
+static void relation_access_walker(	const Plan* const plan,
+									const PlannedStmt* const stmt,
+									bool underSort,
+									Cost sortCost,
+									double loops,
+									List** accesses );
+
+static List* prune_candidates_by_plan(	List* candidates,
+										List* accesses,
+										Cost totalCost );
+
+static uint64 query_fingerprint( const Query* const query );
+
+static bool count_advised_statement( uint64 fingerprint );
+
+static struct AdvisedStatement* lookup_advised_statement( uint64 fingerprint );
+
+static void remember_advised_statement( uint64 fingerprint, bool advised );
+
+static void forget_advised_statement( uint64 fingerprint );
+
+static void flush_advised_weights(void);
+
+static void advised_statements_callback( Datum arg, Oid relid );
 
 static void log_candidates( const char* text, List* candidates );
 
@@ -153,12 +380,27 @@ static void get_relation_info_callback(	PlannerInfo*	root,
 
 static const char* explain_get_index_name_callback( Oid indexId );
 
+static RelOptInfo* join_search_callback(	PlannerInfo*	root,
+											int				levels_needed,
+											List*			initial_rels );
+
+static List* get_scan_order( const PlannedStmt* const stmt );
+
+static void scan_order_walker( const Plan* const plan, List** order );
+
+static int scan_position( const PlannerInfo* const root, Index relid );
+
 static PlannedStmt* index_adviser(	Query*			query,
 									int				cursorOptions,
 									ParamListInfo	boundParams,
 									PlannedStmt*	actual_plan,
+									uint64			fingerprint,
 									bool			doingExplain);
 
+static PlannedStmt* adviser_planner(	Query*			query,
+										int				cursorOptions,
+										ParamListInfo	boundParams);
+
 static void resetSecondaryHooks(void);
 static bool is_virtual_index( Oid oid, IndexCandidate** cand_out );
 
@@ -169,26 +411,358 @@ static bool is_virtual_index( Oid oid, IndexCandidate** cand_out );
 
 typedef struct {
 	bool			running;
-	struct timeval	start;
-	struct timeval	stop;
+	instr_time		start;
+	instr_time		stop;
 	unsigned long	usec;
+	Size			bytesAtStart;	/* adviserMemory.allocated at start */
+	Size			bytes;			/* allocated while running */
 } Timer;
 
+/*
+ * What the adviser has allocated for the statement being advised; see
+ * create_adviser_context().
+ */
+typedef struct {
+	Size	current;				/* in the chunks allocated now */
+	Size	peak;					/* the most that current has been */
+	Size	allocated;				/* in all the chunks ever allocated */
+} MemoryAccount;
+
+static MemoryAccount adviserMemory;
+
+/* The context of the statement being advised, or NULL */
+static MemoryContext adviserContext = NULL;
+
+/* The methods of an AllocSet, and those methods that count the chunks */
+static MemoryContextMethods	*allocSetMethods = NULL;
+static MemoryContextMethods	countingMethods;
+
+/* The most memory-hungry statements the shared statistics keep */
+#define IND_ADV_TOP_MEMORY		10
+
+/* and how much of the text of each */
+#define IND_ADV_TOP_QUERY_LEN	256
+
+/* The statements a backend counts before it adds them to the shared ones */
+#define IND_ADV_STATS_FLUSH_CALLS	100
+
+/*
+ * The phases whose time the shared statistics accumulate; in the order of
+ * the *_time columns of index_adviser_stats().
+ */
+#define IND_ADV_PHASE_TOTAL			0		/* all of index_adviser() */
+#define IND_ADV_PHASE_EXISTING		1		/* analyse_existing_indexes() */
+#define IND_ADV_PHASE_SCAN			2		/* scan_query() */
+#define IND_ADV_PHASE_CREATE		3		/* create_virtual_indexes() */
+#define IND_ADV_PHASE_REPLAN		4		/* the re-plans with candidates */
+#define IND_ADV_PHASE_MARK			5		/* mark_used_candidates() */
+#define IND_ADV_PHASE_ATTRIBUTE		6		/* split_benefit() */
+#define IND_ADV_PHASE_SAMPLES		7		/* evaluate_param_samples() */
+#define IND_ADV_PHASE_SAVE			8		/* save_advice() */
+#define IND_ADV_STATS_PHASES		9
+
+/* The columns of index_adviser_stats(): counters, times, histogram, reset */
+#define IND_ADV_STATS_COUNTERS	((int) ( offsetof( AdviserCounters, usec )	\
+											/ sizeof(int64) ))
+#define IND_ADV_STATS_COLUMNS	( IND_ADV_STATS_COUNTERS					\
+									+ 2 * IND_ADV_STATS_PHASES + 2 )
+
+/* The columns of index_adviser_memory_top() */
+#define IND_ADV_TOP_COLUMNS		5
+
+/* Upper bounds of the buckets of the histogram of adviser time, in msec */
+static const int statsBuckets[] = { 1, 10, 100, 1000, 10000, INT_MAX };
+
+#define IND_ADV_STATS_BUCKETS	((int) lengthof( statsBuckets ))
+
+/*
+ * Cumulative counters of adviser activity. Every member is an int64, so that
+ * a backend can add its pending counts to the shared ones in a single loop.
+ */
+typedef struct {
+	int64	calls;					/* statements planned by the backend */
+	int64	advised;				/* statements that got advice */
+	int64	skipped_no_user_tables;	/* only system catalogs, or none */
+	int64	skipped_repeated;		/* advised before in the session */
+	int64	skipped_cheap;			/* cost below min_cost */
+	int64	skipped_by_plan;		/* the actual plan reads every table well */
+	int64	truncated_time;			/* ran out of time_budget */
+	int64	truncated_candidates;	/* had more than max_candidates */
+	int64	truncated_replans;		/* needed more than max_replans */
+	int64	truncated_memory;		/* needed more than max_memory */
+	int64	candidates_generated;
+	int64	candidates_relevant;
+	int64	candidates_used;
+	int64	replans;
+	int64	usec[IND_ADV_STATS_PHASES];
+	int64	bytes[IND_ADV_STATS_PHASES];	/* allocated in each phase */
+	int64	histogram[IND_ADV_STATS_BUCKETS];
+} AdviserCounters;
+
+/* A statement that needed a lot of memory to be advised */
+typedef struct {
+	uint64		fingerprint;
+	int64		peak_bytes;				/* the most it used at once */
+	int64		allocated_bytes;		/* all it allocated */
+	TimestampTz	when;					/* it was advised */
+	char		query[IND_ADV_TOP_QUERY_LEN];
+} MemoryHungryStatement;
+
+/* The statistics in shared memory; see stats_attach() */
+typedef struct {
+	LWLockId		lock;			/* protects the rest */
+	TimestampTz		stats_reset;	/* when the counters were last zeroed */
+	AdviserCounters	counters;
+	int				ntop;			/* entries used in top[] */
+	MemoryHungryStatement top[IND_ADV_TOP_MEMORY];
+} AdviserStats;
+
+/*
+ * Set in the postmaster when we are loaded thru shared_preload_libraries,
+ * and thus inherited by every backend; only then is there shared memory for
+ * the statistics.
+ */
+static bool statsRequested = false;
+
+static AdviserStats* adviserStats = NULL;
+
+/* What this backend counted since it last added to adviserStats */
+static AdviserCounters pendingStats;
+
+/* and the memory used by the hungriest statement it advised since, if any */
+static MemoryHungryStatement pendingMemory;
+
+/* Is stats_exit_flush() registered to run when the backend exits? */
+static bool statsExitFlush = false;
+
 /* Need this to remember the virtual indexes generated. */
 static List* index_candidates;
 
+/* The hooks installed before ours; ours call thru to them */
+static planner_hook_type				prev_planner_hook = NULL;
+static ExplainOneQuery_hook_type		prev_ExplainOneQuery_hook = NULL;
+static get_relation_info_hook_type		prev_get_relation_info_hook = NULL;
+static explain_get_index_name_hook_type	prev_explain_get_index_name_hook = NULL;
+static join_search_hook_type			prev_join_search_hook = NULL;
+
+/*
+ * The secondary hooks stay installed, so that a plugin loaded after us can
+ * chain to them; they do their job only while these are set.
+ */
+static bool relationInfoActive = false;
+static bool indexNameActive = false;
+static bool joinSearchActive = false;
+
+/*
+ * While the previous ExplainOneQuery hook runs, the first plan it makes thru
+ * our planner hook; it is the actual plan the adviser compares against.
+ */
+static bool			explainedPlanActive = false;
+static PlannedStmt*	explainedPlan = NULL;
+
+/*
+ * The range table indexes of the top query level, in the order the actual plan
+ * scans them; see fast_replan
+ */
+static List* joinOrder = NIL;
+
+/* Oids of the existing indexes hidden from the planner while re-planning */
+static List* hidden_index_oids;
+
+/* Cost of the hypothetical configuration, for EXPLAIN to show; -1 if none */
+static Cost configStartupCost = -1;
+static Cost configTotalCost = -1;
+
 /* Timer for logCandiates; global, since it is called from different places */
 static Timer tLogCandidates;
 
 /* Global variable to hold a value across calls to mark_used_candidates() */
 static PlannedStmt* plannedStmtGlobal;
 
+/* ------------------------------------------------------------------------
+ * GUC variables
+ * ------------------------------------------------------------------------
+ */
+
+/*
+ * The number of times the statement being advised occurs in the workload;
+ * pg_advise collapses identical statements and sets this before EXPLAINing
+ * each of them once.
+ */
+static int	statement_weight = 1;
+
+/*
+ * A hypothetical index configuration, as a list of "reloid(attnum,...)"
+ * separated by semicolons. These indexes are assumed to exist in both the
+ * plans being compared, so that the advice shows the benefit of an index over
+ * and above this configuration; pg_advise uses this to re-evaluate the
+ * remaining candidates after every index it picks.
+ */
+static char *assume_indexes = NULL;
+
+/*
+ * A comma separated list of existing indexes, taken out of the hypothetical
+ * configuration; both the plans being compared are generated without them, so
+ * that replacing or consolidating indexes can be evaluated without dropping
+ * any.
+ */
+static char *hide_indexes = NULL;
+
+/*
+ * Record the HOT update ratio observed by the statistics collector along with
+ * the write profile of an UPDATE; this makes the projected loss of HOT updates
+ * reflect the real workload rather than just the statements advised.
+ */
+static bool use_hot_statistics = false;
+
+/*
+ * Note which existing indexes the actual plans use, and what planning without
+ * the unused and the redundant ones costs, in IND_ADV_USAGE_TABL; the function
+ * index_drop_candidates() turns this into advice on indexes to drop.
+ */
+static bool track_index_usage = false;
+
+/*
+ * The number of samples of parameter values a parameterized statement is also
+ * evaluated with, on top of the generic plan; the values are the most common
+ * ones of the columns the parameters are compared to. The advice is the
+ * average over these, and IND_ADV_SAMPLES_TABL has the benefit in each.
+ */
+static int	param_samples = 0;
+
+/*
+ * Also propose an index on the referencing columns of every foreign key of the
+ * tables in a statement, unless an existing index leads with them; like every
+ * candidate, it is advised only if the planner finds a use for it.
+ */
+static bool foreign_key_candidates = false;
+
+/*
+ * Statements whose plan costs less than this are not looked for candidates;
+ * their writes and their use of the existing indexes are still recorded.
+ */
+static double min_cost = 0;
+
+/*
+ * How the cost saved by a plan is split among the candidates it uses:
+ *
+ *	size (or empty)	in proportion to their sizes
+ *	leave_one_out	in proportion to what re-planning without each one costs
+ *	plan			in proportion to what the scans of each one's table save
+ *
+ * leave_one_out takes a re-plan per candidate used; if a plan uses more than
+ * max_attribution_replans of them, plan is used instead.
+ */
+#define IND_ADV_ATTRIBUTE_SIZE			0
+#define IND_ADV_ATTRIBUTE_LEAVE_ONE_OUT	1
+#define IND_ADV_ATTRIBUTE_PLAN			2
+
+static char *benefit_attribution = NULL;
+static int	max_attribution_replans = 8;
+
+/*
+ * Look for candidates only on the tables the actual plan reads in full, or
+ * reads rows from only to filter them out, or sorts; and whose scans, with the
+ * sorts above them, make at least min_relation_cost_share of the plan's cost.
+ * The statements that use good indexes already then cost only a walk of
+ * their plan.
+ */
+static bool prune_by_plan = false;
+static double min_relation_cost_share = 0.05;
+
+/*
+ * Drop the single-column candidates whose clauses, by the statistics, select
+ * more than this fraction of their table even for the most selective value;
+ * 1 keeps them all.
+ */
+static double max_selectivity = 1;
+
+/* How the actual plan accesses a table; see prune_by_plan */
+typedef struct {
+	Oid		reloid;
+	bool	improvable;		/* read in full, filtered, or sorted */
+	Cost	cost;			/* of its scans, with the sorts above them */
+} RelationAccess;
+
+/*
+ * Show the planner at most these many candidates at a time; 0 shows it all of
+ * them. Each batch of candidates is planned with separately, and the plan
+ * that is advised sees only the candidates some batch's plan used.
+ */
+static int	max_candidates_per_plan = 0;
+
+/*
+ * Re-plan joining the tables in the order the actual plan does, instead of
+ * searching all the join orders again; much cheaper for joins of many tables,
+ * but blind to a join order that only the new indexes make the best.
+ */
+static bool fast_replan = false;
+
+/*
+ * What the adviser may spend on a statement: milliseconds, candidates left
+ * after the irrelevant ones are removed, re-plans, and kilobytes of memory; 0
+ * is no limit. The budget is checked between the steps of the adviser, and a
+ * statement that runs out of it gets no advice, only a row in
+ * IND_ADV_TRUNCATIONS_TABL. One step, like a re-plan, may still overrun the
+ * time or the memory.
+ */
+static int	time_budget = 0;
+static int	max_candidates = 0;
+static int	max_replans = 0;
+static int	max_memory = 0;
+
+/*
+ * Seconds it takes the benefit of an index in IND_ADV_SUMMARY_TABL to decay to
+ * half; 0 does not keep the summary, nor IND_ADV_HOURLY_TABL.
+ */
+static int	benefit_half_life = 0;
+
+/* The budget of the statement being advised; see budget_exceeded() */
+static bool				budgetActive = false;
+static struct timeval	budgetStart;
+static int				budgetReplans = 0;
+static char				budgetReason = '\0';	/* 't'ime, 'c'andidates,
+													 * 'r'eplans, 'm'emory */
+
+/* benefit_attribution, as parsed for the statement being advised */
+static int	benefitAttribution = IND_ADV_ATTRIBUTE_SIZE;
+
+/* ------------------------------------------------------------------------
+ * statements already advised in this session
+ * ------------------------------------------------------------------------
+ */
+
+typedef struct AdvisedStatement {
+	uint64	fingerprint;			/* hash key; must be first */
+	bool	advised;				/* did it produce any advice? */
+	int		weight;					/* of its repetitions not yet saved */
+} AdvisedStatement;
+
+/* reset the cache once it grows beyond these many statements */
+#define ADVISED_STATEMENTS_MAX	1024
+
+/* The repetitions counted in the cache before their weight is saved */
+#define ADVISED_WEIGHT_FLUSH_REPEATS	100
+
+static HTAB* advisedStatements = NULL;
+
+/* the repetitions whose weight the cache holds */
+static int advisedRepeats = 0;
+
+/*
+ * Set when a user table changed; the advice cached for it may no longer hold,
+ * so the cache starts over at the next statement.
+ */
+static bool advisedStatementsStale = false;
+
 static void
 startTimer( Timer* const timer )
 {
-	gettimeofday( &(timer->start), NULL );
+	INSTR_TIME_SET_CURRENT( timer->start );
 
 	timer->usec = 0;
+	timer->bytesAtStart = adviserMemory.allocated;
+	timer->bytes = 0;
 	timer->running = true;
 }
 
@@ -197,7 +771,8 @@ continueTimer( Timer* const timer )
 {
 	if( timer->running == false )
 	{
-		gettimeofday( &(timer->start), NULL );
+		INSTR_TIME_SET_CURRENT( timer->start );
+		timer->bytesAtStart = adviserMemory.allocated;
 		timer->running = true;
 	}
 }
@@ -207,13 +782,14 @@ stopTimer( Timer* const timer )
 {
 	if( timer->running == true )
 	{
-		gettimeofday( &(timer->stop), NULL );
+		INSTR_TIME_SET_CURRENT( timer->stop );
 
-		timer->usec += ( (unsigned long)timer->stop.tv_sec
-							- (unsigned long)timer->start.tv_sec )
-						* (unsigned long)1000000
-							+ (unsigned long)timer->stop.tv_usec
-							- (unsigned long)timer->start.tv_usec;
+		timer->usec += (unsigned long)
+						( ( INSTR_TIME_GET_DOUBLE( timer->stop )
+							- INSTR_TIME_GET_DOUBLE( timer->start ) )
+						* 1000000.0 );
+
+		timer->bytes += adviserMemory.allocated - timer->bytesAtStart;
 
 		timer->running = false;
 	}
@@ -223,100 +799,784 @@ static void
 t_reset( Timer *const timer )
 {
 	timer->usec = 0;
+	timer->bytes = 0;
 	timer->running = false;
 }
 
 /*
- * Since gettimeofday() is expensive, we don't collect profiling data unless
- * elog is going to log this.
+ * Since reading the clock is expensive, we don't collect profiling data unless
+ * elog is going to log this, or the shared statistics are going to add it up.
  */
+#define DEBUG_LEVEL_TIMING	(DEBUG_LEVEL_PROFILE || statsRequested)
+
 #define t_start(x)		do{								\
-							if( DEBUG_LEVEL_PROFILE )	\
+							if( DEBUG_LEVEL_TIMING )	\
 								startTimer( &(x) );		\
 						}while(0)
 
 #define t_continue(x)	do{								\
-							if( DEBUG_LEVEL_PROFILE )	\
+							if( DEBUG_LEVEL_TIMING )	\
 								continueTimer( &(x) );	\
 						}while(0)
 
 #define t_stop(x)		do{								\
-							if( DEBUG_LEVEL_PROFILE )	\
+							if( DEBUG_LEVEL_TIMING )	\
 								stopTimer( &(x) );		\
 						}while(0)
 
-/* ------------------------------------------------------------------------
- * implementations: index adviser
- * ------------------------------------------------------------------------
+/**
+ * stats_attach
+ *		finds the shared statistics, creating them the first time; returns
+ * false if there is no shared memory for them.
  */
-
-/* PG calls this func when loading the plugin */
-void
-_PG_init(void)
+static bool
+stats_attach(void)
 {
-	planner_hook = planner_callback;
-	ExplainOneQuery_hook = ExplainOneQuery_callback;
+	bool found;
 
-	/* We dont need to reset the state here since the contrib module has just been
-	 * loaded; FIXME: consider removing this call.
-	 */
-	resetSecondaryHooks();
+	if( adviserStats != NULL )
+		return true;
 
-//	elog( NOTICE, "IND ADV: plugin loaded" );
+	if( !statsRequested )
+		return false;
+
+	LWLockAcquire( AddinShmemInitLock, LW_EXCLUSIVE );
+
+	adviserStats = (AdviserStats*)ShmemInitStruct( "Index Adviser statistics",
+													sizeof(AdviserStats),
+													&found );
+
+	if( adviserStats == NULL )
+	{
+		/* ShmemInitStruct() has already complained; don't try again */
+		statsRequested = false;
+	}
+	else if( !found )
+	{
+		MemSet( &adviserStats->counters, 0, sizeof(AdviserCounters) );
+
+		adviserStats->lock			= LWLockAssign();
+		adviserStats->stats_reset	= GetCurrentTimestamp();
+	}
+
+	LWLockRelease( AddinShmemInitLock );
+
+	return adviserStats != NULL;
 }
 
-/* PG calls this func when un-loading the plugin (if ever) */
-void
-_PG_fini(void)
+/**
+ * stats_flush
+ *		adds what this backend has counted to the shared statistics.
+ */
+static void
+stats_flush(void)
 {
-	planner_hook				= NULL;
-	ExplainOneQuery_hook		= NULL;
+	const int64* const	pending = (const int64*)&pendingStats;
+	int64*				shared;
+	int					i;
 
-	resetSecondaryHooks();
+	/* whatever is counted, is counted while a statement is */
+	if( pendingStats.calls == 0 )
+		return;
 
-	elog( NOTICE, "IND ADV: plugin unloaded." );
-}
+	if( stats_attach() )
+	{
+		shared = (int64*)&adviserStats->counters;
 
-/* Make sure that Cost datatype can represent negative values */
-compile_assert( ((Cost)-1) < 0 );
+		LWLockAcquire( adviserStats->lock, LW_EXCLUSIVE );
 
-/* As of now the order-by and group-by clauses use the same C-struct.
- * A rudimentary check to confirm this:
- */
-compile_assert( sizeof(*((Query*)NULL)->groupClause) == sizeof(*((Query*)NULL)->sortClause) );
+		for( i = 0; i < (int)( sizeof(AdviserCounters) / sizeof(int64) ); ++i )
+			shared[i] += pending[i];
+
+		if( pendingMemory.peak_bytes > 0 )
+			stats_add_memory_hungry();
+
+		LWLockRelease( adviserStats->lock );
+	}
+
+	MemSet( &pendingStats, 0, sizeof(pendingStats) );
+	MemSet( &pendingMemory, 0, sizeof(pendingMemory) );
+}
 
 /**
- * index_adviser
- *		Takes a query and the actual plan generated by the standard planner for
- * that query. It then creates virtual indexes, using the columns used in the
- * query, and asks the standard planner to generate a new plan for the query.
- *
- *     If the new plan appears to be cheaper than the actual plan, it
- * saves the information about the virtual indexes that were used by the
- * planner in an advisory table.
- *
- *     If it is called by the Explain-hook, then it returns the newly generated
- * plan (allocated in caller's memory context), so that ExplainOnePlan() can
- * generate and send a string representation of the plan to the log or the client.
+ * stats_flush_due
+ *		called after each statement; adds what this backend has counted to
+ * the shared statistics when a statement was advised, or every
+ * IND_ADV_STATS_FLUSH_CALLS statements, so that the statements that are not
+ * advised do not take the lock each. The rest is added when the backend exits.
  */
+static void
+stats_flush_due(void)
+{
+	if( !statsRequested )
+		return;
 
-/* TODO: Make recursion suppression more bullet-proof. ERRORs can leave this indicator on. */
-static int8	SuppressRecursion = 0;		  /* suppress recursive calls */
+	if( !statsExitFlush )
+	{
+		on_shmem_exit( stats_exit_flush, 0 );
+		statsExitFlush = true;
+	}
 
-static PlannedStmt*
-index_adviser(	Query*			queryCopy,
-				int				cursorOptions,
-				ParamListInfo	boundParams,
-				PlannedStmt		*actual_plan,
-				bool			doingExplain)
-{
+	if( pendingStats.advised > 0
+		|| pendingStats.calls >= IND_ADV_STATS_FLUSH_CALLS )
+		stats_flush();
+}
+
+/**
+ * stats_exit_flush
+ *		adds what is left of this backend's counts as it exits.
+ */
+static void
+stats_exit_flush( int code, Datum arg )
+{
+	stats_flush();
+}
+
+/**
+ * stats_add_memory_hungry
+ *		keeps the statement in pendingMemory among the most memory-hungry ones,
+ * if it is one of them. The caller holds the lock of the shared statistics.
+ */
+static void
+stats_add_memory_hungry(void)
+{
+	MemoryHungryStatement	*entry = NULL;
+	int						i;
+
+	/* the statement, if it is there already, or else the least hungry one */
+	for( i = 0; i < adviserStats->ntop; ++i )
+	{
+		MemoryHungryStatement* const top = &adviserStats->top[i];
+
+		if( top->fingerprint == pendingMemory.fingerprint )
+		{
+			entry = top;
+			break;
+		}
+
+		if( entry == NULL || top->peak_bytes < entry->peak_bytes )
+			entry = top;
+	}
+
+	if( i < adviserStats->ntop )
+	{
+		/* the same statement; keep its hungriest run */
+		if( entry->peak_bytes >= pendingMemory.peak_bytes )
+			return;
+	}
+	else if( adviserStats->ntop < IND_ADV_TOP_MEMORY )
+		entry = &adviserStats->top[ adviserStats->ntop++ ];
+	else if( entry->peak_bytes >= pendingMemory.peak_bytes )
+		return;
+
+	*entry = pendingMemory;
+}
+
+/**
+ * create_adviser_context
+ *		creates the memory context the adviser works in for a statement, as a
+ * child of the current one, and starts counting what is allocated in it. The
+ * caller sets adviserContext to it while calling index_adviser(), and deletes
+ * it afterwards with delete_adviser_context().
+ *
+ *     8.3 cannot tell how much memory a context holds, so the context is an
+ * AllocSet whose methods are wrapped by ones that count the chunks.
+ *
+ *     A statement planned while the context of another one exists, like a
+ * query in a function the other one calls, gets a context of its own; the
+ * count of the other one is saved in *outer meanwhile.
+ */
+static MemoryContext
+create_adviser_context( MemoryAccount* outer )
+{
+	MemoryContext context;
+
+	context = AllocSetContextCreate( CurrentMemoryContext,
+										"Index Adviser",
+										ALLOCSET_DEFAULT_MINSIZE,
+										ALLOCSET_DEFAULT_INITSIZE,
+										ALLOCSET_DEFAULT_MAXSIZE );
+
+	if( allocSetMethods == NULL )
+	{
+		allocSetMethods = context->methods;
+
+		countingMethods			= *allocSetMethods;
+		countingMethods.alloc	= counting_alloc;
+		countingMethods.free_p	= counting_free;
+		countingMethods.realloc	= counting_realloc;
+		countingMethods.reset	= counting_reset;
+	}
+
+	/*
+	 * Only the chunks of this context are counted; the contexts created under
+	 * it, like the planner's, are plain AllocSets.
+	 */
+	context->methods = &countingMethods;
+
+	*outer = adviserMemory;
+
+	MemSet( &adviserMemory, 0, sizeof(adviserMemory) );
+
+	return context;
+}
+
+/**
+ * delete_adviser_context
+ *		deletes the context create_adviser_context() returned, and resumes the
+ * count of the context it was created in, if any.
+ */
+static void
+delete_adviser_context( MemoryContext context, const MemoryAccount* outer )
+{
+	MemoryContextDelete( context );
+
+	adviserMemory = *outer;
+}
+
+static void
+count_chunk( Size added, Size removed )
+{
+	Assert( removed <= adviserMemory.current );
+
+	adviserMemory.current	-= removed;
+	adviserMemory.current	+= added;
+	adviserMemory.allocated	+= added;
+
+	if( adviserMemory.current > adviserMemory.peak )
+		adviserMemory.peak = adviserMemory.current;
+}
+
+static void*
+counting_alloc( MemoryContext context, Size size )
+{
+	void *pointer = allocSetMethods->alloc( context, size );
+
+	if( pointer != NULL )
+		count_chunk( allocSetMethods->get_chunk_space( context, pointer ), 0 );
+
+	return pointer;
+}
+
+static void
+counting_free( MemoryContext context, void* pointer )
+{
+	count_chunk( 0, allocSetMethods->get_chunk_space( context, pointer ) );
+
+	allocSetMethods->free_p( context, pointer );
+}
+
+static void*
+counting_realloc( MemoryContext context, void* pointer, Size size )
+{
+	Size	oldSpace = allocSetMethods->get_chunk_space( context, pointer );
+	void	*newPointer = allocSetMethods->realloc( context, pointer, size );
+
+	if( newPointer != NULL )
+		count_chunk( allocSetMethods->get_chunk_space( context, newPointer ),
+						oldSpace );
+
+	return newPointer;
+}
+
+static void
+counting_reset( MemoryContext context )
+{
+	allocSetMethods->reset( context );
+
+	adviserMemory.current = 0;
+}
+
+/* ------------------------------------------------------------------------
+ * implementations: index adviser
+ * ------------------------------------------------------------------------
+ */
+
+/* PG calls this func when loading the plugin */
+void
+_PG_init(void)
+{
+	DefineCustomIntVariable( "index_adviser.statement_weight",
+							"Number of times the advised statement occurs in "
+								"the workload.",
+							"The benefit of the advice generated for a "
+								"statement is multiplied by this weight.",
+							&statement_weight,
+							1, INT_MAX,
+							PGC_USERSET,
+							NULL, NULL );
+
+	DefineCustomStringVariable( "index_adviser.assume_indexes",
+							"Indexes assumed to exist while advising.",
+							"A list of reloid(attnum,...) entries separated by"
+								" semicolons; advice is generated relative to"
+								" this hypothetical configuration.",
+							&assume_indexes,
+							PGC_USERSET,
+							NULL, NULL );
+
+	DefineCustomStringVariable( "index_adviser.hide_indexes",
+							"Existing indexes assumed not to exist while"
+								" advising.",
+							"A comma separated list of index names; advice is"
+								" generated relative to a configuration"
+								" without these indexes.",
+							&hide_indexes,
+							PGC_USERSET,
+							NULL, NULL );
+
+	DefineCustomBoolVariable( "index_adviser.use_hot_statistics",
+							"Record the observed HOT update ratio of tables"
+								" that are updated.",
+							NULL,
+							&use_hot_statistics,
+							PGC_USERSET,
+							NULL, NULL );
+
+	DefineCustomIntVariable( "index_adviser.param_samples",
+							"Number of samples of parameter values to advise"
+								" a parameterized statement for.",
+							"The statement is also advised for its generic"
+								" plan, and for these many most common values"
+								" of the columns its parameters are compared"
+								" to.",
+							&param_samples,
+							0, IND_ADV_MAX_PARAM_SAMPLES - 2,
+							PGC_USERSET,
+							NULL, NULL );
+
+	DefineCustomBoolVariable( "index_adviser.foreign_key_candidates",
+							"Consider indexes on the referencing columns of"
+								" foreign keys.",
+							NULL,
+							&foreign_key_candidates,
+							PGC_USERSET,
+							NULL, NULL );
+
+	DefineCustomBoolVariable( "index_adviser.track_index_usage",
+							"Record which existing indexes the plans use.",
+							"Also re-plans each statement without the unused"
+								" indexes and without each redundant one, to"
+								" find the indexes that can be dropped.",
+							&track_index_usage,
+							PGC_USERSET,
+							NULL, NULL );
+
+	DefineCustomStringVariable( "index_adviser.benefit_attribution",
+							"How the cost saved by a plan is split among the"
+								" indexes it uses.",
+							"One of size, leave_one_out or plan.",
+							&benefit_attribution,
+							PGC_USERSET,
+							NULL, NULL );
+
+	DefineCustomIntVariable( "index_adviser.max_attribution_replans",
+							"Most re-plans to attribute the benefit of a plan"
+								" with leave_one_out.",
+							NULL,
+							&max_attribution_replans,
+							0, INT_MAX,
+							PGC_USERSET,
+							NULL, NULL );
+
+	DefineCustomBoolVariable( "index_adviser.prune_by_plan",
+							"Advise only on tables the actual plan reads in"
+								" full, filters or sorts.",
+							NULL,
+							&prune_by_plan,
+							PGC_USERSET,
+							NULL, NULL );
+
+	DefineCustomRealVariable( "index_adviser.min_relation_cost_share",
+							"Least share of the plan's cost a table must take"
+								" to be advised, with prune_by_plan.",
+							NULL,
+							&min_relation_cost_share,
+							0, 1,
+							PGC_USERSET,
+							NULL, NULL );
+
+	DefineCustomRealVariable( "index_adviser.max_selectivity",
+							"Drop single-column candidates whose clauses select"
+								" more than this fraction of the table.",
+							"Estimated from pg_statistic; for a parameter, the"
+								" most selective value counts. 1 keeps all"
+								" candidates.",
+							&max_selectivity,
+							0, 1,
+							PGC_USERSET,
+							NULL, NULL );
+
+	DefineCustomIntVariable( "index_adviser.max_candidates_per_plan",
+							"Most candidates the planner sees at a time.",
+							"More candidates are planned with in batches, and"
+								" the final plan sees only those the batches"
+								" used. 0 means no limit.",
+							&max_candidates_per_plan,
+							0, INT_MAX,
+							PGC_USERSET,
+							NULL, NULL );
+
+	DefineCustomBoolVariable( "index_adviser.fast_replan",
+							"Re-plan with the join order of the actual plan.",
+							"Saves searching the join orders again; the"
+								" benefit of indexes that would pay off only"
+								" with another join order is missed.",
+							&fast_replan,
+							PGC_USERSET,
+							NULL, NULL );
+
+	DefineCustomIntVariable( "index_adviser.time_budget",
+							"Milliseconds the adviser may spend on a statement.",
+							"A statement that takes longer gets no advice. 0"
+								" means no limit.",
+							&time_budget,
+							0, INT_MAX,
+							PGC_USERSET,
+							NULL, NULL );
+
+	DefineCustomIntVariable( "index_adviser.max_candidates",
+							"Most index candidates the adviser evaluates for a"
+								" statement.",
+							"A statement with more gets no advice. 0 means no"
+								" limit.",
+							&max_candidates,
+							0, INT_MAX,
+							PGC_USERSET,
+							NULL, NULL );
+
+	DefineCustomIntVariable( "index_adviser.max_replans",
+							"Most re-plans the adviser makes for a statement.",
+							"A statement that needs more gets no advice. 0"
+								" means no limit.",
+							&max_replans,
+							0, INT_MAX,
+							PGC_USERSET,
+							NULL, NULL );
+
+	DefineCustomIntVariable( "index_adviser.max_memory",
+							"Kilobytes of memory the adviser may use for a"
+								" statement.",
+							"A statement that needs more gets no advice. 0"
+								" means no limit.",
+							&max_memory,
+							0, INT_MAX,
+							PGC_USERSET,
+							NULL, NULL );
+
+	DefineCustomIntVariable( "index_adviser.benefit_half_life",
+							"Seconds it takes the summarized benefit of an"
+								" index to decay to half.",
+							"The benefit of the advice is added to "
+								IND_ADV_SUMMARY_TABL" and "IND_ADV_HOURLY_TABL
+								" as it is saved. 0 does not keep them.",
+							&benefit_half_life,
+							0, INT_MAX,
+							PGC_USERSET,
+							NULL, NULL );
+
+	DefineCustomRealVariable( "index_adviser.min_cost",
+							"Do not advise statements cheaper than this.",
+							"Statements whose plan costs less are not looked"
+								" for index candidates, nor re-planned.",
+							&min_cost,
+							0, DBL_MAX,
+							PGC_USERSET,
+							NULL, NULL );
+
+	EmitWarningsOnPlaceholders( "index_adviser" );
+
+	prev_planner_hook					= planner_hook;
+	prev_ExplainOneQuery_hook			= ExplainOneQuery_hook;
+	prev_get_relation_info_hook			= get_relation_info_hook;
+	prev_explain_get_index_name_hook	= explain_get_index_name_hook;
+	prev_join_search_hook				= join_search_hook;
+
+	planner_hook				= planner_callback;
+	ExplainOneQuery_hook		= ExplainOneQuery_callback;
+	get_relation_info_hook		= get_relation_info_callback;
+	explain_get_index_name_hook	= explain_get_index_name_callback;
+	join_search_hook			= join_search_callback;
+
+	/* DDL on a table, like creating the index advised, voids the cache */
+	CacheRegisterRelcacheCallback( advised_statements_callback, (Datum)0 );
+
+	/*
+	 * The space for the shared statistics can be reserved only while the
+	 * postmaster starts, that is, if we are in shared_preload_libraries.
+	 */
+	if( !IsUnderPostmaster )
+	{
+		RequestAddinShmemSpace( MAXALIGN( sizeof(AdviserStats) ) );
+		RequestAddinLWLocks( 1 );
+
+		statsRequested = true;
+	}
+
+	/* We dont need to reset the state here since the contrib module has just been
+	 * loaded; FIXME: consider removing this call.
+	 */
+	resetSecondaryHooks();
+
+//	elog( NOTICE, "IND ADV: plugin loaded" );
+}
+
+/* PG calls this func when un-loading the plugin (if ever) */
+void
+_PG_fini(void)
+{
+	planner_hook				= prev_planner_hook;
+	ExplainOneQuery_hook		= prev_ExplainOneQuery_hook;
+	get_relation_info_hook		= prev_get_relation_info_hook;
+	explain_get_index_name_hook	= prev_explain_get_index_name_hook;
+	join_search_hook			= prev_join_search_hook;
+
+	resetSecondaryHooks();
+
+	elog( NOTICE, "IND ADV: plugin unloaded." );
+}
+
+/**
+ * index_adviser_stats
+ *		returns the shared statistics of the adviser's activity as one row; the
+ * times are in milliseconds, and the memory in bytes. See
+ * pg_stat_index_adviser.
+ */
+Datum
+index_adviser_stats(PG_FUNCTION_ARGS)
+{
+	TupleDesc		tupdesc;
+	AdviserCounters	counters;
+	TimestampTz		stats_reset;
+	Datum			values[IND_ADV_STATS_COLUMNS];
+	bool			nulls[IND_ADV_STATS_COLUMNS];
+	Datum			buckets[IND_ADV_STATS_BUCKETS];
+	const int64*	counter = (const int64*)&counters;
+	int				col = 0;
+	int				i;
+
+	if( get_call_result_type( fcinfo, NULL, &tupdesc ) != TYPEFUNC_COMPOSITE
+		|| tupdesc->natts != IND_ADV_STATS_COLUMNS )
+		elog( ERROR, "IND ADV: index_adviser_stats() is declared with a wrong"
+						" result type" );
+
+	if( !stats_attach() )
+		ereport( ERROR,
+				(errcode( ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE ),
+				errmsg( "Index Adviser statistics are not available" ),
+				errhint( "Load the Index Adviser thru"
+							" shared_preload_libraries." )) );
+
+	/* this backend's own counts too */
+	stats_flush();
+
+	LWLockAcquire( adviserStats->lock, LW_SHARED );
+
+	counters	= adviserStats->counters;
+	stats_reset	= adviserStats->stats_reset;
+
+	LWLockRelease( adviserStats->lock );
+
+	for( i = 0; i < IND_ADV_STATS_COUNTERS; ++i )
+		values[col++] = Int64GetDatum( counter[i] );
+
+	for( i = 0; i < IND_ADV_STATS_PHASES; ++i )
+		values[col++] = Float8GetDatum( counters.usec[i] / 1000.0 );
+
+	for( i = 0; i < IND_ADV_STATS_PHASES; ++i )
+		values[col++] = Int64GetDatum( counters.bytes[i] );
+
+	for( i = 0; i < IND_ADV_STATS_BUCKETS; ++i )
+		buckets[i] = Int64GetDatum( counters.histogram[i] );
+
+	values[col++] = PointerGetDatum( construct_array( buckets,
+													IND_ADV_STATS_BUCKETS,
+													INT8OID, sizeof(int64),
+													false, 'd' ) );
+
+	values[col++] = TimestampTzGetDatum( stats_reset );
+
+	MemSet( nulls, false, sizeof(nulls) );
+
+	tupdesc = BlessTupleDesc( tupdesc );
+
+	PG_RETURN_DATUM( HeapTupleGetDatum( heap_form_tuple( tupdesc, values,
+															nulls ) ) );
+}
+
+/**
+ * index_adviser_stats_reset
+ *		zeroes the shared statistics.
+ */
+Datum
+index_adviser_stats_reset(PG_FUNCTION_ARGS)
+{
+	if( !stats_attach() )
+		ereport( ERROR,
+				(errcode( ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE ),
+				errmsg( "Index Adviser statistics are not available" ),
+				errhint( "Load the Index Adviser thru"
+							" shared_preload_libraries." )) );
+
+	LWLockAcquire( adviserStats->lock, LW_EXCLUSIVE );
+
+	MemSet( &adviserStats->counters, 0, sizeof(AdviserCounters) );
+	adviserStats->ntop = 0;
+	adviserStats->stats_reset = GetCurrentTimestamp();
+
+	LWLockRelease( adviserStats->lock );
+
+	/* and what this backend has counted but not added yet */
+	MemSet( &pendingStats, 0, sizeof(pendingStats) );
+	MemSet( &pendingMemory, 0, sizeof(pendingMemory) );
+
+	PG_RETURN_VOID();
+}
+
+/**
+ * index_adviser_memory_top
+ *		returns the statements that needed the most memory to be advised, the
+ * hungriest first. See pg_stat_index_adviser_memory.
+ */
+Datum
+index_adviser_memory_top(PG_FUNCTION_ARGS)
+{
+	FuncCallContext			*funcctx;
+	MemoryHungryStatement	*top;
+	MemoryHungryStatement	*entry;
+	Datum					values[IND_ADV_TOP_COLUMNS];
+	bool					nulls[IND_ADV_TOP_COLUMNS];
+	HeapTuple				tuple;
+
+	if( SRF_IS_FIRSTCALL() )
+	{
+		MemoryContext	oldContext;
+		TupleDesc		tupdesc;
+		int				ntop;
+		int				i;
+		int				j;
+
+		funcctx = SRF_FIRSTCALL_INIT();
+
+		oldContext = MemoryContextSwitchTo( funcctx->multi_call_memory_ctx );
+
+		if( get_call_result_type( fcinfo, NULL, &tupdesc ) != TYPEFUNC_COMPOSITE
+			|| tupdesc->natts != IND_ADV_TOP_COLUMNS )
+			elog( ERROR, "IND ADV: index_adviser_memory_top() is declared with"
+							" a wrong result type" );
+
+		if( !stats_attach() )
+			ereport( ERROR,
+					(errcode( ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE ),
+					errmsg( "Index Adviser statistics are not available" ),
+					errhint( "Load the Index Adviser thru"
+								" shared_preload_libraries." )) );
+
+		funcctx->tuple_desc = BlessTupleDesc( tupdesc );
+
+		/* this backend's own statements too */
+		stats_flush();
+
+		/* a copy, so that the lock is not held across calls */
+		top = (MemoryHungryStatement*)palloc( sizeof(adviserStats->top) );
+
+		LWLockAcquire( adviserStats->lock, LW_SHARED );
+
+		ntop = adviserStats->ntop;
+		memcpy( top, adviserStats->top, ntop * sizeof(MemoryHungryStatement) );
+
+		LWLockRelease( adviserStats->lock );
+
+		/* the hungriest first; there are just a few */
+		for( i = 1; i < ntop; ++i )
+			for( j = i; j > 0 && top[j-1].peak_bytes < top[j].peak_bytes; --j )
+			{
+				MemoryHungryStatement tmp = top[j];
+
+				top[j]		= top[j-1];
+				top[j-1]	= tmp;
+			}
+
+		funcctx->user_fctx	= top;
+		funcctx->max_calls	= ntop;
+
+		MemoryContextSwitchTo( oldContext );
+	}
+
+	funcctx = SRF_PERCALL_SETUP();
+
+	if( funcctx->call_cntr >= funcctx->max_calls )
+		SRF_RETURN_DONE( funcctx );
+
+	top		= (MemoryHungryStatement*)funcctx->user_fctx;
+	entry	= &top[ funcctx->call_cntr ];
+
+	values[0] = Int64GetDatum( (int64)entry->fingerprint );
+	values[1] = Int64GetDatum( entry->peak_bytes );
+	values[2] = Int64GetDatum( entry->allocated_bytes );
+	values[3] = TimestampTzGetDatum( entry->when );
+	values[4] = CStringGetTextDatum( entry->query );
+
+	MemSet( nulls, false, sizeof(nulls) );
+
+	tuple = heap_form_tuple( funcctx->tuple_desc, values, nulls );
+
+	SRF_RETURN_NEXT( funcctx, HeapTupleGetDatum( tuple ) );
+}
+
+/* Make sure that Cost datatype can represent negative values */
+compile_assert( ((Cost)-1) < 0 );
+
+/* stats_flush() adds up the counters as an array */
+compile_assert( sizeof(AdviserCounters) % sizeof(int64) == 0 );
+
+/* As of now the order-by and group-by clauses use the same C-struct.
+ * A rudimentary check to confirm this:
+ */
+compile_assert( sizeof(*((Query*)NULL)->groupClause) == sizeof(*((Query*)NULL)->sortClause) );
+
+/**
+ * index_adviser
+ *		Takes a query and the actual plan generated by the standard planner for
+ * that query. It then creates virtual indexes, using the columns used in the
+ * query, and asks the standard planner to generate a new plan for the query.
+ *
+ *     If the new plan appears to be cheaper than the actual plan, it
+ * saves the information about the virtual indexes that were used by the
+ * planner in an advisory table.
+ *
+ *     If it is called by the Explain-hook, then it returns the newly generated
+ * plan (allocated in caller's memory context), so that ExplainOnePlan() can
+ * generate and send a string representation of the plan to the log or the client.
+ */
+
+/* TODO: Make recursion suppression more bullet-proof. ERRORs can leave this indicator on. */
+static int8	SuppressRecursion = 0;		  /* suppress recursive calls */
+
+static PlannedStmt*
+index_adviser(	Query*			queryCopy,
+				int				cursorOptions,
+				ParamListInfo	boundParams,
+				PlannedStmt		*actual_plan,
+				uint64			fingerprint,
+				bool			doingExplain)
+{
 	bool		saveCandidates = false;
+	bool		showConfig;		/* EXPLAIN shows the what-if configuration */
+	int			ncands = 0;		/* candidates that are not assumed */
 	int			i;
 	ListCell	*prev,							/* temps for list manipulation*/
 				*cell,
 				*next;
 	List*       opnos = NIL;			  /* contains all vailid operator-ids */
 	List*		candidates = NIL;				  /* the resulting candidates */
+	List*		assumed = NIL;	 /* the configuration assumed to exist */
+	List*		existingIndexes = NIL;	/* usage of the existing indexes */
+	List*		paramSamples = NIL;	/* other values of the parameters */
+	List*		relationAccesses = NIL;	/* how the actual plan reads tables */
+	Query*		replanQuery = NULL;	/* an unplanned copy, for more re-plans */
+	char		sampleKinds[IND_ADV_MAX_PARAM_SAMPLES + 1] = "";
+	WriteProfile*	writeProfile;	  /* what a DML statement writes */
 
 	Timer		tAdviser;
 	Timer		tRePlan;
@@ -326,24 +1586,31 @@ index_adviser(	Query*			queryCopy,
 	Timer		tCreateVInds;
 	Timer		tDropVInds;
 	Timer		tSaveAdvise;
+	Timer		tExistingInds;
+	Timer		tParamSamples;
+	Timer		tAttribution;
 
 	Cost		actualStartupCost;
 	Cost		actualTotalCost;
-	Cost		newStartupCost;
-	Cost		newTotalCost;
-	Cost		startupCostSaved;
-	Cost		totalCostSaved;
-	float4		startupGainPerc;							/* in percentages */
-	float4		totalGainPerc;
+	Cost		newStartupCost = 0;
+	Cost		newTotalCost = 0;
+	Cost		startupCostSaved = 0;
+	Cost		totalCostSaved = 0;
+	float4		startupGainPerc = 0;						/* in percentages */
+	float4		totalGainPerc = 0;
 
 	ResourceOwner	oldResourceOwner;
 	PlannedStmt		*new_plan;
+	PlannedStmt		*base_plan;		/* the plan new_plan is compared to */
 	MemoryContext	outerContext;
 
 	char *BTreeOps[] = { "=", "<", ">", "<=", ">=", };
 
 	elog( DEBUG3, "IND ADV: Entering" );
 
+	/* Remember the memory context; we use it to pass interesting data back. */
+	outerContext = CurrentMemoryContext;
+
 	/* We work only in Normal Mode, and non-recursively; that is, we do not work
 	 * on our own DML.
 	 */
@@ -353,20 +1620,112 @@ index_adviser(	Query*			queryCopy,
 		goto DoneCleanly;
 	}
 
-	/* Remember the memory context; we use it to pass interesting data back. */
-	outerContext = CurrentMemoryContext;
+	/* the caller frees all we allocate, by deleting this context */
+	if( adviserContext != NULL )
+		MemoryContextSwitchTo( adviserContext );
+
+	/* a phase that is skipped takes no time */
+	t_reset( &tAdviser );
+	t_reset( &tRePlan );
+	t_reset( &tBTreeOperators );
+	t_reset( &tGenCands );
+	t_reset( &tMarkUsedCands );
+	t_reset( &tCreateVInds );
+	t_reset( &tDropVInds );
+	t_reset( &tSaveAdvise );
+	t_reset( &tExistingInds );
+	t_reset( &tParamSamples );
+	t_reset( &tAttribution );
 
 	/* reset these globals; since an ERROR might have left them unclean */
 	t_reset( &tLogCandidates );
 	index_candidates = NIL;
+	hidden_index_oids = NIL;
+
+	/* the clock starts now */
+	start_budget();
+
+	PG_TRACE2( index_adviser__start, fingerprint, doingExplain );
+
+	/*
+	 * Note what a DML statement writes before planning scribbles on it; this
+	 * is saved even if no candidates come out of it.
+	 */
+	writeProfile = get_write_profile( queryCopy, actual_plan );
 
 	/* save the start-time */
 	t_start( tAdviser );
 
+	/* see which of the existing indexes this statement could do without */
+	t_start( tExistingInds );
+	if( track_index_usage )
+		existingIndexes = analyse_existing_indexes( queryCopy, cursorOptions,
+													boundParams, actual_plan );
+	t_stop( tExistingInds );
+
+	if( budget_exceeded() )
+		goto DoneAdvising;
+
+	/* existing indexes left out of the hypothetical configuration */
+	if( hide_indexes != NULL && hide_indexes[0] != '\0' )
+	{
+		PG_TRY();
+		{
+			hidden_index_oids = parse_hidden_indexes( hide_indexes );
+		}
+		PG_CATCH();
+		{
+			--SuppressRecursion;
+
+			errhint( "Check the setting of index_adviser.hide_indexes." );
+
+			PG_RE_THROW();
+		}
+		PG_END_TRY();
+	}
+
+	/*
+	 * EXPLAIN shows the cost of the hypothetical configuration even if there
+	 * are no candidates to advise.
+	 */
+	showConfig = doingExplain
+					&& ( hidden_index_oids != NIL
+						|| ( assume_indexes != NULL
+							&& assume_indexes[0] != '\0' ) );
+
 	/* get the costs without any virtual index */
 	actualStartupCost	= actual_plan->planTree->startup_cost;
 	actualTotalCost		= actual_plan->planTree->total_cost;
 
+	/* a cheap statement is not worth the re-planning */
+	if( actualTotalCost < min_cost )
+	{
+		++pendingStats.skipped_cheap;
+		goto DoneAdvising;
+	}
+
+	/*
+	 * See which tables the actual plan accesses badly; not if some indexes are
+	 * hidden, since the actual plan may well be using them.
+	 */
+	if( prune_by_plan && hidden_index_oids == NIL )
+	{
+		ListCell	*acell;
+		bool		improvable = false;
+
+		relationAccesses = get_relation_accesses( actual_plan );
+
+		foreach( acell, relationAccesses )
+			improvable = improvable
+						|| ((RelationAccess*)lfirst( acell ))->improvable;
+
+		if( relationAccesses != NIL && !improvable )
+		{
+			++pendingStats.skipped_by_plan;
+			goto DoneAdvising;
+		}
+	}
+
 	/* create list containing all operators supported by B-tree */
 	t_start( tBTreeOperators );
 	for( i=0; i < lengthof(BTreeOps); ++i )
@@ -379,7 +1738,7 @@ index_adviser(	Query*			queryCopy,
 		 * get the operator-id's to the operator, and collect the operator-id's
 		 * into an array.
 		 */
-		/* TODO: find out if the memory of opnosResult is ever freed. */
+		/* the memory of opnosResult is freed with adviserContext */
 		for(	opnosResult = OpernameGetCandidates( btreeop, '\0' );
 				opnosResult != NULL;
 				opnosResult = lnext(opnosResult) )
@@ -395,27 +1754,90 @@ index_adviser(	Query*			queryCopy,
 
 	/* Generate index candidates */
 	t_start( tGenCands );
+	PG_TRACE1( index_adviser__scan__start, fingerprint );
 	candidates = scan_query( queryCopy, opnos, NULL );
+	PG_TRACE1( index_adviser__scan__done, list_length( candidates ) );
 	t_stop( tGenCands );
 
+	pendingStats.candidates_generated += list_length( candidates );
+
 	/* the list of operator oids isn't needed anymore */
 	list_free( opnos );
 
-	if (list_length(candidates) == 0)
-		goto DoneCleanly;
+	if( budget_exceeded() || ( candidates == NIL && !showConfig ) )
+		goto DoneAdvising;
 
 	log_candidates( "Generated candidates", candidates );
 
 	/* remove all irrelevant candidates */
+	PG_TRACE1( index_adviser__filter__start, list_length( candidates ) );
 	candidates = remove_irrelevant_candidates( candidates );
+	PG_TRACE1( index_adviser__filter__done, list_length( candidates ) );
 
-	if (list_length(candidates) == 0)
-		goto DoneCleanly;
+	if( relationAccesses != NIL )
+		candidates = prune_candidates_by_plan( candidates, relationAccesses,
+												actualTotalCost );
 
-	log_candidates( "Relevant candidates", candidates );
-#if CREATE_V_INDEXES
-	/*
-	 * We need to restore the resource-owner after RARCST(), only if we are
+	if( max_selectivity < 1 )
+		candidates = remove_unselective_candidates( candidates );
+
+	pendingStats.candidates_relevant += list_length( candidates );
+
+	ncands = list_length( candidates );
+
+	if( ncands == 0 && !showConfig )
+		goto DoneAdvising;
+
+	if( max_candidates > 0 && list_length( candidates ) > max_candidates )
+		budgetReason = 'c';
+
+	if( budget_exceeded() )
+		goto DoneAdvising;
+
+	log_candidates( "Relevant candidates", candidates );
+
+	/*
+	 * Add the assumed configuration; merge_candidates() keeps the assumed
+	 * entry when a candidate duplicates it.
+	 */
+	if( assume_indexes != NULL && assume_indexes[0] != '\0' )
+	{
+		assumed = parse_assumed_indexes( assume_indexes );
+
+		candidates = merge_candidates( assumed, candidates );
+
+		log_candidates( "Candidates with assumed indexes", candidates );
+
+		/* a candidate may have been an assumed index */
+		ncands = 0;
+
+		foreach( cell, candidates )
+			if( !((IndexCandidate*)lfirst( cell ))->assumed )
+				++ncands;
+	}
+
+	/*
+	 * A parameterized statement is also evaluated for other values of its
+	 * parameters; the samples, and the copy of the query they are planned
+	 * from, have to outlive the subtransaction below. Attributing the benefit
+	 * with leave_one_out re-plans that copy too.
+	 */
+	if( param_samples > 0 )
+		paramSamples = build_param_samples( queryCopy, boundParams,
+											sampleKinds );
+
+	benefitAttribution = parse_benefit_attribution( benefit_attribution );
+
+	if( paramSamples != NIL
+		|| benefitAttribution == IND_ADV_ATTRIBUTE_LEAVE_ONE_OUT )
+		replanQuery = copyObject( queryCopy );
+
+	/* the order of the tables in the actual plan, to re-plan fast */
+	if( fast_replan )
+		joinOrder = get_scan_order( actual_plan );
+#if CREATE_V_INDEXES
+	/*
+	 * We need to restore the resource-owner after RARCST(), only if we are
 	 * called from the executor; but we do it all the time because,
 	 * (1) Its difficult to determine if we are being called by the executor.
 	 * (2) It is harmless.
@@ -445,34 +1867,100 @@ index_adviser(	Query*			queryCopy,
 	 */
 	BeginInternalSubTransaction( "index_adviser" );
 
+	/*
+	 * The subtransaction switched to its own memory context; allocate in ours
+	 * still, so that it is accounted for. Nothing in it refers to what the
+	 * ROLLBACK undoes.
+	 */
+	if( adviserContext != NULL )
+		MemoryContextSwitchTo( adviserContext );
+
 	/* now create the virtual indexes */
 	t_start( tCreateVInds );
+	PG_TRACE1( index_adviser__create__start, list_length( candidates ) );
 	candidates = create_virtual_indexes( candidates );
+	PG_TRACE1( index_adviser__create__done, list_length( candidates ) );
 	t_stop( tCreateVInds );
 #endif
 	/* update the global var */
 	index_candidates = candidates;
 
+	if( budget_exceeded() )
+		goto AbandonReplanning;
+
 	/*
 	 * Setup the hook in the planner that injects information into base-tables
 	 * as they are prepared
 	 */
-	get_relation_info_hook = get_relation_info_callback;
+	relationInfoActive = true;
+
+	/* and, to re-plan fast, the one that joins them in the actual order */
+	if( fast_replan )
+		joinSearchActive	= true;
+
+	/*
+	 * If a configuration is assumed, the plan to compare against is the one
+	 * that has only the assumed indexes, and none of the hidden ones.
+	 * planner() scribbles on its input, so plan a copy of the query.
+	 */
+	base_plan = actual_plan;
+
+	if( ( assumed != NIL || hidden_index_oids != NIL ) && !budget_exceeded() )
+	{
+		PlannedStmt *assumed_plan;
+
+		foreach( cell, candidates )
+		{
+			IndexCandidate *cand = (IndexCandidate*)lfirst( cell );
+
+			cand->hidden = !cand->assumed;
+		}
+
+		t_start( tRePlan );
+		assumed_plan = adviser_planner( copyObject( queryCopy ),
+											cursorOptions, boundParams );
+		t_stop( tRePlan );
+
+		actualStartupCost	= assumed_plan->planTree->startup_cost;
+		actualTotalCost		= assumed_plan->planTree->total_cost;
+
+		configStartupCost	= actualStartupCost;
+		configTotalCost		= actualTotalCost;
+
+		base_plan = assumed_plan;
+
+		foreach( cell, candidates )
+			((IndexCandidate*)lfirst( cell ))->hidden = false;
+	}
+
+	/* nothing to advise; EXPLAIN wanted only the cost of the configuration */
+	if( ncands == 0 )
+	{
+		new_plan = NULL;
+		goto AbandonReplanning;
+	}
+
+	/* too many candidates at once make the planner's search explode */
+	if( max_candidates_per_plan > 0 )
+	{
+		if( ncands > max_candidates_per_plan )
+		{
+			t_continue( tRePlan );
+			replan_in_batches( queryCopy, cursorOptions, boundParams,
+								candidates, base_plan );
+			t_stop( tRePlan );
+		}
+	}
+
+	if( budget_exceeded() )
+		goto AbandonReplanning;
 
 	/* do re-planning using virtual indexes */
 	/* TODO: is the plan ever freed? */
-	t_start( tRePlan );
-	new_plan = standard_planner(queryCopy, cursorOptions, boundParams);
+	t_continue( tRePlan );
+	new_plan = adviser_planner(queryCopy, cursorOptions, boundParams);
 	t_stop( tRePlan );
 
-	/* reset the hook */
-	get_relation_info_hook = NULL;
-#if CREATE_V_INDEXES
-	/* remove the virtual-indexes */
-	t_start( tDropVInds );
-	drop_virtual_indexes( candidates );
-	t_stop( tDropVInds );
-#endif
 	newStartupCost	= new_plan->planTree->startup_cost;
 	newTotalCost	= new_plan->planTree->total_cost;
 
@@ -495,12 +1983,51 @@ index_adviser(	Query*			queryCopy,
 		t_start( tMarkUsedCands );
 		plannedStmtGlobal = new_plan;
 
+		PG_TRACE1( index_adviser__mark__start, list_length( candidates ) );
 		mark_used_candidates( (Node*)new_plan->planTree, candidates );
+		PG_TRACE( index_adviser__mark__done );
 
 		plannedStmtGlobal = NULL;
 		t_stop( tMarkUsedCands );
 	}
 
+	/* calculate the share of cost saved by each index */
+	t_start( tAttribution );
+	split_benefit( replanQuery, cursorOptions, boundParams, candidates,
+					base_plan, new_plan );
+	t_stop( tAttribution );
+
+	/* the same, for other values of the parameters */
+	if( paramSamples != NIL )
+	{
+		t_start( tParamSamples );
+		evaluate_param_samples( replanQuery, cursorOptions, candidates,
+								paramSamples );
+		t_stop( tParamSamples );
+	}
+
+AbandonReplanning:
+	/* out of budget; whatever was found is incomplete, so none of it is advice */
+	if( budgetReason != '\0' )
+	{
+		foreach( cell, candidates )
+			((IndexCandidate*)lfirst( cell ))->idxused = false;
+
+		new_plan = NULL;
+	}
+
+	/* reset the hooks */
+	relationInfoActive	= false;
+	joinSearchActive	= false;
+	list_free( joinOrder );
+	joinOrder			= NIL;
+#if CREATE_V_INDEXES
+	/* remove the virtual-indexes */
+	t_start( tDropVInds );
+	drop_virtual_indexes( candidates );
+	t_stop( tDropVInds );
+#endif
+
 	/* Remove unused candidates from the list. */
 	for( prev = NULL, cell = list_head(candidates);
 			cell != NULL;
@@ -525,26 +2052,16 @@ index_adviser(	Query*			queryCopy,
 	/* log the candidates used by the planner */
 	log_candidates( "Used candidates", candidates );
 
-	if( list_length( candidates ) > 0 )
-		saveCandidates = true;
-
-	/* calculate the share of cost saved by each index */
-	if( saveCandidates )
-	{
-		int4 totalSize = 0;
-		IndexCandidate *cand;
-
-		foreach( cell, candidates )
-			totalSize += ((IndexCandidate*)lfirst( cell ))->pages;
-
-		foreach( cell, candidates )
+	/*
+	 * The assumed indexes are kept in the list for EXPLAIN's sake, but are not
+	 * advice.
+	 */
+	foreach( cell, candidates )
+		if( !((IndexCandidate*)lfirst( cell ))->assumed )
 		{
-			cand = (IndexCandidate*)lfirst( cell );
-
-			cand->benefit = (float4)totalCostSaved
-							* ((float4)cand->pages/totalSize);
+			saveCandidates = true;
+			++pendingStats.candidates_used;
 		}
-	}
 
 	/* Print the new plan if debugging. */
 	if( saveCandidates && Debug_print_plan )
@@ -562,7 +2079,7 @@ index_adviser(	Query*			queryCopy,
 	}
 	else
 	{
-		/* TODO: try to free the new plan node */
+		/* the new plan node is freed with adviserContext */
 		new_plan = NULL;
 	}
 #if CREATE_V_INDEXES
@@ -576,6 +2093,13 @@ index_adviser(	Query*			queryCopy,
 	 */
 	RollbackAndReleaseCurrentSubTransaction();
 
+	/*
+	 * The ROLLBACK left us in the parent transaction's context; what is
+	 * allocated from here on, the saved advice included, goes in ours again.
+	 */
+	MemoryContextSwitchTo( adviserContext != NULL ? adviserContext
+												: outerContext );
+
 	/* restore the resource-owner */
 	CurrentResourceOwner = oldResourceOwner;
 
@@ -590,7 +2114,15 @@ index_adviser(	Query*			queryCopy,
 		/* catch any ERROR */
 		PG_TRY();
 		{
-			save_advice(candidates);
+			PG_TRACE2( index_adviser__save__start, fingerprint,
+						list_length( candidates ) );
+			save_advice( candidates, fingerprint, sampleKinds );
+
+			/* what-if advice is not the workload's */
+			if( benefit_half_life > 0 && !doingExplain
+				&& !hypothetical_configuration() )
+				save_advice_summary( fingerprint, statement_weight );
+			PG_TRACE1( index_adviser__save__done, fingerprint );
 		}
 		PG_CATCH();
 		{
@@ -658,8 +2190,152 @@ index_adviser(	Query*			queryCopy,
 					(  saveCandidates == true ) ? tSaveAdvise.usec : 0 );
 	elog( DEBUG2, "IND ADV: [Prof] |-- log_candidates       : %10lu usec",
 					tLogCandidates.usec );
+	elog( DEBUG2, "IND ADV: [Prof] |-- existingIndexes      : %10lu usec",
+					tExistingInds.usec );
+	elog( DEBUG2, "IND ADV: [Prof] |-- paramSamples         : %10lu usec",
+					paramSamples != NIL ? tParamSamples.usec : 0 );
+	elog( DEBUG2, "IND ADV: [Prof] |-- attribution          : %10lu usec",
+					tAttribution.usec );
+	elog( DEBUG2, "IND ADV: [Prof] * memory allocated       : %10lu bytes",
+					(unsigned long)adviserMemory.allocated );
+	elog( DEBUG2, "IND ADV: [Prof] * memory at peak         : %10lu bytes",
+					(unsigned long)adviserMemory.peak );
+
+DoneAdvising:
+	/* a DML statement makes maintaining indexes on its table more expensive */
+	if( writeProfile != NULL )
+	{
+		PG_TRY();
+		{
+			save_write_profile( writeProfile, fingerprint );
+		}
+		PG_CATCH();
+		{
+			--SuppressRecursion;
+
+			errdetail( IND_ADV_ERROR_DETAIL );
+			errhint( IND_ADV_ERROR_HINT );
+
+			PG_RE_THROW();
+		}
+		PG_END_TRY();
+
+		list_free( writeProfile->updated_attrs );
+		pfree( writeProfile );
+	}
+
+	if( existingIndexes != NIL )
+	{
+		PG_TRY();
+		{
+			save_index_usage( existingIndexes, fingerprint );
+		}
+		PG_CATCH();
+		{
+			--SuppressRecursion;
+
+			errdetail( IND_ADV_ERROR_DETAIL );
+			errhint( IND_ADV_ERROR_HINT );
+
+			PG_RE_THROW();
+		}
+		PG_END_TRY();
+
+		foreach( cell, existingIndexes )
+			pfree( (IndexCandidate*)lfirst( cell ) );
+
+		list_free( existingIndexes );
+	}
+
+	/* a statement given up on is recorded as such */
+	budgetActive = false;
+
+	if( budgetReason != '\0' )
+	{
+		PG_TRY();
+		{
+			save_truncation( fingerprint );
+		}
+		PG_CATCH();
+		{
+			--SuppressRecursion;
+
+			errdetail( IND_ADV_ERROR_DETAIL );
+			errhint( IND_ADV_ERROR_HINT );
+
+			PG_RE_THROW();
+		}
+		PG_END_TRY();
+	}
+
+	list_free_deep( relationAccesses );
+
+	/* remember the statement, so that its next occurrence is not re-planned */
+	remember_advised_statement( fingerprint,
+								saveCandidates || writeProfile != NULL
+								|| existingIndexes != NIL
+								|| budgetReason != '\0' );
+
+	PG_TRACE3( index_adviser__done, fingerprint, saveCandidates, budgetReason );
+
+	/* count the statement in the shared statistics */
+	t_stop( tAdviser );
+
+	if( saveCandidates )
+		++pendingStats.advised;
+
+	switch( budgetReason )
+	{
+		case 't': ++pendingStats.truncated_time;		break;
+		case 'c': ++pendingStats.truncated_candidates;	break;
+		case 'r': ++pendingStats.truncated_replans;		break;
+		case 'm': ++pendingStats.truncated_memory;		break;
+	}
+
+	pendingStats.replans += budgetReplans;
+
+	pendingStats.usec[IND_ADV_PHASE_TOTAL]		+= tAdviser.usec;
+	pendingStats.usec[IND_ADV_PHASE_EXISTING]	+= tExistingInds.usec;
+	pendingStats.usec[IND_ADV_PHASE_SCAN]		+= tGenCands.usec;
+	pendingStats.usec[IND_ADV_PHASE_CREATE]		+= tCreateVInds.usec;
+	pendingStats.usec[IND_ADV_PHASE_REPLAN]		+= tRePlan.usec;
+	pendingStats.usec[IND_ADV_PHASE_MARK]		+= tMarkUsedCands.usec;
+	pendingStats.usec[IND_ADV_PHASE_ATTRIBUTE]	+= tAttribution.usec;
+	pendingStats.usec[IND_ADV_PHASE_SAMPLES]	+= tParamSamples.usec;
+	pendingStats.usec[IND_ADV_PHASE_SAVE]		+= tSaveAdvise.usec;
+
+	pendingStats.bytes[IND_ADV_PHASE_TOTAL]		+= tAdviser.bytes;
+	pendingStats.bytes[IND_ADV_PHASE_EXISTING]	+= tExistingInds.bytes;
+	pendingStats.bytes[IND_ADV_PHASE_SCAN]		+= tGenCands.bytes;
+	pendingStats.bytes[IND_ADV_PHASE_CREATE]	+= tCreateVInds.bytes;
+	pendingStats.bytes[IND_ADV_PHASE_REPLAN]	+= tRePlan.bytes;
+	pendingStats.bytes[IND_ADV_PHASE_MARK]		+= tMarkUsedCands.bytes;
+	pendingStats.bytes[IND_ADV_PHASE_ATTRIBUTE]	+= tAttribution.bytes;
+	pendingStats.bytes[IND_ADV_PHASE_SAMPLES]	+= tParamSamples.bytes;
+	pendingStats.bytes[IND_ADV_PHASE_SAVE]		+= tSaveAdvise.bytes;
+
+	for( i = 0; i < IND_ADV_STATS_BUCKETS - 1
+				&& tAdviser.usec / 1000 >= (unsigned long)statsBuckets[i]; ++i )
+		;
+	++pendingStats.histogram[i];
+
+	/* the statement may be one of the most memory-hungry ones */
+	if( adviserContext != NULL
+		&& (int64)adviserMemory.peak > pendingMemory.peak_bytes )
+	{
+		pendingMemory.fingerprint		= fingerprint;
+		pendingMemory.peak_bytes		= adviserMemory.peak;
+		pendingMemory.allocated_bytes	= adviserMemory.allocated;
+		pendingMemory.when				= GetCurrentTimestamp();
+
+		if( debug_query_string != NULL )
+			strlcpy( pendingMemory.query, debug_query_string,
+						sizeof(pendingMemory.query) );
+	}
 
 DoneCleanly:
+	MemoryContextSwitchTo( outerContext );
+
 	/* allow new calls to the index-adviser */
 	--SuppressRecursion;
 
@@ -672,9 +2348,9 @@ DoneCleanly:
  * This callback is registered immediately upon loading this plugin. It is
  * responsible for taking over control from the planner.
  *
- *     It calls the standard planner and sends the resulting plan to
- * index_adviser() for comparison with a plan generated after creating
- * hypothetical indexes.
+ *     It calls the previous planner hook, or the standard planner, and sends
+ * the resulting plan to index_adviser() for comparison with a plan generated
+ * after creating hypothetical indexes.
  */
 static PlannedStmt*
 planner_callback(	Query*			query,
@@ -684,26 +2360,70 @@ planner_callback(	Query*			query,
 	Query	*queryCopy;
 	PlannedStmt *actual_plan;
 	PlannedStmt *new_plan;
+	uint64	fingerprint;
+	MemoryContext context;
+	MemoryContext oldContext;
+	MemoryAccount outerMemory;
 
 	resetSecondaryHooks();
 
-	/* TODO : try to avoid making a copy if the index_adviser() is not going
-	 * to use it; Index Adviser may not use the query copy at all if we are
-	 * running in BootProcessing mode, or if the Index Adviser is being called
-	 * recursively.
+	/*
+	 * Copying the query costs about as much as planning it, so find out first
+	 * if the adviser is going to use the copy at all.
+	 */
+	if( !worth_advising( query ) )
+	{
+		PlannedStmt *plan;
+
+		stats_count_unadvised();
+
+		plan = adviser_planner( query, cursorOptions, boundParams );
+
+		if( explainedPlanActive && explainedPlan == NULL )
+			explainedPlan = plan;
+
+		return plan;
+	}
+
+	++pendingStats.calls;
+
+	/*
+	 * Identical statements are evaluated only once per session; a repeated
+	 * statement just counts its weight towards the advice saved for it.
 	 */
+	fingerprint = query_fingerprint( query );
+
+	if( count_advised_statement( fingerprint ) )
+	{
+		++pendingStats.skipped_repeated;
+		stats_flush_due();
+
+		return adviser_planner( query, cursorOptions, boundParams );
+	}
+
+	/* all the adviser allocates, beginning with the copy, goes away with it */
+	context = create_adviser_context( &outerMemory );
 
 	/* planner() scribbles on it's input, so make a copy of the query-tree */
+	oldContext = MemoryContextSwitchTo( context );
 	queryCopy = copyObject( query );
+	MemoryContextSwitchTo( oldContext );
 
-	/* Generate a plan using the standard planner */
-	actual_plan = standard_planner( query, cursorOptions, boundParams );
+	/* Generate a plan the way the backend would have */
+	actual_plan = adviser_planner( query, cursorOptions, boundParams );
 
 	/* send the actual plan for comparison with a hypothetical plan */
+	adviserContext = context;
+
 	new_plan = index_adviser( queryCopy, cursorOptions, boundParams,
-								actual_plan, false );
+								actual_plan, fingerprint, false );
+
+	adviserContext = NULL;
 
-	/* TODO: try to free the redundant new_plan */
+	stats_flush_due();
+
+	/* the copy of the query, and the redundant new_plan */
+	delete_adviser_context( context, &outerMemory );
 
 	return actual_plan;
 }
@@ -714,7 +2434,8 @@ planner_callback(	Query*			query,
  *
  *     It calls the standard planner and sends the resultant plan to
  * index_adviser() for comparison with a plan generated after creating
- * hypothetical indexes.
+ * hypothetical indexes. If another plugin had hooked ExplainOneQuery(), that
+ * hook produces the output of the actual plan.
  *
  *     If the index_adviser() finds the hypothetical plan to be beneficial
  * than the real plan, it returns the hypothetical plan's copy so that this
@@ -730,21 +2451,116 @@ ExplainOneQuery_callback(	Query			*query,
 	Query		*queryCopy;
 	PlannedStmt	*actual_plan;
 	PlannedStmt	*new_plan;
-	ListCell	*cell;
+	uint64		fingerprint;
+	MemoryContext	context;
+	MemoryContext	oldContext;
+	MemoryAccount	outerMemory;
 
 	resetSecondaryHooks();
 
+	/* nothing to advise; explain it the usual way, without the copy */
+	if( !worth_advising( query ) )
+	{
+		stats_count_unadvised();
+
+		if( prev_ExplainOneQuery_hook )
+			prev_ExplainOneQuery_hook( query, stmt, queryString, params,
+										tstate );
+		else
+			ExplainOnePlan( adviser_planner( query, 0, params ), params, stmt,
+							tstate );
+
+		return;
+	}
+
+	/*
+	 * EXPLAIN always gets a full evaluation, even of a statement advised
+	 * before, since it has to show the new plan.
+	 */
+	fingerprint = query_fingerprint( query );
+
+	/* all the adviser allocates, beginning with the copy, goes away with it */
+	context = create_adviser_context( &outerMemory );
+
 	/* planner() scribbles on it's input, so make a copy of the query-tree */
+	oldContext = MemoryContextSwitchTo( context );
 	queryCopy = copyObject( query );
+	MemoryContextSwitchTo( oldContext );
+
+	if( prev_ExplainOneQuery_hook )
+	{
+		/*
+		 * Let the previous hook produce the output; the planning it does must
+		 * not be advised, as we advise the query below, but the plan it
+		 * explains is the one to compare against.
+		 */
+		++SuppressRecursion;
+		explainedPlanActive = true;
+		explainedPlan = NULL;
+
+		PG_TRY();
+		{
+			prev_ExplainOneQuery_hook( query, stmt, queryString, params,
+										tstate );
+		}
+		PG_CATCH();
+		{
+			--SuppressRecursion;
+			explainedPlanActive = false;
+			explainedPlan = NULL;
+
+			PG_RE_THROW();
+		}
+		PG_END_TRY();
+
+		--SuppressRecursion;
+		explainedPlanActive = false;
+
+		/*
+		 * A hook that plans without going thru planner() leaves us nothing to
+		 * compare against; only then is the query planned a second time.
+		 */
+		actual_plan = explainedPlan;
+		explainedPlan = NULL;
+
+		if( actual_plan == NULL )
+			actual_plan = adviser_planner( copyObject( queryCopy ), 0, params );
+	}
+	else
+	{
+		/* plan the query */
+		actual_plan = adviser_planner( query, 0, params );
+
+		/* run it (if needed) and produce output */
+		ExplainOnePlan( actual_plan, params, stmt, tstate );
+	}
+
+	/* re-plan the query; the adviser sets the cost of the configuration */
+	configStartupCost = configTotalCost = -1;
+
+	++pendingStats.calls;
 
-	/* plan the query */
-	actual_plan = standard_planner( query, 0, params );
+	adviserContext = context;
 
-	/* run it (if needed) and produce output */
-	ExplainOnePlan( actual_plan, params, stmt, tstate );
+	new_plan = index_adviser( queryCopy, 0, params, actual_plan, fingerprint,
+								true );
 
-	/* re-plan the query */
-	new_plan = index_adviser( queryCopy, 0, params, actual_plan, true );
+	adviserContext = NULL;
+
+	stats_flush_due();
+
+	/* the cost with only the assumed indexes, and without the hidden ones */
+	if( configTotalCost >= 0 )
+	{
+		char buf[128];
+
+		snprintf( buf, sizeof(buf),
+					"** Cost with hypothetical configuration: %.2f..%.2f **",
+					configStartupCost, configTotalCost );
+
+		do_text_output_oneline(tstate, ""); /* separator line */
+		do_text_output_oneline(tstate, buf);
+	}
 
 	if ( new_plan )
 	{
@@ -752,23 +2568,22 @@ ExplainOneQuery_callback(	Query			*query,
 
 		stmt->analyze = false;
 
-	    explain_get_index_name_hook = explain_get_index_name_callback;
+	    indexNameActive = true;
 
 		do_text_output_oneline(tstate, ""); /* separator line */
 		do_text_output_oneline(tstate, "** Plan with hypothetical indexes **");
 		ExplainOnePlan( new_plan, params, stmt, tstate );
 
-	    explain_get_index_name_hook = NULL;
+	    indexNameActive = false;
 
 	    stmt->analyze = analyze;
 	}
 
-	/* The candidates might not have been destroyed by the Index Adviser, do it
-	 * now. FIXME: this block belongs inside the 'if ( new_plan )' block above. */
-	foreach( cell, index_candidates )
-		pfree( (IndexCandidate*)lfirst( cell ) );
-
-	list_free( index_candidates );
+	/*
+	 * The candidates might not have been destroyed by the Index Adviser; they
+	 * go with the rest of what it allocated.
+	 */
+	delete_adviser_context( context, &outerMemory );
 
 	index_candidates = NIL;
 
@@ -792,12 +2607,32 @@ get_relation_info_callback(	PlannerInfo	*root,
 {
 #if CREATE_V_INDEXES
 	ListCell *cell1;
+	ListCell *prev;
+	ListCell *next;
 	IndexCandidate *cand;
 
-	foreach( cell1, rel->indexlist )
+	if( prev_get_relation_info_hook )
+		prev_get_relation_info_hook( root, relationObjectId, inhparent, rel );
+
+	/* nothing to do unless the adviser is re-planning */
+	if( !relationInfoActive )
+		return;
+
+	for( prev = NULL, cell1 = list_head( rel->indexlist );
+			cell1 != NULL;
+			cell1 = next )
 	{
 		IndexOptInfo *info = (IndexOptInfo*)lfirst( cell1 );
 
+		next = lnext( cell1 );
+
+		/* an existing index is hidden to see what planning without it costs */
+		if( list_member_oid( hidden_index_oids, info->indexoid ) )
+		{
+			rel->indexlist = list_delete_cell( rel->indexlist, cell1, prev );
+			continue;
+		}
+
 		/* We call estimate_index_pages() here, instead of immediately after
 		 * index_create() API call, since rel has been run through
 		 * estimate_rel_size() by the caller!
@@ -805,11 +2640,20 @@ get_relation_info_callback(	PlannerInfo	*root,
 
 		if( is_virtual_index( info->indexoid, &cand ) )
 		{
+			/* a hidden index is not offered to the planner at all */
+			if( cand->hidden || cand->excluded )
+			{
+				rel->indexlist = list_delete_cell( rel->indexlist, cell1, prev );
+				continue;
+			}
+
 			/* estimate the size */
 			cand->pages = estimate_index_pages(cand->reloid, cand->idxoid);
 
 			info->pages = cand->pages;
 		}
+
+		prev = cell1;
 	}
 #else
 	/* This needs implimentation */
@@ -891,95 +2735,2450 @@ get_relation_info_callback(	PlannerInfo	*root,
 			info->nulls_first[i] = (opt & INDOPTION_NULLS_FIRST) != 0;
 		}
 
-		/*
-		 * Fetch the index expressions and predicate, if any.  We must
-		 * modify the copies we obtain from the relcache to have the
-		 * correct varno for the parent relation, so that they match up
-		 * correctly against qual clauses.
-		 */
-		info->indexprs = RelationGetIndexExpressions(indexRelation);
-		info->indpred = RelationGetIndexPredicate(indexRelation);
-		if (info->indexprs && varno != 1)
-			ChangeVarNodes((Node *) info->indexprs, 1, varno, 0);
-		if (info->indpred && varno != 1)
-			ChangeVarNodes((Node *) info->indpred, 1, varno, 0);
-		info->predOK = false;		/* set later in indxpath.c */
-		info->unique = false;
+		/*
+		 * Fetch the index expressions and predicate, if any.  We must
+		 * modify the copies we obtain from the relcache to have the
+		 * correct varno for the parent relation, so that they match up
+		 * correctly against qual clauses.
+		 */
+		info->indexprs = RelationGetIndexExpressions(indexRelation);
+		info->indpred = RelationGetIndexPredicate(indexRelation);
+		if (info->indexprs && varno != 1)
+			ChangeVarNodes((Node *) info->indexprs, 1, varno, 0);
+		if (info->indpred && varno != 1)
+			ChangeVarNodes((Node *) info->indpred, 1, varno, 0);
+		info->predOK = false;		/* set later in indxpath.c */
+		info->unique = false;
+
+		/*
+		 * Estimate the index size.  If it's not a partial index, we lock
+		 * the number-of-tuples estimate to equal the parent table; if it
+		 * is partial then we have to use the same methods as we would for
+		 * a table, except we can be sure that the index is not larger
+		 * than the table.
+		 */
+		if (info->indpred == NIL)
+		{
+			info->pages = RelationGetNumberOfBlocks(indexRelation);
+			info->tuples = rel->tuples;
+		}
+		else
+		{
+			estimate_rel_size(indexRelation, NULL,
+							  &info->pages, &info->tuples);
+			if (info->tuples > rel->tuples)
+				info->tuples = rel->tuples;
+		}
+
+		index_close(indexRelation, NoLock);
+
+		indexinfos = lcons(info, indexinfos);
+	}
+#endif
+}
+
+/*
+ * join_search_callback
+ *		plans the joins of the top query level in the order the actual plan
+ * joins the tables in, instead of searching all orders; see
+ * index_adviser.fast_replan. The tables are matched by their range table
+ * index, so the same table read twice is told apart; the range table indexes
+ * of the plan are those of the top level only, so a subquery gets the usual
+ * search.
+ *
+ *     The tables are joined left-deep, each one to the join of those before
+ * it, so the planner still considers nested loops with inner index scans, and
+ * so the virtual indexes. If the actual plan's order is not a legal left-deep
+ * order, say because of outer joins, the usual search is done.
+ */
+static RelOptInfo*
+join_search_callback(	PlannerInfo*	root,
+						int				levels_needed,
+						List*			initial_rels )
+{
+	RelOptInfo	**rels;
+	int			*keys;
+	int			nrels;
+	int			i;
+	int			j;
+	ListCell	*cell;
+	RelOptInfo	*joinrel;
+
+	if( !joinSearchActive || joinOrder == NIL || root->query_level != 1 )
+		goto StandardSearch;
+
+	nrels	= list_length( initial_rels );
+	rels	= (RelOptInfo**)palloc( nrels * sizeof(RelOptInfo*) );
+	keys	= (int*)palloc( nrels * sizeof(int) );
+
+	/* sort the rels by the place of their first table in the actual plan */
+	i = 0;
+	foreach( cell, initial_rels )
+	{
+		RelOptInfo	*rel = (RelOptInfo*)lfirst( cell );
+		Relids		relids = bms_copy( rel->relids );
+		int			relid;
+		int			key = INT_MAX;
+
+		while( (relid = bms_first_member( relids )) >= 0 )
+			key = Min( key, scan_position( root, relid ) );
+
+		bms_free( relids );
+
+		/* insertion sort; stable, so the unknown ones keep their order */
+		for( j = i; j > 0 && keys[j - 1] > key; --j )
+		{
+			rels[j] = rels[j - 1];
+			keys[j] = keys[j - 1];
+		}
+
+		rels[j] = rel;
+		keys[j] = key;
+		++i;
+	}
+
+	joinrel = rels[0];
+
+	for( i = 1; i < nrels && joinrel != NULL; ++i )
+	{
+		joinrel = make_join_rel( root, joinrel, rels[i] );
+
+		if( joinrel != NULL )
+			set_cheapest( joinrel );
+	}
+
+	pfree( rels );
+	pfree( keys );
+
+	if( joinrel != NULL )
+		return joinrel;
+
+	elog( DEBUG1, "IND ADV: the actual join order is not usable; searching" );
+
+StandardSearch:
+	if( prev_join_search_hook )
+		return prev_join_search_hook( root, levels_needed, initial_rels );
+
+	if( enable_geqo && levels_needed >= geqo_threshold )
+		return geqo( root, levels_needed, initial_rels );
+
+	return standard_join_search( root, levels_needed, initial_rels );
+}
+
+/* Use this function to reset the hooks that are required to be registered only
+ * for a short while; these may have been left registered by the previous call, in
+ * case of an ERROR.
+ */
+static void
+resetSecondaryHooks()
+{
+	relationInfoActive	= false;
+	indexNameActive		= false;
+	joinSearchActive	= false;
+	joinOrder			= NIL;
+}
+
+/**
+ * adviser_planner
+ *		plans the query with the planner hook that was installed before ours,
+ * if any, so that the plans we compare are the ones the backend would make.
+ */
+static PlannedStmt*
+adviser_planner(	Query*			query,
+					int				cursorOptions,
+					ParamListInfo	boundParams )
+{
+	PlannedStmt *plan;
+
+	/* the plans made while advising are the re-plans */
+	if( budgetActive )
+	{
+		++budgetReplans;
+
+		PG_TRACE2( index_adviser__replan__start, budgetReplans,
+					list_length( index_candidates ) );
+	}
+
+	if( prev_planner_hook )
+		plan = prev_planner_hook( query, cursorOptions, boundParams );
+	else
+		plan = standard_planner( query, cursorOptions, boundParams );
+
+	if( budgetActive )
+	{
+		PG_TRACE2( index_adviser__replan__done, budgetReplans,
+					list_length( index_candidates ) );
+	}
+
+	return plan;
+}
+
+static bool
+is_virtual_index( Oid oid, IndexCandidate **cand_out )
+{
+	ListCell *cell1;
+
+	foreach( cell1, index_candidates )
+	{
+		IndexCandidate *cand = (IndexCandidate*)lfirst( cell1 );
+
+		if( cand->idxoid == oid )
+		{
+			if( cand_out )
+				*cand_out = cand;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static const char *
+explain_get_index_name_callback(Oid indexId)
+{
+	StringInfoData buf;
+	IndexCandidate *cand;
+
+	if( indexNameActive && is_virtual_index( indexId, &cand ) )
+	{
+		initStringInfo(&buf);
+
+		appendStringInfo( &buf, "<V-Index>:%d", cand->idxoid );
+
+		return buf.data;
+	}
+
+	if( prev_explain_get_index_name_hook )
+		return prev_explain_get_index_name_hook( indexId );
+
+	return NULL;                            /* allow default behavior */
+}
+
+/**
+ * worth_advising
+ *		tells if the adviser has anything to do with the query; this is checked
+ * before the query is copied, which costs about as much as planning it.
+ */
+static bool
+worth_advising( const Query* const query )
+{
+	/* We work only in Normal Mode, and non-recursively; that is, we do not work
+	 * on our own DML.
+	 */
+	if( IsBootstrapProcessingMode() || SuppressRecursion > 0 )
+		return false;
+
+	/* only the tables of the users get indexes advised */
+	return user_table_walker( (Node*)query, NULL );
+}
+
+/**
+ * stats_count_unadvised
+ *		counts a statement of the backend that worth_advising() turned down; the
+ * adviser's own statements are not counted.
+ */
+static void
+stats_count_unadvised(void)
+{
+	if( !statsRequested || IsBootstrapProcessingMode()
+		|| SuppressRecursion > 0 )
+		return;
+
+	++pendingStats.calls;
+	++pendingStats.skipped_no_user_tables;
+
+	stats_flush_due();
+}
+
+/**
+ * user_table_walker
+ *		returns true if the query, or any query in it, reads or writes a table
+ * that is not a system catalog.
+ */
+static bool
+user_table_walker( Node* node, void* context )
+{
+	if( node == NULL )
+		return false;
+
+	if( IsA( node, Query ) )
+	{
+		const ListCell* cell;
+
+		foreach( cell, ((Query*)node)->rtable )
+		{
+			const RangeTblEntry* const rte = (const RangeTblEntry*)lfirst( cell );
+
+			if( rte->rtekind == RTE_RELATION
+				&& rte->relid >= FirstNormalObjectId )
+				return true;
+		}
+
+		/* sub-queries in FROM, and the sub-links */
+		return query_tree_walker( (Query*)node, user_table_walker, context, 0 );
+	}
+
+	return expression_tree_walker( node, user_table_walker, context );
+}
+
+/**
+ * query_fingerprint
+ *		computes a hash of the (not yet planned) query tree, that is identical
+ * for identical statements.
+ */
+static uint64
+query_fingerprint( const Query* const query )
+{
+	char	*str = nodeToString( query );
+	char	*c;
+	uint64	fingerprint = UINT64CONST(14695981039346656037);
+
+	/* 64-bit FNV-1a; hash_any's 32 bits collide too soon for a workload */
+	for (c = str; *c != '\0'; ++c)
+	{
+		fingerprint ^= (unsigned char)*c;
+		fingerprint *= UINT64CONST(1099511628211);
+	}
+
+	pfree( str );
+
+	return fingerprint;
+}
+
+/**
+ * count_advised_statement
+ *		if a statement with this fingerprint has already been advised in this
+ * session, counts its weight towards the advice saved then, and returns true.
+ *
+ *     The weight is kept in the cache, and saved for
+ * ADVISED_WEIGHT_FLUSH_REPEATS repetitions at a time. If the advice is gone by
+ * then, because the transaction that saved it rolled back, or pg_advise
+ * deleted it, the statement is forgotten; and if it is this one, false is
+ * returned, so that it is evaluated again.
+ */
+static bool
+count_advised_statement( uint64 fingerprint )
+{
+	AdvisedStatement *entry = lookup_advised_statement( fingerprint );
+
+	if( entry == NULL )
+		return false;
+
+	if( !entry->advised )
+		return true;
+
+	entry->weight += statement_weight;
+
+	if( ++advisedRepeats < ADVISED_WEIGHT_FLUSH_REPEATS )
+		return true;
+
+	flush_advised_weights();
+
+	return lookup_advised_statement( fingerprint ) != NULL;
+}
+
+/**
+ * lookup_advised_statement
+ *		returns the cache entry of the statement with this fingerprint; NULL if
+ * it has not been advised in this session.
+ */
+static AdvisedStatement*
+lookup_advised_statement( uint64 fingerprint )
+{
+	if( advisedStatementsStale && advisedStatements != NULL )
+	{
+		/* the weight counted so far is still the old advice's */
+		flush_advised_weights();
+
+		hash_destroy( advisedStatements );
+		advisedStatements = NULL;
+	}
+
+	advisedStatementsStale = false;
+
+	if( advisedStatements == NULL )
+		return NULL;
+
+	return (AdvisedStatement*)hash_search( advisedStatements, &fingerprint,
+											HASH_FIND, NULL );
+}
+
+/**
+ * remember_advised_statement
+ *		adds the fingerprint to the session's cache of advised statements.
+ */
+static void
+remember_advised_statement( uint64 fingerprint, bool advised )
+{
+	AdvisedStatement	*entry;
+	bool				found;
+
+	/* a simple way of bounding the cache: start over when it is full */
+	if( advisedStatements != NULL
+		&& hash_get_num_entries( advisedStatements ) >= ADVISED_STATEMENTS_MAX )
+	{
+		flush_advised_weights();
+
+		hash_destroy( advisedStatements );
+		advisedStatements = NULL;
+	}
+
+	if( advisedStatements == NULL )
+	{
+		HASHCTL ctl;
+
+		MemSet( &ctl, 0, sizeof(ctl) );
+		ctl.keysize		= sizeof(uint64);
+		ctl.entrysize	= sizeof(AdvisedStatement);
+		ctl.hash		= tag_hash;
+
+		advisedStatements = hash_create( "Index Adviser statements",
+											ADVISED_STATEMENTS_MAX / 4, &ctl,
+											HASH_ELEM | HASH_FUNCTION );
+	}
+
+	entry = (AdvisedStatement*)hash_search( advisedStatements, &fingerprint,
+											HASH_ENTER, &found );
+	entry->advised = advised;
+
+	if( !found )
+		entry->weight = 0;
+}
+
+/**
+ * forget_advised_statement
+ *		removes the fingerprint from the session's cache of advised statements.
+ */
+static void
+forget_advised_statement( uint64 fingerprint )
+{
+	if( advisedStatements != NULL )
+		hash_search( advisedStatements, &fingerprint, HASH_REMOVE, NULL );
+}
+
+/**
+ * flush_advised_weights
+ *		saves the weight the cached statements have counted since it was last
+ * saved, and forgets the statements whose advice is gone.
+ */
+static void
+flush_advised_weights(void)
+{
+	HASH_SEQ_STATUS		status;
+	AdvisedStatement	*entry;
+
+	advisedRepeats = 0;
+
+	if( advisedStatements == NULL )
+		return;
+
+	/* we do not work on our own DML */
+	++SuppressRecursion;
+
+	hash_seq_init( &status, advisedStatements );
+
+	PG_TRY();
+	{
+		while( (entry = (AdvisedStatement*)hash_seq_search( &status )) != NULL )
+		{
+			int weight = entry->weight;
+
+			if( weight == 0 )
+				continue;
+
+			entry->weight = 0;
+
+			if( !save_advice_weight( entry->fingerprint, weight ) )
+				forget_advised_statement( entry->fingerprint );
+		}
+	}
+	PG_CATCH();
+	{
+		hash_seq_term( &status );
+
+		--SuppressRecursion;
+
+		errdetail( IND_ADV_ERROR_DETAIL );
+		errhint( IND_ADV_ERROR_HINT );
+
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	--SuppressRecursion;
+}
+
+/**
+ * advised_statements_callback
+ *		marks the cache of advised statements stale when a user table, or any
+ * table (relid is InvalidOid), changes. The changes the adviser itself makes,
+ * like the virtual indexes, do not count.
+ */
+static void
+advised_statements_callback( Datum arg, Oid relid )
+{
+	if( SuppressRecursion > 0 )
+		return;
+
+	if( relid == InvalidOid || relid >= FirstNormalObjectId )
+		advisedStatementsStale = true;
+}
+
+/**
+ * parse_assumed_indexes
+ *		builds a sorted list of candidates out of index_adviser.assume_indexes,
+ * which looks like "16395(1,2); 16401(3)". Malformed entries are ignored with
+ * a WARNING.
+ */
+static List*
+parse_assumed_indexes( const char* config )
+{
+	List		*assumed = NIL;
+	const char	*p = config;
+
+	while( *p != '\0' )
+	{
+		IndexCandidate	*cand;
+		char			*end;
+		bool			valid = true;
+
+		while( isspace( (unsigned char)*p ) || *p == ';' )
+			++p;
+
+		if( *p == '\0' )
+			break;
+
+		cand = (IndexCandidate*)palloc0( sizeof(IndexCandidate) );
+
+		cand->reloid	= (Oid)strtoul( p, &end, 10 );
+		cand->varno		= -1;
+		cand->varlevelsup = -1;
+		cand->assumed	= true;
+
+		if( end == p || *end != '(' )
+			valid = false;
+
+		for( p = end; valid && *p != ')'; )
+		{
+			AttrNumber attno;
+
+			++p;	/* skip '(' or ',' */
+
+			attno = (AttrNumber)strtol( p, &end, 10 );
+
+			if( end == p || (*end != ',' && *end != ')')
+				|| cand->ncols >= INDEX_MAX_KEYS || attno <= 0 )
+			{
+				valid = false;
+				break;
+			}
+
+			cand->varattno[ cand->ncols ]	= attno;
+			cand->vartype[ cand->ncols ]	= get_atttype( cand->reloid, attno );
+
+			if( cand->vartype[ cand->ncols ] == InvalidOid )
+				valid = false;
+
+			++cand->ncols;
+			p = end;
+		}
+
+		if( valid && cand->ncols > 0 )
+		{
+			++p;	/* skip ')' */
+			assumed = merge_candidates( assumed, list_make1( cand ) );
+		}
+		else
+		{
+			elog( WARNING, "IND ADV: ignoring malformed entry in"
+							" index_adviser.assume_indexes: \"%s\"", config );
+			pfree( cand );
+
+			/* skip to the next entry */
+			while( *p != '\0' && *p != ';' )
+				++p;
+		}
+	}
+
+	return assumed;
+}
+
+/**
+ * parse_hidden_indexes
+ *		resolves the index names in index_adviser.hide_indexes to a list of
+ * oids. Names that are not those of an index are ignored with a WARNING.
+ */
+static List*
+parse_hidden_indexes( const char* config )
+{
+	List	*oids = NIL;
+	char	*rawstring = pstrdup( config );
+	char	*name = rawstring;
+	char	*p;
+	bool	inquote = false;
+
+	for( p = rawstring; ; ++p )
+	{
+		bool	done = (*p == '\0');
+		Oid		oid;
+
+		if( *p == '"' )
+			inquote = !inquote;
+
+		if( !done && (*p != ',' || inquote) )
+			continue;
+
+		*p = '\0';
+
+		while( isspace( (unsigned char)*name ) )
+			++name;
+
+		if( *name != '\0' )
+		{
+			oid = RangeVarGetRelid( makeRangeVarFromNameList(
+										stringToQualifiedNameList( name ) ),
+									true );
+
+			if( oid == InvalidOid || get_rel_relkind( oid ) != RELKIND_INDEX )
+				elog( WARNING, "IND ADV: ignoring \"%s\" in"
+								" index_adviser.hide_indexes; it is not an"
+								" index", name );
+			else
+				oids = lappend_oid( oids, oid );
+		}
+
+		if( done )
+			break;
+
+		name = p + 1;
+	}
+
+	pfree( rawstring );
+
+	return oids;
+}
+
+/* What the walkers below collect about the parameters of a statement */
+typedef struct {
+	const Query	*query;			/* whose range table the Vars refer to */
+	int			numParams;		/* highest PARAM_EXTERN paramid seen */
+	Oid			*types;			/* per param, its type if values are known */
+	Datum		**values;		/* per param, MCVs of the column it meets */
+	int			*nvalues;
+} ParamSamplesContext;
+
+/**
+ * find_extern_params_walker
+ *		finds the highest numbered parameter anywhere in the query.
+ */
+static bool
+find_extern_params_walker( Node* node, ParamSamplesContext* context )
+{
+	if( node == NULL )
+		return false;
+
+	if( IsA( node, Param ) )
+	{
+		Param *param = (Param*)node;
+
+		if( param->paramkind == PARAM_EXTERN )
+			context->numParams = Max( context->numParams, param->paramid );
+
+		return false;
+	}
+
+	if( IsA( node, Query ) )
+		return query_tree_walker( (Query*)node, find_extern_params_walker,
+									(void*)context, 0 );
+
+	return expression_tree_walker( node, find_extern_params_walker,
+									(void*)context );
+}
+
+/**
+ * find_param_mcvs_walker
+ *		for every "column op parameter" in the quals of the query, gets the
+ * most common values of the column for the parameter. Subqueries are not
+ * looked into, since their Vars refer to other range tables.
+ */
+static bool
+find_param_mcvs_walker( Node* node, ParamSamplesContext* context )
+{
+	if( node == NULL || IsA( node, Query ) )
+		return false;
+
+	if( IsA( node, OpExpr ) && list_length( ((OpExpr*)node)->args ) == 2 )
+	{
+		Node			*left	= linitial( ((OpExpr*)node)->args );
+		Node			*right	= lsecond( ((OpExpr*)node)->args );
+		Var				*var;
+		Param			*param;
+		RangeTblEntry	*rte;
+		HeapTuple		tuple;
+
+		if( IsA( left, Param ) && IsA( right, Var ) )
+		{
+			Node *tmp = left;
+
+			left	= right;
+			right	= tmp;
+		}
+
+		if( !IsA( left, Var ) || !IsA( right, Param ) )
+			return false;
+
+		var		= (Var*)left;
+		param	= (Param*)right;
+
+		if( var->varlevelsup != 0 || param->paramkind != PARAM_EXTERN
+			|| param->paramid <= 0 || param->paramid > context->numParams
+			|| var->vartype != param->paramtype
+			|| context->values[ param->paramid - 1 ] != NULL )
+			return false;
+
+		rte = rt_fetch( var->varno, context->query->rtable );
+
+		if( rte->rtekind != RTE_RELATION )
+			return false;
+
+		tuple = SearchSysCache( STATRELATT,
+								ObjectIdGetDatum( rte->relid ),
+								Int16GetDatum( var->varattno ),
+								0, 0 );
+
+		if( HeapTupleIsValid( tuple ) )
+		{
+			Datum	*values;
+			int		nvalues;
+			float4	*numbers;
+			int		nnumbers;
+
+			if( get_attstatsslot( tuple, var->vartype, var->vartypmod,
+									STATISTIC_KIND_MCV, InvalidOid,
+									&values, &nvalues, &numbers, &nnumbers ) )
+			{
+				int16	typlen;
+				bool	typbyval;
+				int		i;
+
+				get_typlenbyval( var->vartype, &typlen, &typbyval );
+
+				context->values[ param->paramid - 1 ]
+					= (Datum*)palloc( nvalues * sizeof(Datum) );
+
+				for( i = 0; i < nvalues; ++i )
+					context->values[ param->paramid - 1 ][i]
+						= datumCopy( values[i], typbyval, typlen );
+
+				context->nvalues[ param->paramid - 1 ] = nvalues;
+				context->types[ param->paramid - 1 ] = param->paramtype;
+
+				free_attstatsslot( var->vartype, values, nvalues,
+									numbers, nnumbers );
+			}
+
+			ReleaseSysCache( tuple );
+		}
+
+		return false;
+	}
+
+	return expression_tree_walker( node, find_param_mcvs_walker,
+									(void*)context );
+}
+
+/**
+ * build_param_samples
+ *		for a parameterized statement, builds the parameter lists it is to be
+ * evaluated with besides boundParams: NULL for the generic plan (unless
+ * boundParams already is NULL), and up to param_samples lists of the most
+ * common values of the columns the parameters are compared to. A parameter
+ * without such values keeps its bound value, if any. kinds is set to a
+ * character per evaluation, starting with the one of boundParams: 'b' for
+ * bound values, 'g' for the generic plan and 'm' for common values.
+ */
+static List*
+build_param_samples(	const Query* const query,
+						ParamListInfo boundParams,
+						char* kinds )
+{
+	ParamSamplesContext	context;
+	List				*samples = NIL;
+	int					nmcv = 0;
+	int					nkinds = 0;
+	int					i,
+						k;
+
+	elog( DEBUG3, "IND ADV: build_param_samples: ENTER" );
+
+	context.query		= query;
+	context.numParams	= 0;
+
+	find_extern_params_walker( (Node*)query, &context );
+
+	if( context.numParams == 0 )
+	{
+		kinds[0] = '\0';
+		return NIL;
+	}
+
+	kinds[ nkinds++ ] = boundParams != NULL ? 'b' : 'g';
+
+	if( boundParams != NULL )
+	{
+		samples = lappend( samples, NULL );
+		kinds[ nkinds++ ] = 'g';
+	}
+
+	context.types	= (Oid*)palloc0( context.numParams * sizeof(Oid) );
+	context.values	= (Datum**)palloc0( context.numParams * sizeof(Datum*) );
+	context.nvalues	= (int*)palloc0( context.numParams * sizeof(int) );
+
+	find_param_mcvs_walker( (Node*)query->jointree, &context );
+
+	for( i = 0; i < context.numParams; ++i )
+		nmcv = Max( nmcv, context.nvalues[i] );
+
+	nmcv = Min( nmcv, param_samples );
+
+	/* the k-th sample has the k-th most common value of every column */
+	for( k = 0; k < nmcv; ++k )
+	{
+		ParamListInfo params;
+
+		params = (ParamListInfo)palloc0( offsetof( ParamListInfoData, params )
+								+ context.numParams * sizeof(ParamExternData) );
+
+		params->numParams = context.numParams;
+
+		for( i = 0; i < context.numParams; ++i )
+		{
+			ParamExternData *prm = &params->params[i];
+
+			if( context.nvalues[i] > 0 )
+			{
+				prm->value	= context.values[i][ k % context.nvalues[i] ];
+				prm->isnull	= false;
+				prm->pflags	= PARAM_FLAG_CONST;
+				prm->ptype	= context.types[i];
+			}
+			else if( boundParams != NULL && i < boundParams->numParams )
+				*prm = boundParams->params[i];
+			else
+				prm->ptype = InvalidOid;	/* left unknown */
+		}
+
+		samples = lappend( samples, params );
+		kinds[ nkinds++ ] = 'm';
+	}
+
+	kinds[ nkinds ] = '\0';
+
+	elog( DEBUG3, "IND ADV: build_param_samples: EXIT" );
+
+	return samples;
+}
+
+/**
+ * evaluate_param_samples
+ *		re-plans the query, with and without the candidates, for every sample
+ * of parameter values, and records the benefit of each candidate in each. A
+ * candidate used in any sample counts as used, and its benefit becomes the
+ * average over the plan being advised and the samples.
+ */
+static void
+evaluate_param_samples(	const Query* const query,
+						int cursorOptions,
+						List* candidates,
+						List* samples )
+{
+	ListCell		*cell;
+	ListCell		*scell;
+	IndexCandidate	*cand;
+	bool			*used;
+	int				i;
+
+	elog( DEBUG3, "IND ADV: evaluate_param_samples: ENTER" );
+
+	used = (bool*)palloc( list_length( candidates ) * sizeof(bool) );
+
+	/* the plan being advised is the first sample */
+	foreach( cell, candidates )
+	{
+		cand = (IndexCandidate*)lfirst( cell );
+
+		cand->sample_benefit[0] = cand->benefit;
+		cand->nsamples = 1;
+	}
+
+	foreach( scell, samples )
+	{
+		ParamListInfo	params = (ParamListInfo)lfirst( scell );
+		PlannedStmt		*base_plan;
+		PlannedStmt		*plan;
+		Cost			saved;
+
+		if( budget_exceeded() )
+			break;
+
+		/* the plan to compare against has only the assumed indexes */
+		foreach( cell, candidates )
+		{
+			cand = (IndexCandidate*)lfirst( cell );
+
+			cand->hidden = !cand->assumed;
+		}
+
+		base_plan = adviser_planner( copyObject( query ), cursorOptions,
+										params );
+
+		foreach( cell, candidates )
+			((IndexCandidate*)lfirst( cell ))->hidden = false;
+
+		plan = adviser_planner( copyObject( query ), cursorOptions, params );
+
+		saved = base_plan->planTree->total_cost - plan->planTree->total_cost;
+
+		/* find the candidates this plan uses, remembering the others' */
+		i = 0;
+		foreach( cell, candidates )
+		{
+			cand = (IndexCandidate*)lfirst( cell );
+
+			used[ i++ ] = cand->idxused;
+			cand->idxused = false;
+		}
+
+		if( saved > 0 )
+		{
+			plannedStmtGlobal = plan;
+
+			mark_used_candidates( (Node*)plan->planTree, candidates );
+
+			plannedStmtGlobal = NULL;
+		}
+
+		split_benefit( query, cursorOptions, params, candidates, base_plan,
+						plan );
+
+		i = 0;
+		foreach( cell, candidates )
+		{
+			cand = (IndexCandidate*)lfirst( cell );
+
+			cand->sample_benefit[ cand->nsamples++ ]
+				= cand->idxused && !cand->assumed ? cand->benefit : 0;
+
+			cand->idxused = cand->idxused || used[ i++ ];
+		}
+	}
+
+	foreach( cell, candidates )
+	{
+		float4 sum = 0;
+
+		cand = (IndexCandidate*)lfirst( cell );
+
+		for( i = 0; i < cand->nsamples; ++i )
+			sum += cand->sample_benefit[i];
+
+		cand->benefit = sum / cand->nsamples;
+	}
+
+	pfree( used );
+
+	elog( DEBUG3, "IND ADV: evaluate_param_samples: EXIT" );
+}
+
+/**
+ * parse_benefit_attribution
+ *		returns the mode named by index_adviser.benefit_attribution.
+ */
+static int
+parse_benefit_attribution( const char* config )
+{
+	if( config == NULL || config[0] == '\0'
+		|| pg_strcasecmp( config, "size" ) == 0 )
+		return IND_ADV_ATTRIBUTE_SIZE;
+
+	if( pg_strcasecmp( config, "leave_one_out" ) == 0 )
+		return IND_ADV_ATTRIBUTE_LEAVE_ONE_OUT;
+
+	if( pg_strcasecmp( config, "plan" ) == 0 )
+		return IND_ADV_ATTRIBUTE_PLAN;
+
+	ereport( WARNING,
+			(errmsg( "IND ADV: unrecognized benefit attribution \"%s\";"
+						" using size", config ),
+			errhint( "Valid values are size, leave_one_out and plan." )) );
+
+	return IND_ADV_ATTRIBUTE_SIZE;
+}
+
+/**
+ * start_budget
+ *		starts the budget of the statement about to be advised; see
+ * index_adviser.time_budget.
+ */
+static void
+start_budget(void)
+{
+	budgetReason	= '\0';
+	budgetReplans	= 0;
+	budgetActive	= true;
+
+	gettimeofday( &budgetStart, NULL );
+}
+
+/**
+ * budget_exceeded
+ *		tells if the statement being advised has run out of its budget, or has
+ * no re-plans left; once it has, it stays so, and budgetReason says why.
+ */
+static bool
+budget_exceeded(void)
+{
+	struct timeval now;
+
+	if( !budgetActive )
+		return false;
+
+	if( budgetReason != '\0' )
+		return true;
+
+	if( max_replans > 0 && budgetReplans >= max_replans )
+	{
+		budgetReason = 'r';
+		return true;
+	}
+
+	if( max_memory > 0 && adviserMemory.current / 1024 >= (Size)max_memory )
+	{
+		budgetReason = 'm';
+		return true;
+	}
+
+	if( time_budget > 0 )
+	{
+		gettimeofday( &now, NULL );
+
+		if( ( now.tv_sec - budgetStart.tv_sec ) * 1000L
+			+ ( now.tv_usec - budgetStart.tv_usec ) / 1000L >= time_budget )
+		{
+			budgetReason = 't';
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/**
+ * replan_in_batches
+ *		plans the query with a batch of the candidates at a time, and excludes
+ * from the later plans the candidates that no batch's plan uses; see
+ * index_adviser.max_candidates_per_plan. A batch wins if its plan is cheaper
+ * than base_plan, the plan with only the assumed indexes and without the
+ * hidden ones when a configuration is assumed, else the actual plan.
+ *
+ *     The candidates are sorted by table, and the candidates on a table are
+ * kept in one batch, unless there are more of them than fit in one.
+ */
+static void
+replan_in_batches(	const Query* const query,
+					int cursorOptions,
+					ParamListInfo boundParams,
+					List* candidates,
+					const PlannedStmt* const base_plan )
+{
+	ListCell		*cell;
+	ListCell		*cell2;
+	IndexCandidate	*cand;
+	List			*batch = NIL;
+	Oid				batchRel = InvalidOid;
+
+	elog( DEBUG3, "IND ADV: replan_in_batches: ENTER" );
+
+	foreach( cell, candidates )
+	{
+		cand = (IndexCandidate*)lfirst( cell );
+
+		if( cand->assumed )
+			continue;
+
+		if( cand->reloid != batchRel )
+		{
+			int ontable = 0;
+
+			foreach( cell2, candidates )
+			{
+				const IndexCandidate* const other =
+										(const IndexCandidate*)lfirst( cell2 );
+
+				if( other->reloid == cand->reloid && !other->assumed )
+					++ontable;
+			}
+
+			/* start a new batch for this table's candidates, if they fit */
+			if( list_length( batch ) + ontable > max_candidates_per_plan )
+				plan_batch( query, cursorOptions, boundParams, candidates,
+							&batch, base_plan );
+
+			batchRel = cand->reloid;
+		}
+		else if( list_length( batch ) >= max_candidates_per_plan )
+			plan_batch( query, cursorOptions, boundParams, candidates, &batch,
+						base_plan );
+
+		batch = lappend( batch, cand );
+	}
+
+	plan_batch( query, cursorOptions, boundParams, candidates, &batch,
+				base_plan );
+
+	/* the plans from now on see only the winners */
+	foreach( cell, candidates )
+	{
+		cand = (IndexCandidate*)lfirst( cell );
+
+		if( !cand->assumed )
+			cand->excluded = !cand->idxused;
+
+		cand->idxused = false;
+	}
+
+	elog( DEBUG3, "IND ADV: replan_in_batches: EXIT" );
+}
+
+/**
+ * plan_batch
+ *		plans the query with only the candidates in the batch, and the assumed
+ * ones, and marks the candidates of the batch the plan uses, if it is cheaper
+ * than base_plan for them; then empties the batch.
+ */
+static void
+plan_batch(	const Query* const query,
+			int cursorOptions,
+			ParamListInfo boundParams,
+			List* candidates,
+			List** batch,
+			const PlannedStmt* const base_plan )
+{
+	ListCell	*cell;
+	PlannedStmt	*plan;
+
+	if( *batch == NIL )
+		return;
+
+	/* no batch that is not planned can win */
+	if( budget_exceeded() )
+	{
+		list_free( *batch );
+		*batch = NIL;
+		return;
+	}
+
+	foreach( cell, candidates )
+	{
+		IndexCandidate *cand = (IndexCandidate*)lfirst( cell );
+
+		cand->hidden = !cand->assumed;
+	}
+
+	foreach( cell, *batch )
+		((IndexCandidate*)lfirst( cell ))->hidden = false;
+
+	plan = adviser_planner( copyObject( query ), cursorOptions, boundParams );
+
+	foreach( cell, candidates )
+		((IndexCandidate*)lfirst( cell ))->hidden = false;
+
+	if( plan->planTree->startup_cost < base_plan->planTree->startup_cost
+		|| plan->planTree->total_cost < base_plan->planTree->total_cost )
+	{
+		plannedStmtGlobal = plan;
+
+		mark_used_candidates( (Node*)plan->planTree, *batch );
+
+		plannedStmtGlobal = NULL;
+	}
+
+	list_free( *batch );
+	*batch = NIL;
+}
+
+/**
+ * split_benefit
+ *		sets the benefit of each candidate the plan uses, to its share of the
+ * cost the plan saves over base_plan; see index_adviser.benefit_attribution.
+ *
+ *     The credit of each candidate is only used to split the cost saved, so
+ * that the benefits always add up to it; two indexes that can stand in for
+ * each other get no credit leaving either one out, and so do not lose all of
+ * it. When no candidate gets any credit, they share the cost by size.
+ */
+static void
+split_benefit(	const Query* const query,
+				int cursorOptions,
+				ParamListInfo params,
+				List* candidates,
+				const PlannedStmt* const base_plan,
+				const PlannedStmt* const plan )
+{
+	ListCell		*cell;
+	IndexCandidate	*cand;
+	Cost			saved;
+	int				nused = 0;
+	int				mode = benefitAttribution;
+	int4			totalSize = 0;
+	float8			*credit;
+	float8			totalCredit = 0;
+	int				i;
+
+	elog( DEBUG3, "IND ADV: split_benefit: ENTER" );
+
+	saved = base_plan->planTree->total_cost - plan->planTree->total_cost;
+
+	foreach( cell, candidates )
+	{
+		cand = (IndexCandidate*)lfirst( cell );
+
+		if( cand->idxused && !cand->assumed )
+		{
+			totalSize += cand->pages;
+			++nused;
+		}
+	}
+
+	if( nused == 0 )
+		return;
+
+	/* a single index has all the credit anyway */
+	if( nused == 1 || saved <= 0 )
+		mode = IND_ADV_ATTRIBUTE_SIZE;
+
+	if( mode == IND_ADV_ATTRIBUTE_LEAVE_ONE_OUT
+		&& nused > max_attribution_replans )
+	{
+		elog( DEBUG1, "IND ADV: %d indexes used; attributing by plan instead"
+						" of re-planning", nused );
+
+		mode = IND_ADV_ATTRIBUTE_PLAN;
+	}
+
+	credit = (float8*)palloc0( list_length( candidates ) * sizeof(float8) );
+
+	i = 0;
+	foreach( cell, candidates )
+	{
+		cand = (IndexCandidate*)lfirst( cell );
+
+		if( !cand->idxused || cand->assumed )
+		{
+			++i;
+			continue;
+		}
+
+		switch( mode )
+		{
+			case IND_ADV_ATTRIBUTE_LEAVE_ONE_OUT:
+			{
+				/* what the plan costs without this one */
+				PlannedStmt *without;
+
+				/* the statement is given up on anyway */
+				if( budget_exceeded() )
+					break;
+
+				cand->hidden = true;
+
+				without = adviser_planner( copyObject( query ), cursorOptions,
+											params );
+
+				cand->hidden = false;
+
+				credit[i] = Max( 0, without->planTree->total_cost
+									- plan->planTree->total_cost );
+			}
+			break;
+
+			case IND_ADV_ATTRIBUTE_PLAN:
+			{
+				/* what the scans of its table save, shared with the others */
+				ListCell	*cell2;
+				int			nshare = 0;
+
+				foreach( cell2, candidates )
+				{
+					IndexCandidate *other = (IndexCandidate*)lfirst( cell2 );
+
+					if( other->idxused && !other->assumed
+						&& other->reloid == cand->reloid )
+						++nshare;
+				}
+
+				credit[i] = Max( 0, relation_scan_cost( base_plan, cand->reloid )
+									- relation_scan_cost( plan, cand->reloid ) )
+							/ nshare;
+			}
+			break;
+
+			default:
+				credit[i] = cand->pages;
+			break;
+		}
+
+		totalCredit += credit[i++];
+	}
+
+	/* nobody earned anything; fall back to the sizes */
+	if( totalCredit <= 0 )
+	{
+		i = 0;
+		foreach( cell, candidates )
+		{
+			cand = (IndexCandidate*)lfirst( cell );
+
+			credit[i++] = cand->idxused && !cand->assumed ? cand->pages : 0;
+		}
+
+		totalCredit = totalSize;
+	}
+
+	i = 0;
+	foreach( cell, candidates )
+	{
+		cand = (IndexCandidate*)lfirst( cell );
+
+		if( cand->idxused && !cand->assumed )
+			cand->benefit = (float4)(saved * credit[i] / totalCredit);
+
+		++i;
+	}
+
+	pfree( credit );
+
+	elog( DEBUG3, "IND ADV: split_benefit: EXIT" );
+}
+
+/**
+ * relation_scan_cost
+ *		adds up the cost of the nodes of the plan that scan the given table.
+ */
+static Cost
+relation_scan_cost( const PlannedStmt* const stmt, Oid reloid )
+{
+	ListCell	*cell;
+	Cost		cost;
+
+	cost = scan_cost_walker( stmt->planTree, stmt, reloid, 1 );
+
+	foreach( cell, stmt->subplans )
+		cost += scan_cost_walker( (const Plan*)lfirst( cell ), stmt, reloid,
+									1 );
+
+	return cost;
+}
+
+/**
+ * scan_cost_walker
+ *		the walker for relation_scan_cost(); loops is the number of times the
+ * plan is run, as the inner side of nested loops.
+ */
+static Cost
+scan_cost_walker(	const Plan* const plan,
+					const PlannedStmt* const stmt,
+					Oid reloid,
+					double loops )
+{
+	ListCell	*cell;
+	Cost		cost = 0;
+
+	if( plan == NULL )
+		return 0;
+
+	switch( nodeTag( plan ) )
+	{
+		/* the cost of a bitmap heap scan includes its index scans */
+		case T_SeqScan:
+		case T_IndexScan:
+		case T_BitmapHeapScan:
+		case T_TidScan:
+		{
+			const Scan* const scan = (const Scan*)plan;
+
+			if( rt_fetch( scan->scanrelid, stmt->rtable )->relid == reloid )
+				return plan->total_cost * loops;
+
+			return 0;
+		}
+
+		case T_Append:
+			foreach( cell, ((const Append*)plan)->appendplans )
+				cost += scan_cost_walker( (const Plan*)lfirst( cell ), stmt,
+											reloid, loops );
+		break;
+
+		case T_SubqueryScan:
+			cost += scan_cost_walker( ((const SubqueryScan*)plan)->subplan, stmt,
+										reloid, loops );
+		break;
+
+		default:
+		break;
+	}
+
+	cost += scan_cost_walker( plan->lefttree, stmt, reloid, loops );
+	cost += scan_cost_walker( plan->righttree, stmt, reloid,
+								loops * inner_loops( plan ) );
+
+	return cost;
+}
+
+/**
+ * inner_loops
+ *		the number of times a join runs its inner side, each time it is run
+ * itself; a nested loop runs it once per outer row, unless it is materialized.
+ * The cost of a plan node is that of a single run.
+ */
+static double
+inner_loops( const Plan* const join )
+{
+	if( IsA( join, NestLoop ) && !IsA( join->righttree, Material ) )
+		return Max( 1, join->lefttree->plan_rows );
+
+	return 1;
+}
+
+/**
+ * get_scan_order
+ *		returns the range table indexes of the top query level that the plan
+ * scans, in the order it scans them; see join_search_callback().
+ */
+static List*
+get_scan_order( const PlannedStmt* const stmt )
+{
+	List *order = NIL;
+
+	scan_order_walker( stmt->planTree, &order );
+
+	return order;
+}
+
+/**
+ * scan_order_walker
+ *		the walker for get_scan_order(). The plan of a subquery in FROM has the
+ * range table indexes of its own level, so it is not walked into.
+ */
+static void
+scan_order_walker( const Plan* const plan, List** order )
+{
+	ListCell *cell;
+
+	if( plan == NULL )
+		return;
+
+	switch( nodeTag( plan ) )
+	{
+		/* a bitmap heap scan's index scans scan the same entry */
+		case T_SeqScan:
+		case T_IndexScan:
+		case T_BitmapHeapScan:
+		case T_TidScan:
+		case T_SubqueryScan:
+		case T_FunctionScan:
+		case T_ValuesScan:
+			*order = lappend_int( *order, ((const Scan*)plan)->scanrelid );
+		return;
+
+		case T_Append:
+			foreach( cell, ((const Append*)plan)->appendplans )
+				scan_order_walker( (const Plan*)lfirst( cell ), order );
+		break;
+
+		default:
+		break;
+	}
+
+	scan_order_walker( plan->lefttree, order );
+	scan_order_walker( plan->righttree, order );
+}
+
+/**
+ * scan_position
+ *		returns where in joinOrder the actual plan scans the given range table
+ * entry of the top query level, or one of its inheritance children; INT_MAX if
+ * it does not.
+ */
+static int
+scan_position( const PlannerInfo* const root, Index relid )
+{
+	ListCell	*cell;
+	ListCell	*acell;
+	int			pos = 0;
+
+	foreach( cell, joinOrder )
+	{
+		const Index scanrelid = (Index)lfirst_int( cell );
+
+		if( scanrelid == relid )
+			return pos;
+
+		foreach( acell, root->append_rel_list )
+		{
+			const AppendRelInfo* const appinfo =
+										(const AppendRelInfo*)lfirst( acell );
+
+			if( appinfo->child_relid == scanrelid
+				&& appinfo->parent_relid == relid )
+				return pos;
+		}
+
+		++pos;
+	}
+
+	return INT_MAX;
+}
+
+/**
+ * get_relation_accesses
+ *		runs thru the plan to find how it accesses each table; see
+ * index_adviser.prune_by_plan.
+ */
+static List*
+get_relation_accesses( const PlannedStmt* const stmt )
+{
+	ListCell	*cell;
+	List		*accesses = NIL;
+
+	elog( DEBUG3, "IND ADV: get_relation_accesses: ENTER" );
+
+	relation_access_walker( stmt->planTree, stmt, false, 0, 1, &accesses );
+
+	foreach( cell, stmt->subplans )
+		relation_access_walker( (const Plan*)lfirst( cell ), stmt, false, 0, 1,
+								&accesses );
+
+	elog( DEBUG3, "IND ADV: get_relation_accesses: EXIT" );
+
+	return accesses;
+}
+
+/**
+ * relation_access_walker
+ *		the walker for get_relation_accesses(); sortCost is the cost of the
+ * sorts above this node, if underSort, and loops the number of times the node
+ * is run, as the inner side of nested loops.
+ */
+static void
+relation_access_walker(	const Plan* const plan,
+						const PlannedStmt* const stmt,
+						bool underSort,
+						Cost sortCost,
+						double loops,
+						List** accesses )
+{
+	ListCell	*cell;
+
+	if( plan == NULL )
+		return;
+
+	switch( nodeTag( plan ) )
+	{
+		/* a bitmap heap scan's index scans are in its lefttree, not here */
+		case T_SeqScan:
+		case T_IndexScan:
+		case T_BitmapHeapScan:
+		case T_TidScan:
+		{
+			const Oid reloid = rt_fetch( ((const Scan*)plan)->scanrelid,
+										stmt->rtable )->relid;
+			RelationAccess *access = NULL;
+
+			foreach( cell, *accesses )
+				if( ((RelationAccess*)lfirst( cell ))->reloid == reloid )
+					access = (RelationAccess*)lfirst( cell );
+
+			if( access == NULL )
+			{
+				access = (RelationAccess*)palloc0( sizeof(RelationAccess) );
+				access->reloid = reloid;
+
+				*accesses = lappend( *accesses, access );
+			}
+
+			/* read in full, or fetching rows only to filter them out */
+			access->improvable = access->improvable
+								|| IsA( plan, SeqScan )
+								|| plan->qual != NIL
+								|| underSort;
+
+			access->cost += ( plan->total_cost + sortCost ) * loops;
+		}
+		return;
+
+		case T_Sort:
+			underSort = true;
+			sortCost += plan->total_cost - plan->lefttree->total_cost;
+		break;
+
+		case T_Append:
+			foreach( cell, ((const Append*)plan)->appendplans )
+				relation_access_walker( (const Plan*)lfirst( cell ), stmt,
+										underSort, sortCost, loops, accesses );
+		break;
+
+		case T_SubqueryScan:
+			relation_access_walker( ((const SubqueryScan*)plan)->subplan, stmt,
+									underSort, sortCost, loops, accesses );
+		break;
+
+		default:
+		break;
+	}
+
+	relation_access_walker( plan->lefttree, stmt, underSort, sortCost, loops,
+							accesses );
+	relation_access_walker( plan->righttree, stmt, underSort, sortCost,
+							loops * inner_loops( plan ), accesses );
+}
+
+/**
+ * prune_candidates_by_plan
+ *		removes the candidates on the tables the actual plan accesses well
+ * enough, or too cheaply to matter; the candidates on tables not found in the
+ * plan are kept.
+ */
+static List*
+prune_candidates_by_plan( List* candidates, List* accesses, Cost totalCost )
+{
+	ListCell	*prev,
+				*cell,
+				*next;
+
+	elog( DEBUG3, "IND ADV: prune_candidates_by_plan: ENTER" );
+
+	for( prev = NULL, cell = list_head( candidates ); cell != NULL; cell = next )
+	{
+		IndexCandidate	*cand = (IndexCandidate*)lfirst( cell );
+		ListCell		*acell;
+		bool			keep = true;
+
+		next = lnext( cell );
+
+		foreach( acell, accesses )
+		{
+			const RelationAccess* const access =
+										(const RelationAccess*)lfirst( acell );
+
+			if( access->reloid == cand->reloid )
+				keep = access->improvable
+						&& access->cost >= min_relation_cost_share * totalCost;
+		}
+
+		if( !keep )
+		{
+			pfree( cand );
+			candidates = list_delete_cell( candidates, cell, prev );
+		}
+		else
+			prev = cell;
+	}
+
+	elog( DEBUG3, "IND ADV: prune_candidates_by_plan: EXIT" );
+
+	return candidates;
+}
+
+/**
+ * save_advice_weight
+ *		adds the weight of the repetitions of a statement to the rows saved by
+ * its latest evaluation; returns false if none of those are there anymore.
+ *
+ *     The rows of earlier evaluations of the statement (EXPLAIN evaluates it
+ * every time) keep their weight. The rows of one evaluation all have the
+ * timestamp of its transaction, so those of the latest are the ones with the
+ * latest timestamp in any of the tables; not all of them get rows every time.
+ */
+static bool
+save_advice_weight( uint64 fingerprint, int weight )
+{
+	/* the advice first; its row count tells if the summary needs it */
+	static const char* const tables[] = { IND_ADV_TABL,
+											IND_ADV_WRITES_TABL,
+											IND_ADV_USAGE_TABL,
+											IND_ADV_TRUNCATIONS_TABL };
+	StringInfoData	latest;
+	StringInfoData	query;
+	uint32			advice = 0;
+	uint32			rows = 0;
+	int				i;
+
+	elog( DEBUG3, "IND ADV: save_advice_weight: ENTER" );
+
+	initStringInfo( &latest );
+	initStringInfo( &query );
+
+	for (i = 0; i < lengthof( tables ); ++i)
+		appendStringInfo( &latest, "%s select max(timestamp) as timestamp"
+										" from \"%s\""
+										" where backend_pid = %d"
+										" and fingerprint = "INT64_FORMAT,
+									i > 0 ? " union all" : "",
+									tables[i],
+									MyProcPid, (int64)fingerprint );
+
+	for (i = 0; i < lengthof( tables ); ++i)
+	{
+		resetStringInfo( &query );
+
+		appendStringInfo( &query, "update \"%s\""
+									" set weight = weight + %d"
+									" where backend_pid = %d"
+									" and fingerprint = "INT64_FORMAT
+									" and timestamp = (select max(timestamp)"
+													" from (%s) as latest);",
+									tables[i],
+									weight,
+									MyProcPid, (int64)fingerprint,
+									latest.data );
+
+		rows += execute_advisory_sql( query.data, SPI_OK_UPDATE );
+
+		if( i == 0 )
+			advice = rows;
+	}
+
+	pfree( query.data );
+	pfree( latest.data );
+
+	/* the summary sees the repetitions as new occurrences of the advice */
+	if( benefit_half_life > 0 && advice > 0 && !hypothetical_configuration() )
+		save_advice_summary( fingerprint, weight );
+
+	elog( DEBUG3, "IND ADV: save_advice_weight: EXIT" );
+
+	return rows > 0;
+}
+
+/**
+ * hypothetical_configuration
+ *		returns true if index_adviser.assume_indexes or hide_indexes is set;
+ * the advice is then relative to a configuration that does not exist.
+ */
+static bool
+hypothetical_configuration(void)
+{
+	return ( assume_indexes != NULL && assume_indexes[0] != '\0' )
+			|| ( hide_indexes != NULL && hide_indexes[0] != '\0' );
+}
+
+/**
+ * save_advice_summary
+ *		adds the benefit of the advice last saved for the statement, times the
+ * weight, to IND_ADV_SUMMARY_TABL, after decaying what is there by the time
+ * since it was last updated; and to the bucket of this hour in
+ * IND_ADV_HOURLY_TABL, from which the buckets older than a day are removed.
+ *
+ *     8.3 cannot insert-or-update, so the functions IND_ADV_SUMMARY_ADD and
+ * IND_ADV_HOURLY_ADD do it for a row, retrying the update if another backend
+ * inserted the row first; the unique indexes on the tables keep an index to
+ * one row.
+ */
+static void
+save_advice_summary( uint64 fingerprint, int weight )
+{
+	StringInfoData	query;
+
+	elog( DEBUG3, "IND ADV: save_advice_summary: ENTER" );
+
+	initStringInfo( &query );
+
+	/* the advice, from the latest evaluation of the statement */
+	appendStringInfo( &query, "select "IND_ADV_SUMMARY_ADD"( a.reloid, a.attrs,"
+										" a.coloptions, a.benefit,"
+										" a.index_size, %d ),"
+									" "IND_ADV_HOURLY_ADD"( a.reloid, a.attrs,"
+										" a.coloptions, a.benefit )"
+								" from (select reloid, attrs, coloptions,"
+										" max(index_size) as index_size,"
+										" sum(benefit) * %d as benefit"
+									" from \""IND_ADV_TABL"\""
+									" where backend_pid = %d"
+									" and fingerprint = "INT64_FORMAT
+									" and timestamp = (select max(timestamp)"
+													" from \""IND_ADV_TABL"\""
+													" where backend_pid = %d"
+													" and fingerprint = "
+														INT64_FORMAT")"
+									" group by reloid, attrs, coloptions) as a;",
+								benefit_half_life,
+								weight,
+								MyProcPid, (int64)fingerprint,
+								MyProcPid, (int64)fingerprint );
+
+	/* a day's worth of buckets, and the one the day begins in */
+	appendStringInfoString( &query, "delete from \""IND_ADV_HOURLY_TABL"\""
+									" where hour < date_trunc( 'hour', now() )"
+												" - interval '1 day';" );
+
+	execute_advisory_sql( query.data, SPI_OK_DELETE );
+
+	pfree( query.data );
+
+	elog( DEBUG3, "IND ADV: save_advice_summary: EXIT" );
+}
+
+/**
+ * execute_advisory_sql
+ *		runs a statement that writes to one of the advisory tables; returns the
+ * number of rows the (last) statement processed.
+ */
+static uint32
+execute_advisory_sql( const char* sql, int expected )
+{
+	uint32 rows = 0;
+
+	if( SPI_connect() == SPI_OK_CONNECT )
+	{
+		if( SPI_execute( sql, false, 0 ) != expected )
+			elog( WARNING, "IND ADV: SPI_execute failed while saving advice." );
+		else
+			rows = SPI_processed;
+
+		if( SPI_finish() != SPI_OK_FINISH )
+			elog( WARNING, "IND ADV: SPI_finish failed while saving advice." );
+	}
+	else
+		elog( WARNING, "IND ADV: SPI_connect failed while saving advice." );
+
+	return rows;
+}
+
+/**
+ * get_write_profile
+ *		for an INSERT, UPDATE or DELETE on a user table, collects what is needed
+ * to estimate the cost of maintaining an index on that table: the rows
+ * written, and for an UPDATE the columns it sets, and whether it can be a
+ * HOT update with the existing indexes. Returns NULL for other statements.
+ */
+static WriteProfile*
+get_write_profile(	const Query* const query,
+					const PlannedStmt* const actual_plan )
+{
+	WriteProfile		*profile;
+	const RangeTblEntry	*rte;
+	Relation			rel;
+	List				*indexoids;
+	Bitmapset			*indexattrs;
+	ListCell			*cell;
+
+	if( query->commandType != CMD_INSERT
+		&& query->commandType != CMD_UPDATE
+		&& query->commandType != CMD_DELETE )
+		return NULL;
+
+	rte = rt_fetch( query->resultRelation, query->rtable );
+
+	if( rte->rtekind != RTE_RELATION )
+		return NULL;
+
+	rel = heap_open( rte->relid, AccessShareLock );
+
+	/* the advice is never about catalog tables and temporary tables */
+	if( rel->rd_istemp || IsSystemRelation( rel ) )
+	{
+		heap_close( rel, AccessShareLock );
+		return NULL;
+	}
+
+	profile = (WriteProfile*)palloc0( sizeof(WriteProfile) );
+
+	profile->reloid	= rte->relid;
+	profile->rows	= actual_plan->planTree->plan_rows;
+	profile->command = query->commandType == CMD_INSERT ? 'i'
+						: query->commandType == CMD_UPDATE ? 'u' : 'd';
+
+	indexoids = RelationGetIndexList( rel );
+	profile->num_indexes = list_length( indexoids );
+	list_free( indexoids );
+
+	profile->hot_ratio = -1;
+
+	if( query->commandType == CMD_UPDATE )
+	{
+		indexattrs = RelationGetIndexAttrBitmap( rel );
+
+		profile->hot_possible = true;
+
+		/* before planning, the targetlist has only the columns SET */
+		foreach( cell, query->targetList )
+		{
+			TargetEntry *tle = (TargetEntry*)lfirst( cell );
+
+			if( tle->resjunk )
+				continue;
+
+			profile->updated_attrs = lappend_int( profile->updated_attrs,
+													tle->resno );
+
+			if( bms_is_member( tle->resno - FirstLowInvalidHeapAttributeNumber,
+								indexattrs ) )
+				profile->hot_possible = false;
+		}
+
+		bms_free( indexattrs );
+
+		if( use_hot_statistics )
+		{
+			PgStat_StatTabEntry *tabentry
+				= pgstat_fetch_stat_tabentry( profile->reloid );
+
+			if( tabentry != NULL && tabentry->tuples_updated > 0 )
+				profile->hot_ratio = (float4)tabentry->tuples_hot_updated
+										/ tabentry->tuples_updated;
+		}
+	}
+
+	heap_close( rel, AccessShareLock );
+
+	return profile;
+}
+
+/**
+ * save_write_profile
+ *		insert the write profile of a DML statement into IND_ADV_WRITES_TABL
+ */
+static void
+save_write_profile( WriteProfile* profile, uint64 fingerprint )
+{
+	StringInfoData	query;
+	StringInfoData	cols;
+	StringInfoData	hot_ratio;
+	ListCell		*cell;
+
+	elog( DEBUG3, "IND ADV: save_write_profile: ENTER" );
+
+	initStringInfo( &query );
+	initStringInfo( &cols );
+	initStringInfo( &hot_ratio );
+
+	if( profile->hot_ratio >= 0 )
+		appendStringInfo( &hot_ratio, "%f", profile->hot_ratio );
+	else
+		appendStringInfoString( &hot_ratio, "null" );
+
+	foreach( cell, profile->updated_attrs )
+		appendStringInfo( &cols, "%s%d", (cols.len > 0 ? "," : ""),
+							lfirst_int( cell ) );
+
+	appendStringInfo( &query, "insert into \""IND_ADV_WRITES_TABL"\""
+								"( reloid, command, rows, updated_attrs,"
+								" hot_possible, num_indexes, hot_ratio,"
+								" backend_pid, timestamp, fingerprint,"
+								" weight )"
+								" values"
+								"( %d, '%c', %f, %s%s%s, %s, %d, %s, %d,"
+								" now(), "INT64_FORMAT", %d );",
+								profile->reloid,
+								profile->command,
+								profile->rows,
+								cols.len > 0 ? "array[" : "",
+								cols.len > 0 ? cols.data : "null",
+								cols.len > 0 ? "]" : "",
+								profile->hot_possible ? "true" : "false",
+								profile->num_indexes,
+								hot_ratio.data,
+								MyProcPid,
+								(int64)fingerprint,
+								statement_weight );
+
+	execute_advisory_sql( query.data, SPI_OK_INSERT );
+
+	pfree( query.data );
+	pfree( cols.data );
+	pfree( hot_ratio.data );
+
+	elog( DEBUG3, "IND ADV: save_write_profile: EXIT" );
+}
+
+/**
+ * save_truncation
+ *		insert the reason the adviser gave up on a statement, and what it had
+ * spent by then, into IND_ADV_TRUNCATIONS_TABL
+ */
+static void
+save_truncation( uint64 fingerprint )
+{
+	StringInfoData	query;
+	struct timeval	now;
+	long			elapsed;
+
+	elog( DEBUG3, "IND ADV: save_truncation: ENTER" );
+
+	gettimeofday( &now, NULL );
+
+	elapsed = ( now.tv_sec - budgetStart.tv_sec ) * 1000L
+				+ ( now.tv_usec - budgetStart.tv_usec ) / 1000L;
+
+	initStringInfo( &query );
+
+	appendStringInfo( &query, "insert into \""IND_ADV_TRUNCATIONS_TABL"\""
+								"( reason, elapsed_ms, replans, backend_pid,"
+								" timestamp, fingerprint, weight )"
+								" values"
+								"( '%c', %ld, %d, %d, now(), "INT64_FORMAT", %d );",
+								budgetReason,
+								elapsed,
+								budgetReplans,
+								MyProcPid,
+								(int64)fingerprint,
+								statement_weight );
+
+	execute_advisory_sql( query.data, SPI_OK_INSERT );
+
+	pfree( query.data );
+
+	elog( DEBUG3, "IND ADV: save_truncation: EXIT" );
+}
+
+/**
+ * get_existing_indexes
+ *		builds a candidate for every valid, non-unique index on the user tables
+ * the plan uses. A unique index enforces a constraint, so it is never advised
+ * to be dropped, but it still makes a plain index on a prefix of its columns
+ * redundant.
+ */
+static List*
+get_existing_indexes( const PlannedStmt* const plan )
+{
+	List		*indexes = NIL;
+	List		*reloids = NIL;
+	ListCell	*cell;
+
+	foreach( cell, plan->rtable )
+	{
+		RangeTblEntry	*rte = (RangeTblEntry*)lfirst( cell );
+		Relation		rel;
+		List			*index_oids;
+		List			*plain = NIL;	/* indexes on columns only */
+		ListCell		*index_cell;
+		ListCell		*cell2;
+
+		if( rte->rtekind != RTE_RELATION
+			|| list_member_oid( reloids, rte->relid ) )
+			continue;
+
+		reloids = lappend_oid( reloids, rte->relid );
+
+		rel = heap_open( rte->relid, AccessShareLock );
+
+		if( rel->rd_istemp || IsSystemRelation( rel ) )
+		{
+			heap_close( rel, AccessShareLock );
+			continue;
+		}
+
+		index_oids = RelationGetIndexList( rel );
+
+		foreach( index_cell, index_oids )
+		{
+			Oid				index_oid	= lfirst_oid( index_cell );
+			Relation		index_rel	= index_open( index_oid,
+														AccessShareLock );
+			IndexInfo		*index_info	= BuildIndexInfo( index_rel );
+			IndexCandidate	*cand;
+			int				i;
+
+			if( !index_rel->rd_index->indisvalid )
+			{
+				index_close( index_rel, AccessShareLock );
+				pfree( index_info );
+				continue;
+			}
+
+			cand = (IndexCandidate*)palloc0( sizeof(IndexCandidate) );
+
+			cand->varno			= -1;
+			cand->varlevelsup	= -1;
+			cand->reloid		= rte->relid;
+			cand->idxoid		= index_oid;
+			cand->ncols			= index_info->ii_NumIndexAttrs;
+			cand->pages			= index_rel->rd_rel->relpages;
+			cand->existing		= true;
+			cand->penalty		= -1;
+			cand->relam			= index_rel->rd_rel->relam;
+
+			for( i = 0; i < cand->ncols; ++i )
+			{
+				cand->varattno[i]	= index_info->ii_KeyAttrNumbers[i];
+				cand->vartype[i]	= index_rel->rd_att->attrs[i]->atttypid;
+				cand->coloptions[i]	= index_rel->rd_indoption[i];
+				cand->opclass[i]	= index_rel->rd_indclass->values[i];
+			}
+
+			if( !index_rel->rd_index->indisunique )
+				indexes = lappend( indexes, cand );
+
+			if( index_info->ii_Expressions == NIL
+				&& index_info->ii_Predicate == NIL )
+				plain = lappend( plain, cand );
+			else if( index_rel->rd_index->indisunique )
+				pfree( cand );
+
+			index_close( index_rel, AccessShareLock );
+			pfree( index_info );
+		}
+
+		/*
+		 * A plain index is redundant if its columns lead another plain btree
+		 * index, or are those of another plain index, of the same access
+		 * method, and with the same opclasses and options; of two non-unique
+		 * indexes on the same columns, the younger one is.
+		 */
+		foreach( index_cell, plain )
+		{
+			IndexCandidate *cand = (IndexCandidate*)lfirst( index_cell );
+
+			foreach( cell2, plain )
+			{
+				IndexCandidate	*other = (IndexCandidate*)lfirst( cell2 );
+				int				i;
+
+				if( other == cand || other->ncols < cand->ncols
+					|| other->relam != cand->relam
+					|| (other->ncols > cand->ncols
+						&& cand->relam != BTREE_AM_OID)
+					|| (other->ncols == cand->ncols
+						&& other->idxoid > cand->idxoid
+						&& list_member_ptr( indexes, other )) )
+					continue;
+
+				for( i = 0; i < cand->ncols; ++i )
+					if( cand->varattno[i] != other->varattno[i]
+						|| cand->opclass[i] != other->opclass[i]
+						|| cand->coloptions[i] != other->coloptions[i] )
+						break;
+
+				if( i == cand->ncols )
+				{
+					cand->redundant = true;
+					break;
+				}
+			}
+		}
+
+		/* the unique indexes were needed only for the above */
+		foreach( index_cell, plain )
+			if( !list_member_ptr( indexes, lfirst( index_cell ) ) )
+				pfree( lfirst( index_cell ) );
+
+		list_free( plain );
+		list_free( index_oids );
+
+		heap_close( rel, AccessShareLock );
+	}
+
+	list_free( reloids );
+
+	return indexes;
+}
+
+/**
+ * analyse_existing_indexes
+ *		finds the existing indexes the actual plan uses, and what re-planning
+ * the query without the others costs: once without all of the unused ones, and
+ * once without each used one that is redundant. The returned list carries the
+ * results in idxused and penalty.
+ */
+static List*
+analyse_existing_indexes(	const Query* const query,
+							int cursorOptions,
+							ParamListInfo boundParams,
+							PlannedStmt* actual_plan )
+{
+	List			*indexes;
+	List			*unused = NIL;
+	ListCell		*cell;
+	IndexCandidate	*cand;
+	PlannedStmt		*plan;
+	Cost			penalty;
+
+	elog( DEBUG3, "IND ADV: analyse_existing_indexes: ENTER" );
+
+	indexes = get_existing_indexes( actual_plan );
+
+	if( indexes == NIL )
+		return NIL;
+
+	plannedStmtGlobal = actual_plan;
+
+	mark_used_candidates( (Node*)actual_plan->planTree, indexes );
+
+	plannedStmtGlobal = NULL;
+
+	relationInfoActive = true;
+
+	/*
+	 * Hiding the indexes the planner did not choose should cost nothing; if it
+	 * does, say because of fuzzy path comparisons, each of them is charged the
+	 * whole difference, which errs on the side of keeping them.
+	 */
+	foreach( cell, indexes )
+	{
+		cand = (IndexCandidate*)lfirst( cell );
+
+		if( !cand->idxused )
+			unused = lappend_oid( unused, cand->idxoid );
+	}
+
+	if( unused != NIL )
+	{
+		hidden_index_oids = unused;
+
+		plan = adviser_planner( copyObject( query ), cursorOptions,
+									boundParams );
+
+		hidden_index_oids = NIL;
+
+		penalty = Max( 0, plan->planTree->total_cost
+							- actual_plan->planTree->total_cost );
+
+		foreach( cell, indexes )
+		{
+			cand = (IndexCandidate*)lfirst( cell );
+
+			if( !cand->idxused )
+				cand->penalty = penalty;
+		}
+
+		list_free( unused );
+	}
 
-		/*
-		 * Estimate the index size.  If it's not a partial index, we lock
-		 * the number-of-tuples estimate to equal the parent table; if it
-		 * is partial then we have to use the same methods as we would for
-		 * a table, except we can be sure that the index is not larger
-		 * than the table.
-		 */
-		if (info->indpred == NIL)
+	/* a used index is worth dropping only if a longer one can stand in */
+	foreach( cell, indexes )
+	{
+		cand = (IndexCandidate*)lfirst( cell );
+
+		if( !cand->idxused || !cand->redundant )
+			continue;
+
+		/* the penalty stays unknown */
+		if( budget_exceeded() )
+			break;
+
+		hidden_index_oids = list_make1_oid( cand->idxoid );
+
+		plan = adviser_planner( copyObject( query ), cursorOptions,
+									boundParams );
+
+		list_free( hidden_index_oids );
+		hidden_index_oids = NIL;
+
+		cand->penalty = Max( 0, plan->planTree->total_cost
+								- actual_plan->planTree->total_cost );
+	}
+
+	/*
+	 * The indexes that can go one at a time may not go together; say two
+	 * indexes on the same columns, each of which can stand in for the other.
+	 * So re-plan without all of them at once, and if that costs more, hide
+	 * them one at a time instead, the redundant ones first, dropping only those
+	 * that can go along with the ones dropped before them. A set that can go
+	 * for each statement can go for all of them, since hiding fewer indexes
+	 * never makes a plan more expensive.
+	 */
+	if( droppable_indexes_cost( query, cursorOptions, boundParams, indexes,
+								actual_plan ) != 0 )
+	{
+		List	*dropped = NIL;
+
+		foreach( cell, indexes )
 		{
-			info->pages = RelationGetNumberOfBlocks(indexRelation);
-			info->tuples = rel->tuples;
+			cand = (IndexCandidate*)lfirst( cell );
+
+			if( cand->redundant && cand->penalty == 0 )
+				dropped = check_droppable( query, cursorOptions, boundParams,
+											cand, dropped, actual_plan );
 		}
-		else
+
+		foreach( cell, indexes )
 		{
-			estimate_rel_size(indexRelation, NULL,
-							  &info->pages, &info->tuples);
-			if (info->tuples > rel->tuples)
-				info->tuples = rel->tuples;
-		}
+			cand = (IndexCandidate*)lfirst( cell );
 
-		index_close(indexRelation, NoLock);
+			if( !cand->redundant && cand->penalty == 0 )
+				dropped = check_droppable( query, cursorOptions, boundParams,
+											cand, dropped, actual_plan );
+		}
 
-		indexinfos = lcons(info, indexinfos);
+		list_free( dropped );
 	}
-#endif
+
+	relationInfoActive = false;
+
+	elog( DEBUG3, "IND ADV: analyse_existing_indexes: EXIT" );
+
+	return indexes;
 }
 
-/* Use this function to reset the hooks that are required to be registered only
- * for a short while; these may have been left registered by the previous call, in
- * case of an ERROR.
+/**
+ * droppable_indexes_cost
+ *		returns what re-planning the query without all the indexes that can be
+ * dropped one at a time costs over the actual plan; 0 if there are none, or
+ * they are all unused, since analyse_existing_indexes() hid those together;
+ * -1 if the budget does not allow finding out.
  */
-static void
-resetSecondaryHooks()
+static Cost
+droppable_indexes_cost(	const Query* const query,
+						int cursorOptions,
+						ParamListInfo boundParams,
+						List* indexes,
+						PlannedStmt* actual_plan )
 {
-	get_relation_info_hook		= NULL;
-	explain_get_index_name_hook	= NULL;
+	ListCell	*cell;
+	PlannedStmt	*plan;
+	bool		anyRedundant = false;
+	Cost		cost;
+
+	foreach( cell, indexes )
+	{
+		IndexCandidate *cand = (IndexCandidate*)lfirst( cell );
+
+		if( cand->penalty == 0 )
+		{
+			hidden_index_oids = lappend_oid( hidden_index_oids, cand->idxoid );
+			anyRedundant = anyRedundant || cand->redundant;
+		}
+	}
+
+	if( !anyRedundant || list_length( hidden_index_oids ) < 2
+		|| budget_exceeded() )
+	{
+		cost = anyRedundant && list_length( hidden_index_oids ) > 1 ? -1 : 0;
+
+		list_free( hidden_index_oids );
+		hidden_index_oids = NIL;
+
+		return cost;
+	}
+
+	plan = adviser_planner( copyObject( query ), cursorOptions, boundParams );
+
+	list_free( hidden_index_oids );
+	hidden_index_oids = NIL;
+
+	cost = plan->planTree->total_cost - actual_plan->planTree->total_cost;
+
+	return Max( 0, cost );
 }
 
-static bool
-is_virtual_index( Oid oid, IndexCandidate **cand_out )
+/**
+ * check_droppable
+ *		re-plans the query without the index and those already dropped; if that
+ * costs nothing more, the index is added to the dropped ones, else it is
+ * charged what it costs. Returns the dropped ones. An index that the budget
+ * leaves unchecked is kept.
+ */
+static List*
+check_droppable(	const Query* const query,
+					int cursorOptions,
+					ParamListInfo boundParams,
+					IndexCandidate* cand,
+					List* dropped,
+					PlannedStmt* actual_plan )
 {
-	ListCell *cell1;
+	PlannedStmt	*plan;
+	Cost		penalty;
 
-	foreach( cell1, index_candidates )
+	if( budget_exceeded() )
 	{
-		IndexCandidate *cand = (IndexCandidate*)lfirst( cell1 );
+		cand->penalty = -1;
+		return dropped;
+	}
 
-		if( cand->idxoid == oid )
-		{
-			if( cand_out )
-				*cand_out = cand;
-			return true;
-		}
+	hidden_index_oids = lappend_oid( list_copy( dropped ), cand->idxoid );
+
+	plan = adviser_planner( copyObject( query ), cursorOptions, boundParams );
+
+	penalty = plan->planTree->total_cost - actual_plan->planTree->total_cost;
+
+	if( penalty > 0 )
+	{
+		cand->penalty = penalty;
+		list_free( hidden_index_oids );
+	}
+	else
+	{
+		list_free( dropped );
+		dropped = hidden_index_oids;
 	}
 
-	return false;
+	hidden_index_oids = NIL;
+
+	return dropped;
 }
 
-static const char *
-explain_get_index_name_callback(Oid indexId)
+/**
+ * save_index_usage
+ *		insert the usage of every existing index into IND_ADV_USAGE_TABL
+ */
+static void
+save_index_usage( List* indexes, uint64 fingerprint )
 {
-	StringInfoData buf;
-	IndexCandidate *cand;
+	StringInfoData	query;
+	StringInfoData	cols;
+	StringInfoData	penalty;
+	ListCell		*cell;
 
-	if( is_virtual_index( indexId, &cand ) )
+	elog( DEBUG3, "IND ADV: save_index_usage: ENTER" );
+
+	initStringInfo( &query );
+	initStringInfo( &cols );
+	initStringInfo( &penalty );
+
+	foreach( cell, indexes )
 	{
-		initStringInfo(&buf);
+		IndexCandidate	*cand = (IndexCandidate*)lfirst( cell );
+		int				i;
 
-		appendStringInfo( &buf, "<V-Index>:%d", cand->idxoid );
+		resetStringInfo( &cols );
+		resetStringInfo( &penalty );
 
-		return buf.data;
+		for( i = 0; i < cand->ncols; ++i )
+			appendStringInfo( &cols, "%s%d", (i>0?",":""), cand->varattno[i] );
+
+		if( cand->penalty >= 0 )
+			appendStringInfo( &penalty, "%f", cand->penalty );
+		else
+			appendStringInfoString( &penalty, "null" );
+
+		appendStringInfo( &query, "insert into \""IND_ADV_USAGE_TABL"\""
+									"( indexrelid, reloid, attrs, used,"
+									" redundant, penalty, index_size,"
+									" backend_pid, timestamp, fingerprint,"
+									" weight )"
+									" values"
+									"( %d, %d, array[%s], %s, %s, %s, %d, %d,"
+									" now(), "INT64_FORMAT", %d );",
+									cand->idxoid,
+									cand->reloid,
+									cols.data,
+									cand->idxused ? "true" : "false",
+									cand->redundant ? "true" : "false",
+									penalty.data,
+									cand->pages * BLCKSZ/1024, /* in KBs */
+									MyProcPid,
+									(int64)fingerprint,
+									statement_weight );
 	}
 
-	return NULL;                            /* allow default behavior */
+	execute_advisory_sql( query.data, SPI_OK_INSERT );
+
+	pfree( query.data );
+	pfree( cols.data );
+	pfree( penalty.data );
+
+	elog( DEBUG3, "IND ADV: save_index_usage: EXIT" );
 }
 
 /**
@@ -987,10 +5186,11 @@ explain_get_index_name_callback(Oid indexId)
  *		for every candidate insert an entry into IND_ADV_TABL
  */
 static void
-save_advice( List* candidates )
+save_advice( List* candidates, uint64 fingerprint, const char* sample_kinds )
 {
 	StringInfoData	query;	/* string for Query */
 	StringInfoData	cols;	/* string for Columns */
+	StringInfoData	opts;	/* string for the ordering options */
 	Oid				advise_oid;
 	ListCell		*cell;
 
@@ -1043,74 +5243,419 @@ save_advice( List* candidates )
 			errmsg( IND_ADV_ERROR_NTV );
 			PG_RE_THROW();
 		}
-		PG_END_TRY();
-#endif
-	}
-	else
-	{
-		/* FIXME: add errdetail() and/or errcontext() calls here. */
-		ereport(ERROR,
-				(errcode(ERRCODE_UNDEFINED_TABLE),
-				 errmsg( IND_ADV_ERROR_NE )));
-	}
+		PG_END_TRY();
+#endif
+	}
+	else
+	{
+		/* FIXME: add errdetail() and/or errcontext() calls here. */
+		ereport(ERROR,
+				(errcode(ERRCODE_UNDEFINED_TABLE),
+				 errmsg( IND_ADV_ERROR_NE )));
+	}
+
+	initStringInfo( &query );
+	initStringInfo( &cols );
+	initStringInfo( &opts );
+
+	foreach( cell, candidates )
+	{
+		int i;
+		IndexCandidate* idxcd = (IndexCandidate*)lfirst( cell );
+
+		if( !idxcd->idxused || idxcd->assumed )
+			continue;
+
+		PG_TRACE3( index_adviser__advice, idxcd->reloid, idxcd->ncols,
+					idxcd->pages );
+
+		/* the ordering options, if any column has them */
+		resetStringInfo( &opts );
+
+		for (i = 0; i < idxcd->ncols; ++i)
+			if( idxcd->coloptions[i] != 0 )
+				break;
+
+		if( i < idxcd->ncols )
+		{
+			appendStringInfoString( &opts, "array[" );
+
+			for (i = 0; i < idxcd->ncols; ++i)
+				appendStringInfo( &opts, "%s%d", (i>0?",":""),
+									idxcd->coloptions[i] );
+
+			appendStringInfoChar( &opts, ']' );
+		}
+		else
+			appendStringInfoString( &opts, "null" );
+
+		/* pfree() the memory allocated for the previous candidate. FIXME: Avoid
+		 * meddling with the internals of a StringInfo, and try to use an API.
+		 */
+		if( cols.len > 0 )
+		{
+			pfree( cols.data );
+			cols.data = NULL;
+		}
+
+		initStringInfo( &cols );
+
+		for (i = 0; i < idxcd->ncols; ++i)
+			appendStringInfo( &cols, "%s%d", (i>0?",":""), idxcd->varattno[i]);
+
+		appendStringInfo( &query, "insert into \""IND_ADV_TABL"\""
+									"( reloid, attrs, coloptions, benefit,"
+									" index_size, backend_pid, timestamp,"
+									" fingerprint, weight )"
+									" values"
+									"( %d, array[%s], %s, %f, %d, %d, now(),"
+									" "INT64_FORMAT", %d );",
+									idxcd->reloid,
+									cols.data,
+									opts.data,
+									idxcd->benefit,
+									idxcd->pages * BLCKSZ/1024, /* in KBs */
+									MyProcPid,
+									(int64)fingerprint,
+									statement_weight );
+
+		/* the benefit for each sample of parameter values */
+		for (i = 0; i < idxcd->nsamples; ++i)
+			appendStringInfo( &query, "insert into \""IND_ADV_SAMPLES_TABL"\""
+										"( reloid, attrs, sample, kind, benefit,"
+										" backend_pid, timestamp, fingerprint )"
+										" values"
+										"( %d, array[%s], %d, '%c', %f, %d,"
+										" now(), "INT64_FORMAT" );",
+										idxcd->reloid,
+										cols.data,
+										i,
+										sample_kinds[i],
+										idxcd->sample_benefit[i],
+										MyProcPid,
+										(int64)fingerprint );
+	} /* foreach cell in candidates */
+
+	if( query.len > 0 )	/* if we generated any SQL */
+	{
+		if( SPI_connect() == SPI_OK_CONNECT )
+		{
+			if( SPI_execute( query.data, false, 0 ) != SPI_OK_INSERT )
+					elog( WARNING, "IND ADV: SPI_execute failed while saving advice." );
+
+			if( SPI_finish() != SPI_OK_FINISH )
+				elog( WARNING, "IND ADV: SPI_finish failed while saving advice." );
+		}
+		else
+			elog( WARNING, "IND ADV: SPI_connect failed while saving advice." );
+	}
+
+	/* TODO: Propose to -hackers to introduce API to free a StringInfoData . */
+	if ( query.len > 0 )
+		pfree( query.data );
+
+	if ( cols.len > 0 )
+		pfree( cols.data );
+
+	pfree( opts.data );
+
+	elog( DEBUG3, "IND ADV: save_advice: EXIT" );
+}
+
+/**
+ * estimate_selectivity
+ *		estimates, from pg_statistic, the fraction of the rows of the table of
+ * a single-column candidate that "column op other" selects; when other is not
+ * a constant, the fraction for the value that selects the fewest rows. Returns
+ * 0 if it cannot tell.
+ */
+static float4
+estimate_selectivity(	const IndexCandidate* const cand,
+						Oid opno,
+						Node* other,
+						bool varonleft )
+{
+	HeapTuple	tuple;
+	Form_pg_statistic stats;
+	List		*opfamilies;
+	List		*opstrats;
+	bool		equality;
+	bool		isconst;
+	Datum		*values;
+	int			nvalues = 0;
+	float4		*numbers;
+	int			nnumbers = 0;
+	float8		ndistinct;
+	float8		nullfrac;
+	float8		mcvfrac = 0;		/* of the rows, the MCVs take */
+	float8		mcvsel = 0;			/* of the rows, the MCVs selected take */
+	float8		minmcv = 1;
+	float8		sel = 0;
+	FmgrInfo	opproc;
+	int			i;
+
+	while( other != NULL && IsA( other, RelabelType ) )
+		other = (Node*)((RelabelType*)other)->arg;
+
+	isconst = other != NULL && IsA( other, Const )
+				&& !((Const*)other)->constisnull;
+
+	get_op_btree_interpretation( opno, &opfamilies, &opstrats );
+
+	equality = list_member_int( opstrats, BTEqualStrategyNumber );
+
+	list_free( opfamilies );
+	list_free( opstrats );
+
+	/* a range over an unknown value may be as narrow as it gets */
+	if( !equality && !isconst )
+		return 0;
+
+	tuple = SearchSysCache( STATRELATT,
+							ObjectIdGetDatum( cand->reloid ),
+							Int16GetDatum( cand->varattno[0] ),
+							0, 0 );
+
+	if( !HeapTupleIsValid( tuple ) )
+		return 0;
+
+	stats = (Form_pg_statistic)GETSTRUCT( tuple );
+
+	nullfrac = stats->stanullfrac;
+
+	if( stats->stadistinct >= 0 )
+		ndistinct = stats->stadistinct;
+	else
+	{
+		HeapTuple classtup = SearchSysCache( RELOID,
+											ObjectIdGetDatum( cand->reloid ),
+											0, 0, 0 );
+
+		ndistinct = 0;
+
+		if( HeapTupleIsValid( classtup ) )
+		{
+			ndistinct = -stats->stadistinct
+						* ((Form_pg_class)GETSTRUCT( classtup ))->reltuples;
+
+			ReleaseSysCache( classtup );
+		}
+	}
+
+	if( isconst )
+		fmgr_info( get_opcode( opno ), &opproc );
+
+	/* the most common values */
+	if( get_attstatsslot( tuple, cand->vartype[0], -1,
+							STATISTIC_KIND_MCV, InvalidOid,
+							&values, &nvalues, &numbers, &nnumbers ) )
+	{
+		for( i = 0; i < nnumbers; ++i )
+		{
+			mcvfrac += numbers[i];
+			minmcv = Min( minmcv, numbers[i] );
+
+			if( isconst
+				&& DatumGetBool( varonleft
+						? FunctionCall2( &opproc, values[i],
+											((Const*)other)->constvalue )
+						: FunctionCall2( &opproc, ((Const*)other)->constvalue,
+											values[i] ) ) )
+				mcvsel += numbers[i];
+		}
+
+		free_attstatsslot( cand->vartype[0], values, nvalues,
+							numbers, nnumbers );
+	}
+
+	if( equality )
+	{
+		/* what each of the values that are not among the MCVs take */
+		float8 othersel = ndistinct > nnumbers
+							? (1 - mcvfrac - nullfrac) / (ndistinct - nnumbers)
+							: 0;
+
+		if( isconst && mcvsel > 0 )
+			sel = mcvsel;
+		else if( isconst || nnumbers == 0 )
+			sel = othersel;
+		else
+			sel = othersel > 0 ? Min( minmcv, othersel ) : minmcv;
+	}
+	else
+	{
+		/* the share of the histogram that qualifies, of the other rows */
+		if( get_attstatsslot( tuple, cand->vartype[0], -1,
+								STATISTIC_KIND_HISTOGRAM, InvalidOid,
+								&values, &nvalues, NULL, NULL ) )
+		{
+			int nselected = 0;
+
+			for( i = 0; i < nvalues; ++i )
+				if( DatumGetBool( varonleft
+						? FunctionCall2( &opproc, values[i],
+											((Const*)other)->constvalue )
+						: FunctionCall2( &opproc, ((Const*)other)->constvalue,
+											values[i] ) ) )
+					++nselected;
+
+			if( nvalues > 0 )
+				sel = mcvsel + (1 - mcvfrac - nullfrac)
+								* ((float8)nselected / nvalues);
+
+			free_attstatsslot( cand->vartype[0], values, nvalues, NULL, 0 );
+		}
+		else if( nnumbers > 0 )
+			sel = mcvsel;
+	}
+
+	ReleaseSysCache( tuple );
+
+	return (float4)Max( 0, Min( 1, sel ) );
+}
+
+/**
+ * range_bound
+ *		tells which bound of a range "column op other" sets: 1 for a lower
+ * bound, -1 for an upper one, and 0 if op is not an inequality.
+ */
+static int8
+range_bound( Oid opno, bool varonleft )
+{
+	List	*opfamilies;
+	List	*opstrats;
+	int8	bound = 0;
+
+	get_op_btree_interpretation( opno, &opfamilies, &opstrats );
+
+	if( opstrats != NIL )
+		switch( linitial_int( opstrats ) )
+		{
+			case BTLessStrategyNumber:
+			case BTLessEqualStrategyNumber:
+				bound = -1;
+			break;
+
+			case BTGreaterStrategyNumber:
+			case BTGreaterEqualStrategyNumber:
+				bound = 1;
+			break;
+
+			default:
+			break;
+		}
 
-	initStringInfo( &query );
-	initStringInfo( &cols );
+	list_free( opfamilies );
+	list_free( opstrats );
 
-	foreach( cell, candidates )
+	return varonleft ? bound : -bound;
+}
+
+/**
+ * combine_range_bounds
+ *		a column that list1 and list2, the candidates of two ANDed clauses,
+ * bound from opposite sides is in a range narrower than either bound; like
+ * clauselist_selectivity(), its selectivity is that of the lower bound plus
+ * that of the upper one, less 1. If that is not positive, the estimates
+ * cannot tell, and it is 0.
+ */
+static void
+combine_range_bounds( List* list1, List* list2 )
+{
+	ListCell	*cell1;
+	ListCell	*cell2;
+
+	foreach( cell1, list1 )
 	{
-		int i;
-		IndexCandidate* idxcd = (IndexCandidate*)lfirst( cell );
+		IndexCandidate *cand1 = (IndexCandidate*)lfirst( cell1 );
 
-		if( !idxcd->idxused )
+		if( cand1->ncols != 1 || cand1->bound == 0 )
 			continue;
 
-		/* pfree() the memory allocated for the previous candidate. FIXME: Avoid
-		 * meddling with the internals of a StringInfo, and try to use an API.
-		 */
-		if( cols.len > 0 )
+		foreach( cell2, list2 )
 		{
-			pfree( cols.data );
-			cols.data = NULL;
+			IndexCandidate *cand2 = (IndexCandidate*)lfirst( cell2 );
+			float4			sel;
+
+			/* in a self-join, the same column of two different rows */
+			if( cand2->bound != -cand1->bound
+				|| cand2->varno != cand1->varno
+				|| cand2->varlevelsup != cand1->varlevelsup
+				|| compare_candidates( cand1, cand2 ) != 0 )
+				continue;
+
+			sel = Max( 0, cand1->selectivity + cand2->selectivity - 1 );
+
+			cand1->selectivity = cand2->selectivity = sel;
+			cand1->bound = cand2->bound = 0;
 		}
+	}
+}
 
-		initStringInfo( &cols );
+/**
+ * estimate_null_selectivity
+ *		estimates the fraction of the rows of the table of a single-column
+ * candidate that "column IS [NOT] NULL" selects; 0 if it cannot tell.
+ */
+static float4
+estimate_null_selectivity(	const IndexCandidate* const cand,
+							NullTestType type )
+{
+	HeapTuple	tuple;
+	float4		nullfrac;
 
-		for (i = 0; i < idxcd->ncols; ++i)
-			appendStringInfo( &cols, "%s%d", (i>0?",":""), idxcd->varattno[i]);
+	tuple = SearchSysCache( STATRELATT,
+							ObjectIdGetDatum( cand->reloid ),
+							Int16GetDatum( cand->varattno[0] ),
+							0, 0 );
 
-		/* FIXME: Mention the column names explicitly after the table name. */
-		appendStringInfo( &query, "insert into \""IND_ADV_TABL"\" values"
-									"( %d, array[%s], %f, %d, %d, now());",
-									idxcd->reloid,
-									cols.data,
-									idxcd->benefit,
-									idxcd->pages * BLCKSZ/1024, /* in KBs */
-									MyProcPid );
-	} /* foreach cell in candidates */
+	if( !HeapTupleIsValid( tuple ) )
+		return 0;
 
-	if( query.len > 0 )	/* if we generated any SQL */
+	nullfrac = ((Form_pg_statistic)GETSTRUCT( tuple ))->stanullfrac;
+
+	ReleaseSysCache( tuple );
+
+	return type == IS_NULL ? nullfrac : 1 - nullfrac;
+}
+
+/**
+ * remove_unselective_candidates
+ *		removes the single-column candidates whose clauses select more than
+ * index_adviser.max_selectivity of their table even at best; a sequential
+ * scan serves those better.
+ */
+static List*
+remove_unselective_candidates( List* candidates )
+{
+	ListCell	*prev,
+				*cell,
+				*next;
+
+	elog( DEBUG3, "IND ADV: remove_unselective_candidates: ENTER" );
+
+	for( prev = NULL, cell = list_head( candidates ); cell != NULL; cell = next )
 	{
-		if( SPI_connect() == SPI_OK_CONNECT )
+		IndexCandidate *cand = (IndexCandidate*)lfirst( cell );
+
+		next = lnext( cell );
+
+		if( cand->ncols == 1 && cand->selectivity > max_selectivity )
 		{
-			if( SPI_execute( query.data, false, 0 ) != SPI_OK_INSERT )
-					elog( WARNING, "IND ADV: SPI_execute failed while saving advice." );
+			elog( DEBUG1, "IND ADV: candidate %d(%d) selects %.3f of its table",
+							cand->reloid, cand->varattno[0],
+							cand->selectivity );
 
-			if( SPI_finish() != SPI_OK_FINISH )
-				elog( WARNING, "IND ADV: SPI_finish failed while saving advice." );
+			pfree( cand );
+			candidates = list_delete_cell( candidates, cell, prev );
 		}
 		else
-			elog( WARNING, "IND ADV: SPI_connect failed while saving advice." );
+			prev = cell;
 	}
 
-	/* TODO: Propose to -hackers to introduce API to free a StringInfoData . */
-	if ( query.len > 0 )
-		pfree( query.data );
-
-	if ( cols.len > 0 )
-		pfree( cols.data );
+	elog( DEBUG3, "IND ADV: remove_unselective_candidates: EXIT" );
 
-	elog( DEBUG3, "IND ADV: save_advice: EXIT" );
+	return candidates;
 }
 
 /**
@@ -1193,10 +5738,14 @@ remove_irrelevant_candidates( List* candidates )
 															AccessShareLock );
 				IndexInfo	*old_index_info	= BuildIndexInfo( old_index_rel );
 
-				/* We ignore expressional indexes and partial indexes */
+				/*
+				 * We ignore expressional indexes and partial indexes, and
+				 * those hidden by index_adviser.hide_indexes
+				 */
 				if( old_index_rel->rd_index->indisvalid
 					&& old_index_info->ii_Expressions == NIL
-					&& old_index_info->ii_Predicate == NIL )
+					&& old_index_info->ii_Predicate == NIL
+					&& !list_member_oid( hidden_index_oids, old_index_oid ) )
 				{
 					ListCell *cell2;
 					ListCell *prev2;
@@ -1228,6 +5777,11 @@ remove_irrelevant_candidates( List* candidates )
 							/* FIXME: should this while condition be: cmp==0&&(i<min(ncols,ii_NumIndexAttrs))
  							 * maybe this is to eliminate candidates that are a prefix match of an existing index. */
 							} while((cmp == 0) && (i < cand->ncols));
+
+							/* and in the same order */
+							for(i = 0; (cmp == 0) && (i < cand->ncols); ++i)
+								cmp = cand->coloptions[i]
+										- old_index_rel->rd_indoption[i];
 						}
 
 						if(cmp != 0)
@@ -1521,64 +6075,513 @@ scan_query(	const Query* const query,
 					List* rangeTableStack )
 {
 	const ListCell*	cell;
-	List*		candidates		= NIL;
-	List*		newCandidates	= NIL;
+	List*		candidates		= NIL;
+	List*		newCandidates	= NIL;
+
+	elog( DEBUG3, "IND ADV: scan_query: ENTER" );
+
+	/* add the current rangetable to the stack */
+	rangeTableStack = lcons( query->rtable, rangeTableStack );
+
+	/*
+	 * scan sub-queries; these include the arms of a UNION, INTERSECT or
+	 * EXCEPT, which query->setOperations refers to by their range table index
+	 */
+	foreach( cell, query->rtable )
+	{
+		const RangeTblEntry* const rte = (const RangeTblEntry*)lfirst( cell );
+
+		if( rte->subquery )
+		{
+			candidates = merge_candidates( candidates, scan_query(
+															rte->subquery,
+															opnos,
+															rangeTableStack));
+		}
+	}
+
+	/* scan the sub-queries in the select-list and in "having" */
+	candidates = merge_candidates( candidates,
+									scan_subqueries( (Node*)query->targetList,
+													opnos, rangeTableStack ) );
+
+	candidates = merge_candidates( candidates,
+									scan_subqueries( query->havingQual,
+													opnos, rangeTableStack ) );
+
+	/* scan "where" from the current query */
+	if( query->jointree->quals != NULL )
+	{
+		newCandidates = scan_generic_node(	query->jointree->quals, opnos,
+											rangeTableStack );
+	}
+
+	/* scan the "join ... on" conditions */
+	candidates = merge_candidates( candidates,
+									scan_jointree( (Node*)query->jointree,
+													opnos, rangeTableStack ) );
+
+	/*
+	 * Indexes that return the rows in the order of ORDER BY or GROUP BY, once
+	 * past the columns compared for equality, like (tenant_id, created_at)
+	 * for "where tenant_id = $1 order by created_at desc limit 50".
+	 */
+	if( query->sortClause != NIL )
+		candidates = merge_candidates( candidates,
+							scan_ordered_candidates( query, query->sortClause ) );
+
+	if( query->groupClause != NIL )
+		candidates = merge_candidates( candidates,
+							scan_ordered_candidates( query, query->groupClause ) );
+
+	/* the foreign keys of the tables in the current query */
+	if( foreign_key_candidates )
+		candidates = merge_candidates( candidates, scan_foreign_keys( query ) );
+
+	/*
+	 * scan_ordered_candidates() above stops at the first GROUP BY or ORDER BY
+	 * entry that is not a column of the table it started with; the columns
+	 * from there on, of the other tables, or of an outer query, are still
+	 * candidates on their own, if the WHERE clause had none. The ones it did
+	 * cover come out the same, and merge_candidates() keeps one of each.
+	 */
+
+	/* if no indexcadidate found in "where", scan "group" */
+	if( ( newCandidates == NIL ) && ( query->groupClause != NULL ) )
+	{
+		newCandidates = scan_group_clause(	query->groupClause,
+											query->targetList,
+											opnos,
+											rangeTableStack );
+	}
+
+	/* if no indexcadidate found in "group", scan "order by" */
+	if( ( newCandidates == NIL ) && ( query->sortClause != NULL ) )
+	{
+		newCandidates = scan_group_clause(	query->sortClause,
+											query->targetList,
+											opnos,
+											rangeTableStack );
+	}
+
+	/* remove the current rangetable from the stack */
+	rangeTableStack = list_delete_ptr( rangeTableStack, query->rtable );
+
+	/* merge indexcandiates */
+	candidates = merge_candidates( candidates, newCandidates );
+
+	elog( DEBUG3, "IND ADV: scan_query: EXIT" );
+
+	return candidates;
+}
+
+/**
+ * scan_jointree
+ *    Runs thru the join-tree looking for candidates in the conditions of
+ * explicit JOINs; the quals of the top-level FromExpr, that is the WHERE
+ * clause, are scanned by the caller.
+ */
+static List*
+scan_jointree(	const Node* const jtnode,
+				List* const opnos,
+				List* const rangeTableStack )
+{
+	const ListCell*	cell;
+	List*		candidates = NIL;
+
+	if( jtnode == NULL )
+		return NIL;
+
+	if( IsA( jtnode, FromExpr ) )
+	{
+		foreach( cell, ((const FromExpr*)jtnode)->fromlist )
+			candidates = merge_candidates( candidates,
+									scan_jointree( (const Node*)lfirst( cell ),
+													opnos, rangeTableStack ) );
+	}
+	else if( IsA( jtnode, JoinExpr ) )
+	{
+		const JoinExpr* const join = (const JoinExpr*)jtnode;
+
+		if( join->quals != NULL )
+			candidates = scan_generic_node( join->quals, opnos,
+											rangeTableStack );
+
+		candidates = merge_candidates( candidates,
+									scan_jointree( join->larg, opnos,
+													rangeTableStack ) );
+
+		candidates = merge_candidates( candidates,
+									scan_jointree( join->rarg, opnos,
+													rangeTableStack ) );
+	}
+
+	/* a RangeTblRef has nothing to scan */
+
+	return candidates;
+}
+
+/**
+ * scan_ordered_candidates
+ *    Builds a candidate that returns the rows of a table in the order of the
+ * given ORDER BY or GROUP BY list: the columns compared to a constant or a
+ * parameter with = in the WHERE clause, followed by the leading columns of the
+ * list that belong to the same table, in the same direction.
+ */
+static List*
+scan_ordered_candidates(	const Query* const query,
+							List* const sortList )
+{
+	const ListCell*	cell;
+	IndexCandidate*	cand;
+	const RangeTblEntry* rte = NULL;
+	Index		varno = 0;
+	List*		quals;
+	int			i;
+	bool		flip = false;
+
+	elog( DEBUG3, "IND ADV: scan_ordered_candidates: ENTER" );
+
+	cand = (IndexCandidate*)palloc0( sizeof(IndexCandidate) );
+
+	/* the top-level AND-ed conditions of the WHERE clause */
+	quals = make_ands_implicit( (Expr*)query->jointree->quals );
+
+	/* the leading sort columns, all from one table */
+	foreach( cell, sortList )
+	{
+		const SortClause* const sortcl = (const SortClause*)lfirst( cell );
+		const TargetEntry* const tle = get_sortgroupclause_tle(
+											(SortClause*)sortcl,
+											query->targetList );
+		Node*	expr = (Node*)tle->expr;
+		Var*	var;
+		Oid		opfamily;
+		Oid		opcintype;
+		int16	strategy;
+		int16	options = 0;
+
+		while( IsA( expr, RelabelType ) )
+			expr = (Node*)((RelabelType*)expr)->arg;
+
+		if( !IsA( expr, Var ) || ((Var*)expr)->varlevelsup != 0
+			|| ((Var*)expr)->varattno <= 0
+			|| cand->ncols >= INDEX_MAX_KEYS )
+			break;
+
+		var = (Var*)expr;
+
+		if( varno == 0 )
+		{
+			Relation base_rel;
+			bool	 supported;
+
+			rte = rt_fetch( var->varno, query->rtable );
+
+			if( rte->rtekind != RTE_RELATION )
+				break;
+
+			/* the same restrictions as for the candidates from the clauses */
+			base_rel = heap_open( rte->relid, AccessShareLock );
+
+			supported = !base_rel->rd_istemp && !IsSystemRelation( base_rel )
+						&& base_rel->rd_rel->relpages > 1
+						&& base_rel->rd_rel->reltuples > 1;
+
+			heap_close( base_rel, AccessShareLock );
+
+			if( !supported )
+				break;
+
+			varno = var->varno;
+		}
+		else if( var->varno != varno )
+			break;
+
+		if( get_ordering_op_properties( sortcl->sortop, &opfamily, &opcintype,
+										&strategy )
+			&& strategy == BTGreaterStrategyNumber )
+			options |= INDOPTION_DESC;
+
+		if( sortcl->nulls_first )
+			options |= INDOPTION_NULLS_FIRST;
+
+		/*
+		 * An index can be scanned backwards, so the first sort column is
+		 * always ascending, and the options of the others are relative to it.
+		 */
+		if( cand->ncols == 0 )
+			flip = (options & INDOPTION_DESC) != 0;
+
+		if( flip )
+			options ^= (INDOPTION_DESC | INDOPTION_NULLS_FIRST);
+
+		cand->varattno[ cand->ncols ]	= var->varattno;
+		cand->vartype[ cand->ncols ]	= var->vartype;
+		cand->coloptions[ cand->ncols ]	= options;
+		++cand->ncols;
+	}
+
+	if( cand->ncols == 0 )
+	{
+		pfree( cand );
+		list_free( quals );
+		return NIL;
+	}
+
+	/* the equality conditions on the same table go in front */
+	foreach( cell, quals )
+	{
+		const Node* const qual = (const Node*)lfirst( cell );
+		Node*		left;
+		Node*		right;
+		Var*		var;
+		List*		opfamilies;
+		List*		opstrats;
+		bool		equality;
+
+		if( !IsA( qual, OpExpr )
+			|| list_length( ((const OpExpr*)qual)->args ) != 2 )
+			continue;
+
+		left	= (Node*)linitial( ((const OpExpr*)qual)->args );
+		right	= (Node*)lsecond( ((const OpExpr*)qual)->args );
+
+		while( IsA( left, RelabelType ) )
+			left = (Node*)((RelabelType*)left)->arg;
+
+		while( IsA( right, RelabelType ) )
+			right = (Node*)((RelabelType*)right)->arg;
+
+		if( !IsA( left, Var ) )
+		{
+			Node *tmp = left;
+
+			left	= right;
+			right	= tmp;
+		}
+
+		if( !IsA( left, Var ) || ((Var*)left)->varno != varno
+			|| ((Var*)left)->varlevelsup != 0 || ((Var*)left)->varattno <= 0
+			|| contain_vars_of_level( right, 0 ) )
+			continue;
+
+		var = (Var*)left;
+
+		get_op_btree_interpretation( ((const OpExpr*)qual)->opno,
+										&opfamilies, &opstrats );
+
+		equality = list_member_int( opstrats, BTEqualStrategyNumber );
+
+		list_free( opfamilies );
+		list_free( opstrats );
+
+		if( !equality )
+			continue;
+
+		/* skip a column already in the candidate */
+		for( i = 0; i < cand->ncols; ++i )
+			if( cand->varattno[i] == var->varattno )
+				break;
+
+		/*
+		 * A sort column that is compared for equality orders nothing; move it
+		 * to the front, with the other equality columns.
+		 */
+		if( i < cand->ncols )
+		{
+			if( cand->coloptions[i] == -1 )
+				continue;
+
+			memmove( &cand->varattno[1], &cand->varattno[0],
+						i * sizeof(AttrNumber) );
+			memmove( &cand->vartype[1], &cand->vartype[0], i * sizeof(Oid) );
+			memmove( &cand->coloptions[1], &cand->coloptions[0],
+						i * sizeof(int16) );
+		}
+		else
+		{
+			if( cand->ncols >= INDEX_MAX_KEYS )
+				continue;
+
+			memmove( &cand->varattno[1], &cand->varattno[0],
+						cand->ncols * sizeof(AttrNumber) );
+			memmove( &cand->vartype[1], &cand->vartype[0],
+						cand->ncols * sizeof(Oid) );
+			memmove( &cand->coloptions[1], &cand->coloptions[0],
+						cand->ncols * sizeof(int16) );
+			++cand->ncols;
+		}
+
+		cand->varattno[0]	= var->varattno;
+		cand->vartype[0]	= var->vartype;
+		cand->coloptions[0]	= -1;	/* marks an equality column for now */
+	}
+
+	list_free( quals );
+
+	for( i = 0; i < cand->ncols; ++i )
+		if( cand->coloptions[i] == -1 )
+			cand->coloptions[i] = 0;
+
+	cand->varno			= varno;
+	cand->varlevelsup	= 0;
+	cand->reloid		= rte->relid;
+
+	elog( DEBUG3, "IND ADV: scan_ordered_candidates: EXIT" );
+
+	return list_make1( cand );
+}
+
+/**
+ * scan_foreign_keys
+ *    Builds a candidate on the referencing columns of every foreign key of the
+ * tables in the query, unless an existing index leads with those columns.
+ */
+static List*
+scan_foreign_keys( const Query* const query )
+{
+	const ListCell*	cell;
+	List*		candidates = NIL;
+	Relation	conrel;
 
-	elog( DEBUG3, "IND ADV: scan_query: ENTER" );
+	elog( DEBUG3, "IND ADV: scan_foreign_keys: ENTER" );
 
-	/* add the current rangetable to the stack */
-	rangeTableStack = lcons( query->rtable, rangeTableStack );
+	conrel = heap_open( ConstraintRelationId, AccessShareLock );
 
-	/* scan sub-queries */
 	foreach( cell, query->rtable )
 	{
 		const RangeTblEntry* const rte = (const RangeTblEntry*)lfirst( cell );
+		Relation		base_rel;
+		List			*index_oids;
+		ScanKeyData		key;
+		SysScanDesc		scan;
+		HeapTuple		tuple;
 
-		if( rte->subquery )
+		if( rte->rtekind != RTE_RELATION )
+			continue;
+
+		base_rel = heap_open( rte->relid, AccessShareLock );
+
+		/* the same restrictions as for the candidates from the clauses */
+		if( base_rel->rd_istemp || IsSystemRelation( base_rel )
+			|| base_rel->rd_rel->relpages <= 1
+			|| base_rel->rd_rel->reltuples <= 1 )
 		{
-			candidates = merge_candidates( candidates, scan_query(
-															rte->subquery,
-															opnos,
-															rangeTableStack));
+			heap_close( base_rel, AccessShareLock );
+			continue;
 		}
-	}
 
-	/* scan "where" from the current query */
-	if( query->jointree->quals != NULL )
-	{
-		newCandidates = scan_generic_node(	query->jointree->quals, opnos,
-											rangeTableStack );
-	}
+		index_oids = RelationGetIndexList( base_rel );
 
-	/* FIXME: Why don't we consider the GROUP BY and ORDER BY clause
-	 * irrespective of whether we found candidates in WHERE clause?
-	 */
+		ScanKeyInit( &key,
+					Anum_pg_constraint_conrelid,
+					BTEqualStrategyNumber, F_OIDEQ,
+					ObjectIdGetDatum( rte->relid ) );
 
-	/* if no indexcadidate found in "where", scan "group" */
-	if( ( newCandidates == NIL ) && ( query->groupClause != NULL ) )
-	{
-		newCandidates = scan_group_clause(	query->groupClause,
-											query->targetList,
-											opnos,
-											rangeTableStack );
-	}
+		scan = systable_beginscan( conrel, ConstraintRelidIndexId, true,
+									SnapshotNow, 1, &key );
 
-	/* if no indexcadidate found in "group", scan "order by" */
-	if( ( newCandidates == NIL ) && ( query->sortClause != NULL ) )
-	{
-		newCandidates = scan_group_clause(	query->sortClause,
-											query->targetList,
-											opnos,
-											rangeTableStack );
-	}
+		while( HeapTupleIsValid( tuple = systable_getnext( scan ) ) )
+		{
+			Form_pg_constraint	con = (Form_pg_constraint)GETSTRUCT( tuple );
+			Datum				conkey;
+			bool				isnull;
+			Datum				*keys;
+			int					nkeys;
+			bool				covered = false;
+			ListCell			*index_cell;
+			IndexCandidate		*cand;
+			int					i;
+
+			if( con->contype != CONSTRAINT_FOREIGN )
+				continue;
+
+			conkey = heap_getattr( tuple, Anum_pg_constraint_conkey,
+									RelationGetDescr( conrel ), &isnull );
+			if( isnull )
+				continue;
+
+			deconstruct_array( DatumGetArrayTypeP( conkey ),
+								INT2OID, 2, true, 's',
+								&keys, NULL, &nkeys );
+
+			if( nkeys > INDEX_MAX_KEYS )
+			{
+				pfree( keys );
+				continue;
+			}
 
-	/* remove the current rangetable from the stack */
-	rangeTableStack = list_delete_ptr( rangeTableStack, query->rtable );
+			/* an index whose leading columns are the keys, in any order */
+			foreach( index_cell, index_oids )
+			{
+				HeapTuple		index_tuple;
+				Form_pg_index	index;
+				int				j;
 
-	/* merge indexcandiates */
-	candidates = merge_candidates( candidates, newCandidates );
+				index_tuple = SearchSysCache( INDEXRELID,
+									ObjectIdGetDatum( lfirst_oid( index_cell ) ),
+									0, 0, 0 );
+				if( !HeapTupleIsValid( index_tuple ) )
+					continue;
 
-	elog( DEBUG3, "IND ADV: scan_query: EXIT" );
+				index = (Form_pg_index)GETSTRUCT( index_tuple );
+
+				if( index->indisvalid && index->indnatts >= nkeys
+					&& heap_attisnull( index_tuple, Anum_pg_index_indpred ) )
+				{
+					for( i = 0; i < nkeys; ++i )
+					{
+						for( j = 0; j < nkeys; ++j )
+							if( index->indkey.values[j]
+								== DatumGetInt16( keys[i] ) )
+								break;
+
+						if( j == nkeys )
+							break;
+					}
+
+					covered = (i == nkeys);
+				}
+
+				ReleaseSysCache( index_tuple );
+
+				if( covered )
+					break;
+			}
+
+			if( !covered )
+			{
+				cand = (IndexCandidate*)palloc0( sizeof(IndexCandidate) );
+
+				cand->varno			= -1;
+				cand->varlevelsup	= -1;
+				cand->reloid		= rte->relid;
+				cand->ncols			= nkeys;
+
+				for( i = 0; i < nkeys; ++i )
+				{
+					cand->varattno[i]	= DatumGetInt16( keys[i] );
+					cand->vartype[i]	= get_atttype( rte->relid,
+														cand->varattno[i] );
+				}
+
+				candidates = merge_candidates( candidates, list_make1( cand ) );
+			}
+
+			pfree( keys );
+		}
+
+		systable_endscan( scan );
+
+		list_free( index_oids );
+
+		heap_close( base_rel, AccessShareLock );
+	}
+
+	heap_close( conrel, AccessShareLock );
+
+	elog( DEBUG3, "IND ADV: scan_foreign_keys: EXIT" );
 
 	return candidates;
 }
@@ -1621,42 +6624,112 @@ scan_group_clause(	List* const groupList,
 	return candidates;
 }
 
+/* State of the walkers below, while scanning one expression */
+typedef struct ScanContext {
+	List*	opnos;				/* the B-tree operators */
+	List*	rangeTableStack;	/* the range tables, innermost first */
+	List*	candidates;			/* found so far, sorted */
+} ScanContext;
+
 /**
  * scan_generic_node
  *    Runs thru the given Node looking for columns to create index candidates.
  *
- * TODO: Convert it to use expression_tree_walker().
+ *    The clause shapes a B-tree index can serve, and the candidates they make:
+ *
+ *	col op expr, expr op col	(op a B-tree operator)		col
+ *	col op ANY (array)			(op a B-tree operator)		col
+ *	col IS [NOT] NULL										col
+ *	(col1, col2) op (...)		(op a B-tree operator)		col1, (col1,col2)
+ *	(...) op (col1, col2)		(op a B-tree operator)		col1, (col1,col2)
+ *	a AND b					the candidates of a and b, and their composites
+ *	a OR b, NOT a			the candidates of a and b
+ *
+ * A column in any other kind of expression, like a function call, a CASE or
+ * a COALESCE, cannot use a plain index; such expressions are only looked into
+ * for subqueries.
  */
 static List*
 scan_generic_node(	const Node* const root,
 							List* const opnos,
 							List* const rangeTableStack )
 {
-	ListCell*		cell;
-	List*			candidates = NIL;
+	ScanContext context;
 
 	elog( DEBUG3, "IND ADV: scan_generic_node: ENTER" );
 
 	Assert( root != NULL );
 
-	switch( nodeTag( root ) )
+	context.opnos			= opnos;
+	context.rangeTableStack	= rangeTableStack;
+	context.candidates		= NIL;
+
+	scan_clause_walker( (Node*)root, &context );
+
+	elog( DEBUG3, "IND ADV: scan_generic_node: EXIT" );
+
+	return context.candidates;
+}
+
+/**
+ * scan_subqueries
+ *    Runs thru the given Node looking for subqueries, and returns the
+ * candidates found in them; the columns of the Node itself are not candidates.
+ */
+static List*
+scan_subqueries(	const Node* const root,
+					List* const opnos,
+					List* const rangeTableStack )
+{
+	ScanContext context;
+
+	if( root == NULL )
+		return NIL;
+
+	context.opnos			= opnos;
+	context.rangeTableStack	= rangeTableStack;
+	context.candidates		= NIL;
+
+	scan_subqueries_walker( (Node*)root, &context );
+
+	return context.candidates;
+}
+
+/**
+ * scan_clause_walker
+ *    The walker for scan_generic_node(), for the nodes in a position where a
+ * column can use an index.
+ */
+static bool
+scan_clause_walker( Node* node, ScanContext* context )
+{
+	ListCell* cell;
+	int		i;
+
+	if( node == NULL )
+		return false;
+
+	switch( nodeTag( node ) )
 	{
-		/* if the node is an aggregate */
-		case T_Aggref:
+		/* if this case is reached, the variable is an index-candidate */
+		case T_Var:
 		{
-			const Aggref* const aggref = (const Aggref*)root;
-			const Node* const   list   = (const Node*)aggref->args;
+			IndexCandidate *cand = make_var_candidate( (Var*)node, context );
 
-			/* The arg list may be NIL in case of count(*) */
-			if( list != NULL )
-				candidates = scan_generic_node( list, opnos, rangeTableStack );
+			if( cand != NULL )
+				context->candidates = merge_candidates( context->candidates,
+														list_make1( cand ) );
 		}
 		break;
 
+		case T_RelabelType:
+			return scan_clause_walker( (Node*)((RelabelType*)node)->arg,
+										context );
+
 		/* if the node is a boolean-expression */
 		case T_BoolExpr:
 		{
-			const BoolExpr* const expr = (const BoolExpr*)root;
+			const BoolExpr* const expr = (const BoolExpr*)node;
 
 			if( expr->boolop != AND_EXPR )
 			{
@@ -1664,25 +6737,25 @@ scan_generic_node(	const Node* const root,
 				Assert( expr->boolop == OR_EXPR || expr->boolop == NOT_EXPR );
 
 				foreach( cell, expr->args )
-				{
-					const Node* const node = (const Node*)lfirst( cell );
-					candidates = merge_candidates( candidates,
-											scan_generic_node( node, opnos,
-															rangeTableStack));
-				}
+					scan_clause_walker( (Node*)lfirst( cell ), context );
 			}
 			else
 			{
 				/* AND expression */
+				List* candidates = NIL;
 				List* compositeCandidates = NIL;
 
 				foreach( cell, expr->args )
 				{
-					const Node* const node = (const Node*)lfirst( cell );
 					List	*icList; /* Index candidate list */
 					List	*cicList; /* Composite index candidate list */
 
-					icList	= scan_generic_node( node, opnos, rangeTableStack );
+					icList	= scan_generic_node( (Node*)lfirst( cell ),
+													context->opnos,
+													context->rangeTableStack );
+
+					/* col > x AND col < y selects less than either */
+					combine_range_bounds( candidates, icList );
 
 					cicList = build_composite_candidates(candidates, icList);
 
@@ -1694,167 +6767,323 @@ scan_generic_node(	const Node* const root,
 
 				/* now append the composite (multi-col) indexes to the list */
 				candidates = merge_candidates(candidates, compositeCandidates);
+
+				context->candidates = merge_candidates( context->candidates,
+														candidates );
 			}
 		}
 		break;
 
-		/* if the node is list of other nodes (e.g. group-by expressions) */
-		case T_List:
+		/* if the node is an operator */
+		case T_OpExpr:
 		{
-			List* const list = (List*)root;
-			foreach( cell, list )
+			/* get candidates if operator is supported */
+			const OpExpr* const expr = (const OpExpr*)node;
+
+			if( !list_member_oid( context->opnos, expr->opno ) )
+				return scan_subqueries_walker( node, context );
+
+			/* a column compared to something; note how selective that is */
+			if( max_selectivity < 1 && list_length( expr->args ) == 2 )
 			{
-				const Node* const node = (const Node*)lfirst( cell );
+				for( i = 0; i < 2; ++i )
+				{
+					Node *arg = (Node*)list_nth( expr->args, i );
+					IndexCandidate *cand;
 
-				candidates = merge_candidates( candidates,
-											scan_generic_node( node, opnos,
-															rangeTableStack));
+					while( IsA( arg, RelabelType ) )
+						arg = (Node*)((RelabelType*)arg)->arg;
+
+					if( !IsA( arg, Var ) )
+					{
+						scan_clause_walker( arg, context );
+						continue;
+					}
+
+					cand = make_var_candidate( (Var*)arg, context );
+
+					if( cand == NULL )
+						continue;
+
+					cand->selectivity = estimate_selectivity( cand, expr->opno,
+										(Node*)list_nth( expr->args, 1 - i ),
+										i == 0 );
+
+					if( cand->selectivity > 0 )
+						cand->bound = range_bound( expr->opno, i == 0 );
+
+					context->candidates = merge_candidates( context->candidates,
+														list_make1( cand ) );
+				}
+			}
+			else
+			{
+				foreach( cell, expr->args )
+					scan_clause_walker( (Node*)lfirst( cell ), context );
 			}
 		}
 		break;
-		/* if the node is an operator */
-		case T_OpExpr:
+
+		/* col op ANY (array) */
+		case T_ScalarArrayOpExpr:
 		{
-			/* get candidates if operator is supported */
-			const OpExpr* const expr = (const OpExpr*)root;
+			const ScalarArrayOpExpr* const expr = (const ScalarArrayOpExpr*)node;
 
-			if( list_member_oid( opnos, expr->opno ) )
+			if( list_member_oid( context->opnos, expr->opno ) )
 			{
 				foreach( cell, expr->args )
-				{
-					const Node* const node = (const Node*)lfirst( cell );
-
-					candidates = merge_candidates( candidates,
-											scan_generic_node( node, opnos,
-															rangeTableStack));
-				}
+					scan_clause_walker( (Node*)lfirst( cell ), context );
 			}
+			else
+				return scan_subqueries_walker( node, context );
 		}
 		break;
 
-		/* if this case is reached, the variable is an index-candidate */
-		case T_Var:
+		case T_ArrayExpr:
+		{
+			foreach( cell, ((ArrayExpr*)node)->elements )
+				scan_clause_walker( (Node*)lfirst( cell ), context );
+		}
+		break;
+
+		/* col IS [NOT] NULL */
+		case T_NullTest:
 		{
-			const Var* const expr = (const Var*)root;
-			List* rt = list_nth( rangeTableStack, expr->varlevelsup );
-			const RangeTblEntry* rte = list_nth( rt, expr->varno - 1 );
+			const NullTest* const expr = (const NullTest*)node;
+			Node *arg = (Node*)expr->arg;
+			IndexCandidate *cand;
+
+			while( IsA( arg, RelabelType ) )
+				arg = (Node*)((RelabelType*)arg)->arg;
+
+			if( max_selectivity >= 1 || !IsA( arg, Var ) )
+				return scan_clause_walker( arg, context );
+
+			cand = make_var_candidate( (Var*)arg, context );
 
-			/* only relations have indexes */
-			if( rte->rtekind == RTE_RELATION )
+			if( cand != NULL )
 			{
-				Relation base_rel = heap_open( rte->relid, AccessShareLock );
-
-				/* We do not support catalog tables and temporary tables */
-				if( base_rel->rd_istemp != true
-					&& !IsSystemRelation(base_rel)
-					/* and don't recommend indexes on hidden/system columns */
-					&& expr->varattno > 0
-					/* and it should have at least two tuples */
-					//TODO: Do we really need these checks?
-					&& base_rel->rd_rel->relpages > 1
-					&& base_rel->rd_rel->reltuples > 1 )
-				{
-					/* create index-candidate and build a new list */
-					int				i;
-					IndexCandidate	*cand = (IndexCandidate*)palloc0(
-														sizeof(IndexCandidate));
-
-					cand->varno         = expr->varno;
-					cand->varlevelsup   = expr->varlevelsup;
-					cand->ncols         = 1;
-					cand->reloid        = rte->relid;
-					cand->idxused       = false;
-
-					cand->vartype[ 0 ]  = expr->vartype;
-					cand->varattno[ 0 ] = expr->varattno;
-
-					/*FIXME: Do we really need this loop? palloc0 and ncols,
-					 * above, should have taken care of this!
-					 */
-					for( i = 1; i < INDEX_MAX_KEYS; ++i )
-						cand->varattno[i] = 0;
-
-					candidates = list_make1( cand );
-				}
+				cand->selectivity = estimate_null_selectivity( cand,
+															expr->nulltesttype );
 
-				heap_close( base_rel, AccessShareLock );
+				context->candidates = merge_candidates( context->candidates,
+														list_make1( cand ) );
 			}
 		}
 		break;
 
-		/* subquery in where-clause */
-		case T_SubLink:
+		/* (col1, col2) op (...), or (...) op (col1, col2) */
+		case T_RowCompareExpr:
 		{
-			/* convert it to sublink-expression */
-			const SubLink* const expr = (const SubLink*)root;
+			const RowCompareExpr* const expr = (const RowCompareExpr*)node;
 
-			candidates = scan_generic_node( expr->subselect, opnos,
-												rangeTableStack );
+			foreach( cell, expr->opnos )
+				if( !list_member_oid( context->opnos, lfirst_oid( cell ) ) )
+					return scan_subqueries_walker( node, context );
 
-			/* scan lefthand expression (if any); [NOT] EXISTS operators do not have it */
-			if( expr->testexpr )
-				candidates = merge_candidates(candidates,
-										scan_generic_node(	expr->testexpr,
-															opnos,
-															rangeTableStack));
+			scan_row_compare_args( expr->largs, context );
+			scan_row_compare_args( expr->rargs, context );
 		}
 		break;
 
-		case T_RelabelType:
+		/* the arguments of an aggregate, eg. in GROUP BY */
+		case T_Aggref:
 		{
-			const RelabelType*	const	relabeltype = (const RelabelType*)root;
-			const Node* const	node	= (const Node*)relabeltype->arg;
+			foreach( cell, ((Aggref*)node)->args )
+				scan_clause_walker( (Node*)lfirst( cell ), context );
+		}
+		break;
 
-			candidates = scan_generic_node( node, opnos, rangeTableStack );
+		/* if the node is list of other nodes (e.g. group-by expressions) */
+		case T_List:
+		{
+			foreach( cell, (List*)node )
+				scan_clause_walker( (Node*)lfirst( cell ), context );
 		}
 		break;
 
-		/* Query found */
-		case T_Query:
+		/* subquery in where-clause */
+		case T_SubLink:
 		{
-			const Query* const query = (const Query*)root;
+			const SubLink* const expr = (const SubLink*)node;
 
-			candidates = scan_query( query, opnos, rangeTableStack );
+			scan_clause_walker( expr->subselect, context );
+
+			/* scan lefthand expression (if any); [NOT] EXISTS operators do not have it */
+			scan_clause_walker( expr->testexpr, context );
 		}
 		break;
 
+		/* Query found */
+		case T_Query:
+			context->candidates = merge_candidates( context->candidates,
+											scan_query( (Query*)node,
+														context->opnos,
+														context->rangeTableStack ) );
+		break;
+
 		/* ignore some types */
-		case T_FuncExpr:
 		case T_Param:
 		case T_Const:
-			break;
-		case T_ScalarArrayOpExpr:
+		break;
 
-			foreach( cell, ((ScalarArrayOpExpr*)root)->args )
-			{
-				const Node* const node = (const Node*)lfirst( cell );
-				candidates = merge_candidates( candidates,
-										scan_generic_node( node, opnos,
-														rangeTableStack));
-			}
-			break;
-		case T_ArrayExpr:
+		default:
+			return scan_subqueries_walker( node, context );
+	}
 
-			foreach( cell, ((ArrayExpr*)root)->elements )
-			{
-				const Node* const node = (const Node*)lfirst( cell );
-				candidates = merge_candidates( candidates,
-										scan_generic_node( node, opnos,
-														rangeTableStack));
-			}
-			break;
+	return false;
+}
 
+/**
+ * scan_row_compare_args
+ *    Adds the candidates of one side of a row comparison: its leading columns,
+ * while they are columns of the same table in the same range table entry, as
+ * a composite candidate, and the first of them on its own. The rest of the
+ * side is looked into for subqueries.
+ */
+static void
+scan_row_compare_args( List* args, ScanContext* context )
+{
+	IndexCandidate	*composite = NULL;
+	ListCell		*cell;
 
-		/* report non-considered parse-node types */
-		default:
-/*			elog( NOTICE, "IND ADV: unhandled parse-node type: %d; Query: %s\n",
-						(int)nodeTag( root ), debug_query_string );*/
+	foreach( cell, args )
+	{
+		Node			*arg = (Node*)lfirst( cell );
+		IndexCandidate	*cand = NULL;
+
+		while( IsA( arg, RelabelType ) )
+			arg = (Node*)((RelabelType*)arg)->arg;
+
+		if( IsA( arg, Var ) )
+			cand = make_var_candidate( (Var*)arg, context );
+
+		/* in a self-join, (a.x, b.y) are columns of two different rows */
+		if( cand == NULL
+			|| (composite != NULL
+				&& (composite->reloid != cand->reloid
+					|| composite->varno != cand->varno
+					|| composite->varlevelsup != cand->varlevelsup
+					|| composite->ncols >= INDEX_MAX_KEYS)) )
+		{
+			if( cand != NULL )
+				pfree( cand );
 			break;
+		}
+
+		if( composite == NULL )
+		{
+			composite = cand;
+			continue;
+		}
+
+		composite->varattno[ composite->ncols ]	= cand->varattno[0];
+		composite->vartype[ composite->ncols ]	= cand->vartype[0];
+		++composite->ncols;
+
+		pfree( cand );
 	}
 
-	elog( DEBUG3, "IND ADV: scan_generic_node: EXIT" );
+	if( composite != NULL )
+	{
+		/* the first column on its own too */
+		IndexCandidate *first = (IndexCandidate*)palloc(
+											sizeof(IndexCandidate) );
 
-	return candidates;
+		memcpy( first, composite, sizeof(IndexCandidate) );
+		first->ncols = 1;
+
+		context->candidates = merge_candidates( context->candidates,
+												list_make1( first ) );
+
+		if( composite->ncols > 1 )
+			context->candidates = merge_candidates( context->candidates,
+													list_make1( composite ) );
+		else
+			pfree( composite );
+	}
+
+	foreach( cell, args )
+		scan_subqueries_walker( (Node*)lfirst( cell ), context );
+}
+
+/**
+ * scan_subqueries_walker
+ *    The walker for scan_generic_node(), for the nodes in which a column
+ * cannot use an index; it only looks for subqueries.
+ */
+static bool
+scan_subqueries_walker( Node* node, ScanContext* context )
+{
+	if( node == NULL )
+		return false;
+
+	if( IsA( node, SubLink ) )
+		return scan_clause_walker( node, context );
+
+	return expression_tree_walker( node, scan_subqueries_walker,
+									(void*)context );
+}
+
+/**
+ * make_var_candidate
+ *    Builds a single-column candidate for a column, or returns NULL if the
+ * column cannot have one.
+ */
+static IndexCandidate*
+make_var_candidate( const Var* const expr, ScanContext* context )
+{
+	List* rt = list_nth( context->rangeTableStack, expr->varlevelsup );
+	const RangeTblEntry* rte = list_nth( rt, expr->varno - 1 );
+	IndexCandidate	*cand = NULL;
+
+	/* only relations have indexes */
+	if( rte->rtekind == RTE_RELATION )
+	{
+		Relation base_rel = heap_open( rte->relid, AccessShareLock );
+
+		/* We do not support catalog tables and temporary tables */
+		if( base_rel->rd_istemp != true
+			&& !IsSystemRelation(base_rel)
+			/* and don't recommend indexes on hidden/system columns */
+			&& expr->varattno > 0
+			/* and it should have at least two tuples */
+			//TODO: Do we really need these checks?
+			&& base_rel->rd_rel->relpages > 1
+			&& base_rel->rd_rel->reltuples > 1 )
+		{
+			/* create index-candidate; palloc0 leaves the other columns 0 */
+			cand = (IndexCandidate*)palloc0( sizeof(IndexCandidate) );
+
+			cand->varno         = expr->varno;
+			cand->varlevelsup   = expr->varlevelsup;
+			cand->ncols         = 1;
+			cand->reloid        = rte->relid;
+			cand->idxused       = false;
+
+			cand->vartype[ 0 ]  = expr->vartype;
+			cand->varattno[ 0 ] = expr->varattno;
+		}
+
+		heap_close( base_rel, AccessShareLock );
+	}
+	/* a column of a join; look at the column it stands for */
+	else if( rte->rtekind == RTE_JOIN && expr->varattno > 0 )
+	{
+		Node *alias = copyObject( list_nth( rte->joinaliasvars,
+											expr->varattno - 1 ) );
+
+		/* the alias refers to the same query level as the join */
+		IncrementVarSublevelsUp( alias, expr->varlevelsup, 0 );
+
+		while( IsA( alias, RelabelType ) )
+			alias = (Node*)((RelabelType*)alias)->arg;
+
+		if( IsA( alias, Var ) )
+			cand = make_var_candidate( (Var*)alias, context );
+	}
+
+	return cand;
 }
 
 
@@ -1881,6 +7110,10 @@ compare_candidates( const IndexCandidate* ic1,
 				result = ic1->varattno[ i ] - ic2->varattno[ i ];
 				++i;
 			} while( ( result == 0 ) && ( i < ic1->ncols ) );
+
+			/* the same columns, in another order */
+			for( i = 0; ( result == 0 ) && ( i < ic1->ncols ); ++i )
+				result = ic1->coloptions[ i ] - ic2->coloptions[ i ];
 		}
 	}
 
@@ -1979,6 +7212,15 @@ merge_candidates( List* list1, List* list2 )
 			if( cmp == 0 )
 			{
 				ListCell *next = lnext( cell2 );
+				IndexCandidate *cand1 = (IndexCandidate*)llast( ret );
+				IndexCandidate *cand2 = (IndexCandidate*)lfirst( cell2 );
+
+				/* the best case of either; 0, unknown, is the best */
+				cand1->selectivity = Min( cand1->selectivity,
+											cand2->selectivity );
+
+				if( cand1->bound != cand2->bound )
+					cand1->bound = 0;
 
 				pfree( (IndexCandidate*)lfirst( cell2 ) );
 				list2 = list_delete_cell( list2, cell2, prev2 );
@@ -2116,10 +7358,10 @@ build_composite_candidates( List* list1, List* list2 )
 							 * candidates 2,1
 							 */
 							IndexCandidate* cic1
-								= (IndexCandidate*)palloc(
+								= (IndexCandidate*)palloc0(
 													sizeof(IndexCandidate));
 							IndexCandidate* cic2
-								= (IndexCandidate*)palloc(
+								= (IndexCandidate*)palloc0(
 													sizeof(IndexCandidate));
 
 							/* init some members of composite candidate 1 */
@@ -2261,6 +7503,10 @@ create_virtual_indexes( List* candidates )
 
 		IndexCandidate* const cand = (IndexCandidate*)lfirst( cell );
 
+		/* the rest are left uncreated, and unused */
+		if( budget_exceeded() )
+			break;
+
 		indexInfo->ii_NumIndexAttrs = cand->ncols;
 
 		for( i = 0; i < cand->ncols; ++i )
@@ -2292,12 +7538,16 @@ create_virtual_indexes( List* candidates )
 		/* create the index without data */
 		cand->idxoid = index_create( cand->reloid, idx_name,
 										InvalidOid, indexInfo, BTREE_AM_OID,
-										InvalidOid, op_class, NULL, (Datum)0,
+										InvalidOid, op_class, cand->coloptions,
+										(Datum)0,
 										false, false, false, true, false );
 
 		elog( DEBUG1, "IND ADV: virtual index created: oid=%d name=%s size=%d",
 					cand->idxoid, idx_name, cand->pages );
 
+		PG_TRACE4( index_adviser__virtual__index, cand->reloid, cand->idxoid,
+					cand->ncols, cand->pages );
+
 		/* increase count for the next index */
 		++idx_count;
 		prev = cell;
@@ -17,6 +17,10 @@
 #include "catalog/namespace.h"
 #include "executor/executor.h"
 
+/* The most evaluations of a parameterized statement: the plan being advised,
+ * the generic plan, and samples of parameter values */
+#define IND_ADV_MAX_PARAM_SAMPLES	16
+
 typedef struct {
 
 	Index		varno;					/* index into the rangetable */
@@ -24,18 +28,49 @@ typedef struct {
 	int2		ncols;					/* number of indexed columns */
 	Oid			vartype[INDEX_MAX_KEYS];/* type of the column(s) */
 	AttrNumber	varattno[INDEX_MAX_KEYS];/* attribute number of the column(s) */
+	int16		coloptions[INDEX_MAX_KEYS];/* INDOPTION_* of the column(s) */
 	Oid			reloid;					/* the table oid */
 //TODO1 remove this member
 	Oid			idxoid;					/* the virtual index oid */
 	BlockNumber	pages;					/* the estimated size of index */
 	bool		idxused;				/* was this used by the planner? */
 	float4		benefit;				/* benefit made by using this cand */
+	bool		assumed;				/* from index_adviser.assume_indexes */
+	bool		hidden;					/* hide it from the planner */
+	bool		excluded;				/* unused in its batch; hidden for good */
+	bool		existing;				/* a real index, tracked for drop advice */
+	bool		redundant;				/* a prefix of another existing index */
+	Oid			relam;					/* access method of an existing index */
+	Oid			opclass[INDEX_MAX_KEYS];/* and the opclass of its column(s) */
+	float4		penalty;				/* cost of planning without it, or -1 */
+	int			nsamples;				/* parameter samples evaluated */
+	float4		sample_benefit[IND_ADV_MAX_PARAM_SAMPLES]; /* benefit in each */
+	float4		selectivity;			/* of its clauses at best; 0 if unknown */
+	int8		bound;					/* of a range: 1 lower, -1 upper, or 0 */
 
 } IndexCandidate;
 
+/* What a DML statement does to its target table; used to charge the cost of
+ * maintaining the indexes on that table. */
+typedef struct {
+
+	Oid			reloid;					/* the target table */
+	char		command;				/* 'i', 'u' or 'd' */
+	float8		rows;					/* estimated rows affected */
+	List		*updated_attrs;			/* attnums SET by an UPDATE */
+	bool		hot_possible;			/* no existing index on those attrs? */
+	int			num_indexes;			/* existing indexes on the table */
+	float4		hot_ratio;				/* observed HOT updates/updates, or -1 */
+
+} WriteProfile;
+
 extern void _PG_init(void);
 extern void _PG_fini(void);
 
+extern Datum index_adviser_stats(PG_FUNCTION_ARGS);
+extern Datum index_adviser_stats_reset(PG_FUNCTION_ARGS);
+extern Datum index_adviser_memory_top(PG_FUNCTION_ARGS);
+
 #define compile_assert(x)	extern int	_compile_assert_array[(x)?1:-1]
 
 #endif   /* INDEX_ADVISER_H */
@@ -12,8 +12,6 @@
 #include "libpq-fe.h"
 #include "advise_index.h"
 
-#define ADV_MAX_COLS 32
-
 static PGconn *init_connection(const char *dbname, const char *host, int port,
 						const char *user, const char *password)
 {
@@ -62,82 +60,387 @@ static int prepare_advisor(PGconn *conn)
 	return 0;
 }
 
-static int analyse_workload(PGconn *conn, FILE *file)
+/* true if c can be part of an identifier or a dollar-quote tag */
+static bool is_ident_char(char c)
 {
-	PGresult *res;
-	char *query = NULL;
-	char line[1024];
+	return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')
+			|| (c >= '0' && c <= '9') || c == '_' || (c & 0x80);
+}
 
-	printf("Analyzing queries ");
+/*
+ * Builds the key that identifies a statement among the workload: its text
+ * without comments, and with whitespace outside of quotes collapsed, so that
+ * reformatted or differently commented copies of a statement are recognized
+ * as identical. The statement itself is EXPLAINed as it was written.
+ *
+ * Backslashes escape the next character in string literals, as they do in
+ * E'' strings, and in all of them unless standard_conforming_strings is on.
+ */
+static char *normalize_statement(const char *query)
+{
+	char		*key = (char *)malloc(strlen(query) + 1);
+	char		*dst = key;
+	const char	*src = query;
+	const char	*tag = NULL;	/* of the dollar quote we are in */
+	int			taglen = 0;
+	char		quote = '\0';
+	int			depth;
+
+	while (*src)
+	{
+		if (quote == '\'' || quote == '"')
+		{
+			if (quote == '\'' && *src == '\\' && src[1] != '\0')
+				*dst++ = *src++;
+			else if (*src == quote)
+				quote = '\0';
+
+			*dst++ = *src++;
+			continue;
+		}
+
+		if (quote == '$')
+		{
+			if (*src == '$' && strncmp(src, tag, taglen) == 0)
+			{
+				memcpy(dst, src, taglen);
+				dst += taglen;
+				src += taglen;
+				quote = '\0';
+			}
+			else
+				*dst++ = *src++;
+			continue;
+		}
+
+		/* a comment is whitespace; the block ones nest */
+		if (src[0] == '-' && src[1] == '-')
+		{
+			while (*src && *src != '\n')
+				++src;
+			if (dst > key && dst[-1] != ' ')
+				*dst++ = ' ';
+			continue;
+		}
+
+		if (src[0] == '/' && src[1] == '*')
+		{
+			for (depth = 0; *src; )
+			{
+				if (src[0] == '/' && src[1] == '*')
+				{
+					++depth;
+					src += 2;
+				}
+				else if (src[0] == '*' && src[1] == '/')
+				{
+					src += 2;
+					if (--depth == 0)
+						break;
+				}
+				else
+					++src;
+			}
+			if (dst > key && dst[-1] != ' ')
+				*dst++ = ' ';
+			continue;
+		}
+
+		if (*src == ' ' || *src == '\t' || *src == '\n' || *src == '\r')
+		{
+			if (dst > key && dst[-1] != ' ')
+				*dst++ = ' ';
+			++src;
+			continue;
+		}
+
+		if (*src == '\'' || *src == '"')
+			quote = *src;
+		else if (*src == '$' && (src == query || !is_ident_char(src[-1])))
+		{
+			/* $tag$ or $$ starts a dollar quote; $1 is a parameter */
+			const char *end = src + 1;
+
+			if (!(*end >= '0' && *end <= '9'))
+				while (is_ident_char(*end))
+					++end;
+
+			if (*end == '$')
+			{
+				tag = src;
+				taglen = (int)(end - src) + 1;
+				memcpy(dst, src, taglen);
+				dst += taglen;
+				src += taglen;
+				quote = '$';
+				continue;
+			}
+		}
+
+		*dst++ = *src++;
+	}
+
+	if (dst > key && dst[-1] == ' ')
+		--dst;
+
+	*dst = '\0';
+
+	return key;
+}
+
+static unsigned int hash_statement(const char *query)
+{
+	unsigned int h = 5381;
+
+	while (*query)
+		h = h * 33 + (unsigned char)*query++;
+
+	return h;
+}
+
+/*
+ * Read the workload, collapsing identical statements into a single entry with
+ * an occurrence count. Returns the number of distinct statements.
+ */
+static int read_workload(FILE *file, WorkloadStmt **stmts)
+{
+	char	*query = NULL;
+	char	line[1024];
+	int		nstmts = 0,
+			maxstmts = 64;
+	int		*slots;				/* open-addressing index into *stmts */
+	int		nslots = 128;
+	int		i;
+
+	*stmts = (WorkloadStmt *)malloc(maxstmts * sizeof(WorkloadStmt));
+	slots = (int *)malloc(nslots * sizeof(int));
+	for (i = 0; i < nslots; ++i)
+		slots[i] = -1;
 
 	for(;;)
 	{
+		unsigned int h;
+		char	*key;
+
 		if (fgets(line, 1024, file) == NULL)
 			break;
 		if (query == NULL)
 		{
 			query = (char *)malloc(10*1024);
-			strcpy(query, "EXPLAIN ");
-			strcat(query, line);
+			strcpy(query, line);
 		}
 		else
 		{
-			if (strlen(query) + strlen(line) > 10*1024)
+			if (strlen(query) + strlen(line) >= 10*1024)
 			{
 				fprintf(stderr, "ERROR: Query string too long.\n");
+				free(query);
+				free(slots);
 				return -1;
 			}
 
 			strcat(query, line);
 		}
 
-		if (strchr(query, ';') != NULL)
+		if (strchr(query, ';') == NULL)
+			continue;
+
+		key = normalize_statement(query);
+
+		h = hash_statement(key);
+		for (i = h & (nslots - 1);
+				slots[i] != -1 && strcmp((*stmts)[slots[i]].key, key) != 0;
+				i = (i + 1) & (nslots - 1))
+			;
+
+		if (slots[i] != -1)
 		{
-			// printf("query \#%d: %s\n", ++lno, query);
-			res = PQexec(conn, query);
-			printf(".");
-			if (PQresultStatus(res) != PGRES_TUPLES_OK)
+			/* seen before; just count it */
+			++(*stmts)[slots[i]].count;
+			free(query);
+			free(key);
+			query = NULL;
+			continue;
+		}
+
+		if (nstmts == maxstmts)
+		{
+			maxstmts *= 2;
+			*stmts = (WorkloadStmt *)realloc(*stmts,
+											maxstmts * sizeof(WorkloadStmt));
+		}
+
+		(*stmts)[nstmts].query = query;
+		(*stmts)[nstmts].key = key;
+		(*stmts)[nstmts].count = 1;
+		slots[i] = nstmts++;
+		query = NULL;
+
+		/* keep the index at most half full */
+		if (nstmts * 2 > nslots)
+		{
+			int j;
+
+			nslots *= 2;
+			slots = (int *)realloc(slots, nslots * sizeof(int));
+			for (i = 0; i < nslots; ++i)
+				slots[i] = -1;
+
+			for (j = 0; j < nstmts; ++j)
 			{
-				fprintf(stderr, "ERROR: %s", PQerrorMessage(conn));
-				return -1;
+				for (i = hash_statement((*stmts)[j].key) & (nslots - 1);
+						slots[i] != -1;
+						i = (i + 1) & (nslots - 1))
+					;
+				slots[i] = j;
 			}
-			else
-				PQclear(res);
+		}
+	}
 
-			free(query);
-			query = NULL;
+	free(query);
+	free(slots);
+
+	return nstmts;
+}
+
+static int exec_command(PGconn *conn, const char *command)
+{
+	PGresult *res = PQexec(conn, command);
+
+	if (PQresultStatus(res) != PGRES_COMMAND_OK)
+	{
+		fprintf(stderr, "ERROR: %s", PQerrorMessage(conn));
+		PQclear(res);
+		return -1;
+	}
+
+	PQclear(res);
+	return 0;
+}
+
+static int analyse_workload(PGconn *conn, WorkloadStmt *stmts, int nstmts)
+{
+	PGresult *res;
+	int i;
+	int weight = 1;		/* the server-side default */
+	char stmt[64];
+	char *query;
+
+	printf("Analyzing queries ");
+
+	for (i = 0; i < nstmts; ++i)
+	{
+		/* tell the adviser how many times this statement occurred */
+		if (stmts[i].count != weight)
+		{
+			weight = stmts[i].count;
+			snprintf(stmt, sizeof(stmt),
+						"SET index_adviser.statement_weight TO %d", weight);
+
+			if (exec_command(conn, stmt) != 0)
+				return -1;
 		}
+
+		query = (char *)malloc(strlen(stmts[i].query) + sizeof("EXPLAIN "));
+		strcpy(query, "EXPLAIN ");
+		strcat(query, stmts[i].query);
+
+		res = PQexec(conn, query);
+		printf(".");
+		if (PQresultStatus(res) != PGRES_TUPLES_OK)
+		{
+			fprintf(stderr, "ERROR: %s", PQerrorMessage(conn));
+			return -1;
+		}
+		else
+			PQclear(res);
+
+		free(query);
 	}
+
+	if (weight != 1
+		&& exec_command(conn, "RESET index_adviser.statement_weight") != 0)
+		return -1;
+
 	printf(" done.\n");
 	return 0;
 }
 
+/* parse an array literal, like {1,2}; returns the number of elements */
+static int parse_int_array(const char *literal, int *values)
+{
+	int n = 0;
+	char *end;
+
+	while (*literal != '\0' && n < ADV_MAX_COLS)
+	{
+		long value = strtol(literal, &end, 10);
+
+		if (end == literal)
+			++literal;		/* skip '{', ',' and '}' */
+		else
+		{
+			values[n++] = (int)value;
+			literal = end;
+		}
+	}
+
+	return n;
+}
+
+/*
+ * Read the indexes the adviser suggested in this session, the ones with the
+ * best gain first. Returns their number, or -1 on an error.
+ */
 static int read_advisor_output(PGconn *conn, AdvIndexList *index_list)
 {
 	PGresult *res;
 	int i;
 	int num_indexes = 0;
-	char stmt[1024];
+	char stmt[2048];
+
+	*index_list = NULL;
 
 	res = PQexec(conn, "BEGIN");
 	if (PQresultStatus(res) != PGRES_COMMAND_OK)
 	{
 		fprintf(stderr, "ERROR: BEGIN failed:\n %s", PQerrorMessage(conn));
 		PQclear(res);
-		return 0;
+		return -1;
 	}
 
 	snprintf(stmt,	sizeof(stmt),
-				"SELECT	c.relname,"
+				"SELECT	reloid,"
+						"qualname,"
+						"relname,"
+						"colids,"
+						"size_in_pages,"
+						"benefit - maintenance,"
+						"maintenance,"
+						"(benefit - maintenance)/size_in_pages AS gain,"
+						"(index_hot_ratio(pg_backend_pid(), reloid, colids))"
+							".current_ratio,"
+						"(index_hot_ratio(pg_backend_pid(), reloid, colids))"
+							".projected_ratio,"
+						"coloptions "
+				"FROM	(SELECT	c.oid AS reloid,"
+						"quote_ident(n.nspname) || '.' || quote_ident(c.relname)"
+							" AS qualname,"
+						"c.relname,"
 						"attrs AS colids,"
+						"coloptions,"
 						"MAX(index_size) AS size_in_pages,"
-						"SUM(benefit) AS benefit,"
-						"SUM(benefit)/MAX(index_size) AS gain "
-				"FROM	advise_index a,"
-						"pg_class c "
+						"SUM(benefit * weight) AS benefit,"
+						"index_maintenance_cost(pg_backend_pid(), c.oid, attrs,"
+												"MAX(index_size))"
+							" AS maintenance "
+				"FROM	index_advisory a,"
+						"pg_class c,"
+						"pg_namespace n "
 				"WHERE	a.backend_pid = pg_backend_pid() "
 				"AND	a.reloid = c.oid "
-				"GROUP BY	c.relname, colids "
+				"AND	c.relnamespace = n.oid "
+				"GROUP BY	c.oid, n.nspname, c.relname, colids, coloptions) AS v "
 				"ORDER BY	gain"
 				"	DESC");
 
@@ -146,7 +449,9 @@ static int read_advisor_output(PGconn *conn, AdvIndexList *index_list)
 	{
 		fprintf(stderr, "ERROR: %s", PQerrorMessage(conn));
 		PQclear(res);
-		return 0;
+		res = PQexec(conn, "END");
+		PQclear(res);
+		return -1;
 	}
 
 	*index_list = (AdvIndexInfo **)malloc(PQntuples(res)*sizeof(AdvIndexInfo*));
@@ -155,19 +460,33 @@ static int read_advisor_output(PGconn *conn, AdvIndexList *index_list)
 	{
 		AdvIndexInfo *index = (AdvIndexInfo *)malloc(sizeof(AdvIndexInfo));
 
-		index->table	= strdup(PQgetvalue(	res, i, 0));
-		index->col_ids	= strdup(PQgetvalue(	res, i, 1));
+		index->reloid	= strtoul(PQgetvalue(res, i, 0), NULL, 10);
+		index->table	= strdup(PQgetvalue(	res, i, 1));
+		index->relname	= strdup(PQgetvalue(	res, i, 2));
+		index->ncols	= parse_int_array(PQgetvalue(res, i, 3),
+											index->attnums);
+
+		/* null if all the columns are ascending */
+		memset(index->options, 0, sizeof(index->options));
+		parse_int_array(PQgetvalue(res, i, 10), index->options);
+
 			/*
 			 * size returned by the query is in number of pages.
 			 * TODO: change the backend to dump size in KBs. Done.
 			 */
-		index->size		= atol(PQgetvalue(	res, i, 2));
-		index->benefit	= atof(PQgetvalue(	res, i, 3));
+		index->size		= atol(PQgetvalue(	res, i, 4));
+		index->benefit	= atof(PQgetvalue(	res, i, 5));
+		index->maintenance = atof(PQgetvalue(	res, i, 6));
+		index->hot_ratio = PQgetisnull(res, i, 8) ? -1
+							: atof(PQgetvalue(res, i, 8));
+		index->projected_hot_ratio = PQgetisnull(res, i, 9) ? -1
+										: atof(PQgetvalue(res, i, 9));
 		index->used		= false;
 
 		(*index_list)[i] = index;
 
-		printf("size = %d KB, benefit = %f\n", index->size, index->benefit);
+		printf("size = %d KB, benefit = %f, maintenance = %f\n",
+				index->size, index->benefit, index->maintenance);
 		++num_indexes;
 	}
 
@@ -178,75 +497,113 @@ static int read_advisor_output(PGconn *conn, AdvIndexList *index_list)
 	return num_indexes;
 }
 
-static char* get_column_names(PGconn *conn, const char *table, char *column_ids)
+/*
+ * Fetch the names of all the columns used by the recommended indexes in a
+ * single query.
+ */
+static ColumnNameCache *resolve_column_names(PGconn *conn,
+											AdvIndexList index_list, int len)
 {
 	PGresult *res;
-	int len, colno;
-	char stmt[512];
-	char *idxdef;
-	char *colnames[ADV_MAX_COLS] = {0};
-	char *tok;
+	ColumnNameCache *cache;
+	char *stmt;
+	size_t stmtlen;
+	int i, j, ncols = 0;
 
-	res = PQexec(conn, "BEGIN");
+	for (i = 0; i < len; ++i)
+		if (index_list[i]->used)
+			ncols += index_list[i]->ncols;
 
-	if (PQresultStatus(res) != PGRES_COMMAND_OK)
-	{
-		fprintf(stderr, "ERROR: BEGIN failed.\n %s", PQerrorMessage(conn));
-		PQclear(res);
-		return NULL;
-	}
+	cache = colname_cache_create(ncols);
+
+	if (ncols == 0)
+		return cache;
+
+	/* room for one "(oid,attnum)," per column */
+	stmtlen = 256 + ncols * 24;
+	stmt = (char *)malloc(stmtlen);
+
+	strcpy(stmt, "SELECT	a.attrelid,"
+						"a.attnum,"
+						"quote_ident(a.attname) "
+				"FROM	pg_attribute a "
+				"WHERE	(a.attrelid, a.attnum) IN (");
 
-	for(	colno = 0, tok = strtok(column_ids, "{,}");
-			tok;
-			++colno, tok = strtok(NULL, "{,}"))
+	for (i = 0, ncols = 0; i < len; ++i)
 	{
-		snprintf(stmt, sizeof(stmt),
-					"SELECT	a.attname,"
-							"a.attnum "
-					"FROM	pg_class c,"
-							"pg_attribute a "
-					"WHERE	c.relname = '%s' "
-					"AND	a.attrelid = c.oid "
-					"AND	a.attnum = %s",
-					table, tok);
+		if (!index_list[i]->used)
+			continue;
 
-		res = PQexec(conn, stmt);
-		if (PQresultStatus(res) != PGRES_TUPLES_OK)
-		{
-			fprintf(stderr, "ERROR: %s", PQerrorMessage(conn));
-			PQclear(res);
-			return NULL;
-		}
+		for (j = 0; j < index_list[i]->ncols; ++j)
+			sprintf(stmt + strlen(stmt), "%s(%u,%d)", ncols++ > 0 ? "," : "",
+					index_list[i]->reloid, index_list[i]->attnums[j]);
+	}
 
-		if (PQntuples(res) != 1)
-		{
-			fprintf(stderr, "ERROR: an internal query failed at %s:%d.",
-								__FILE__, __LINE__ );
-			PQclear(res);
-			return NULL;
-		}
+	strcat(stmt, ")");
 
-		colnames[colno] = strdup(PQgetvalue(res, 0, 0));
+	res = PQexec(conn, stmt);
+	free(stmt);
+
+	if (PQresultStatus(res) != PGRES_TUPLES_OK)
+	{
+		fprintf(stderr, "ERROR: %s", PQerrorMessage(conn));
+		PQclear(res);
+		colname_cache_free(cache);
+		return NULL;
 	}
 
-	res = PQexec(conn, "END");
+	for (i = 0; i < PQntuples(res); ++i)
+		colname_cache_insert(cache,
+							strtoul(PQgetvalue(res, i, 0), NULL, 10),
+							atoi(PQgetvalue(res, i, 1)),
+							PQgetvalue(res, i, 2));
+
 	PQclear(res);
 
+	return cache;
+}
+
+/* build the comma separated column list of an index */
+static char* get_column_names(ColumnNameCache *cache, AdvIndexInfo *info)
+{
+	const char *colnames[ADV_MAX_COLS];
+	char *idxdef;
+	int len, colno;
+
 	len = 1;	/* 1 for null terminator */
-	for (colno = 0; colno < ADV_MAX_COLS && colnames[colno]; ++colno)
+	for (colno = 0; colno < info->ncols; ++colno)
 	{
+		colnames[colno] = colname_cache_lookup(cache, info->reloid,
+												info->attnums[colno]);
+
+		if (colnames[colno] == NULL)
+		{
+			fprintf(stderr, "ERROR: column %d of table %s not found.\n",
+								info->attnums[colno], info->table);
+			return NULL;
+		}
+
 		len += strlen(colnames[colno]);
 		if (colno > 0) len += 1; /* for a ',' */
+		len += sizeof(" DESC NULLS FIRST");
 	}
 
 	idxdef = (char *)malloc(len);
 	idxdef[0] = '\0';
 
-	for (colno = 0; colno < ADV_MAX_COLS && colnames[colno]; ++colno)
+	for (colno = 0; colno < info->ncols; ++colno)
 	{
+		int options = info->options[colno];
+
 		if (colno > 0) strcat(idxdef, ",");
 		strcat(idxdef, colnames[colno]);
-		free(colnames[colno]);
+
+		/* only what differs from the default of the direction */
+		if (options & ADV_INDOPTION_DESC)
+			strcat(idxdef, (options & ADV_INDOPTION_NULLS_FIRST)
+								? " DESC" : " DESC NULLS LAST");
+		else if (options & ADV_INDOPTION_NULLS_FIRST)
+			strcat(idxdef, " NULLS FIRST");
 	}
 
 	return idxdef;
@@ -257,30 +614,289 @@ static void output_recommendation(PGconn *conn, AdvIndexList index_list,
 {
 	int i;
 	long size = 0;
+	ColumnNameCache *colnames = resolve_column_names(conn, index_list, len);
+
+	if (colnames == NULL)
+		return;
 
 	for (i = 0; i < len; ++i)
 	{
 		AdvIndexInfo *info = index_list[i];
+		char *idxdef;
 
 		if (!info->used)
 			continue;
 
-		char *idxdef = get_column_names(conn, info->table, info->col_ids);
+		idxdef = get_column_names(colnames, info);
+		if (idxdef == NULL)
+			continue;
+
+		printf("/* %d. %s(%s): size=%d KB, benefit=%.2f, maintenance=%.2f */\n",
+				i+1, info->table, idxdef, info->size, info->benefit,
+				info->maintenance);
 
-		printf("/* %d. %s(%s): size=%d KB, benefit=%.2f */\n",
-				i+1, info->table, idxdef, info->size, info->benefit);
+		if (info->projected_hot_ratio >= 0
+			&& info->projected_hot_ratio < info->hot_ratio)
+			printf("/*    HOT updates on %s: %.0f%% -> %.0f%% */\n",
+					info->table, info->hot_ratio * 100,
+					info->projected_hot_ratio * 100);
 
 		size += info->size;
 
 		if (sqlfile)
 			fprintf(sqlfile, "create index idx_%s_%d on %s (%s);\n",
-								info->table, i+1, info->table, idxdef);
+								info->relname, i+1, info->table, idxdef);
 		free(idxdef);
 	}
 
+	colname_cache_free(colnames);
+
 	printf("/* Total size = %ldKB */\n", size);
 }
 
+/* print the existing indexes that the workload can do without */
+static void output_drop_recommendation(PGconn *conn, FILE *sqlfile)
+{
+	PGresult *res;
+	int i;
+	long size = 0;
+
+	res = PQexec(conn, "SELECT	indexrelid::regclass,"
+								"index_size,"
+								"maintenance,"
+								"used "
+						"FROM	index_drop_candidates(pg_backend_pid())");
+
+	if (PQresultStatus(res) != PGRES_TUPLES_OK)
+	{
+		fprintf(stderr, "ERROR: %s", PQerrorMessage(conn));
+		PQclear(res);
+		return;
+	}
+
+	for (i = 0; i < PQntuples(res); ++i)
+	{
+		printf("/* drop %d. %s: size=%s KB, maintenance=%.2f, %s */\n",
+				i+1, PQgetvalue(res, i, 0), PQgetvalue(res, i, 1),
+				atof(PQgetvalue(res, i, 2)),
+				strcmp(PQgetvalue(res, i, 3), "t") == 0 ? "redundant"
+														: "unused");
+
+		size += atol(PQgetvalue(res, i, 1));
+
+		if (sqlfile)
+			fprintf(sqlfile, "drop index %s;\n", PQgetvalue(res, i, 0));
+	}
+
+	PQclear(res);
+
+	printf("/* Total size freed = %ldKB */\n", size);
+}
+
+/* does a chosen index make this one redundant? That is, is this index the
+ * same as, or a prefix of, an index chosen on the same table? */
+static bool is_subsumed(AdvIndexInfo *index, AdvIndexList chosen, int nchosen)
+{
+	int i, j;
+
+	for (i = 0; i < nchosen; ++i)
+	{
+		if (chosen[i]->reloid != index->reloid
+			|| chosen[i]->ncols < index->ncols)
+			continue;
+
+		for (j = 0; j < index->ncols; ++j)
+			if (chosen[i]->attnums[j] != index->attnums[j])
+				break;
+
+		if (j == index->ncols)
+			return true;
+	}
+
+	return false;
+}
+
+/* make the adviser assume that the chosen indexes exist */
+static int set_assumed_indexes(PGconn *conn, AdvIndexList chosen, int nchosen)
+{
+	char *stmt;
+	int i, j, rc;
+
+	stmt = (char *)malloc(64 + nchosen * (16 + ADV_MAX_COLS * 8));
+	strcpy(stmt, "SET index_adviser.assume_indexes TO '");
+
+	for (i = 0; i < nchosen; ++i)
+	{
+		sprintf(stmt + strlen(stmt), "%s%u(", i > 0 ? ";" : "",
+				chosen[i]->reloid);
+
+		for (j = 0; j < chosen[i]->ncols; ++j)
+			sprintf(stmt + strlen(stmt), "%s%d", j > 0 ? "," : "",
+					chosen[i]->attnums[j]);
+
+		strcat(stmt, ")");
+	}
+
+	strcat(stmt, "'");
+
+	rc = exec_command(conn, stmt);
+	free(stmt);
+
+	return rc;
+}
+
+static void free_index_list(AdvIndexList index_list, int len)
+{
+	int i;
+
+	for (i = 0; i < len; ++i)
+	{
+		if (index_list[i] == NULL)
+			continue;
+
+		free(index_list[i]->table);
+		free(index_list[i]->relname);
+		free(index_list[i]);
+	}
+
+	free(index_list);
+}
+
+/*
+ * Interaction-aware selection: take the candidate with the best gain, then
+ * have the adviser re-plan the workload assuming the chosen indexes exist, so
+ * that the remaining candidates are ranked by their marginal benefit, and
+ * candidates made redundant by a chosen index are dropped. This is repeated
+ * 'rounds' times; whatever space remains is then filled from the last
+ * evaluation using the requested knapsack algorithm.
+ *
+ * Returns the number of indexes in *index_list; the chosen ones come first.
+ * Returns -1 on an error.
+ */
+static int select_interaction_aware(PGconn *conn, WorkloadStmt *stmts,
+									int nstmts, int rounds, long pool_size,
+									AdvOptimizer algorithm, long granularity,
+									double epsilon, AdvIndexList *index_list)
+{
+	AdvIndexList	chosen,
+					candidates;
+	int				nchosen = 0,
+					ncandidates,
+					nresult,
+					round,
+					i;
+	long			room = pool_size;
+
+	chosen = (AdvIndexInfo **)malloc(rounds * sizeof(AdvIndexInfo *));
+
+	ncandidates = read_advisor_output(conn, &candidates);
+
+	if (ncandidates < 0)
+	{
+		free(chosen);
+		return -1;
+	}
+
+	for (round = 0; round < rounds; ++round)
+	{
+		int best = -1;
+
+		/* the candidates are ordered by gain */
+		for (i = 0; i < ncandidates && best < 0; ++i)
+			if (candidates[i]->benefit > 0
+				&& (pool_size <= 0 || candidates[i]->size <= room)
+				&& !is_subsumed(candidates[i], chosen, nchosen))
+				best = i;
+
+		if (best < 0)
+			break;
+
+		chosen[nchosen] = candidates[best];
+		chosen[nchosen]->used = true;
+		room -= chosen[nchosen]->size;
+		++nchosen;
+
+		printf("round %d: chose index on %s, size = %d KB, benefit = %f\n",
+				round + 1, candidates[best]->table, candidates[best]->size,
+				candidates[best]->benefit);
+
+		candidates[best] = NULL;
+		free_index_list(candidates, ncandidates);
+
+		/*
+		 * re-evaluate the workload relative to the chosen indexes; each
+		 * evaluation saves all of its rows again, the write profiles that the
+		 * maintenance cost is summed from included
+		 */
+		if (set_assumed_indexes(conn, chosen, nchosen) != 0
+			|| exec_command(conn, "DELETE FROM index_advisory "
+									"WHERE backend_pid = pg_backend_pid();"
+								"DELETE FROM index_advisory_writes "
+									"WHERE backend_pid = pg_backend_pid();"
+								"DELETE FROM index_advisory_samples "
+									"WHERE backend_pid = pg_backend_pid();"
+								"DELETE FROM index_advisory_usage "
+									"WHERE backend_pid = pg_backend_pid();"
+								"DELETE FROM index_advisory_truncations "
+									"WHERE backend_pid = pg_backend_pid()") != 0
+			|| analyse_workload(conn, stmts, nstmts) != 0)
+		{
+			ncandidates = 0;
+			candidates = NULL;
+			break;
+		}
+
+		ncandidates = read_advisor_output(conn, &candidates);
+
+		if (ncandidates < 0)
+		{
+			exec_command(conn, "RESET index_adviser.assume_indexes");
+			free_index_list(chosen, nchosen);
+			return -1;
+		}
+	}
+
+	exec_command(conn, "RESET index_adviser.assume_indexes");
+
+	/* the chosen indexes, followed by the remaining useful candidates */
+	*index_list = (AdvIndexInfo **)malloc((nchosen + ncandidates)
+											* sizeof(AdvIndexInfo *));
+	memcpy(*index_list, chosen, nchosen * sizeof(AdvIndexInfo *));
+	nresult = nchosen;
+
+	for (i = 0; i < ncandidates; ++i)
+	{
+		if (candidates[i]->benefit <= 0
+			|| is_subsumed(candidates[i], chosen, nchosen))
+		{
+			free(candidates[i]->table);
+			free(candidates[i]->relname);
+			free(candidates[i]);
+			continue;
+		}
+
+		(*index_list)[nresult++] = candidates[i];
+	}
+
+	if (pool_size > 0 &&
+			compute_config_size(*index_list + nchosen, nresult - nchosen) > room)
+	{
+		if (room > 0)
+			find_optimal_configuration(*index_list + nchosen, nresult - nchosen,
+										room, algorithm, granularity, epsilon);
+	}
+	else
+	{
+		for (i = nchosen; i < nresult; ++i)
+			(*index_list)[i]->used = true;
+	}
+
+	free(candidates);
+	free(chosen);
+
+	return nresult;
+}
+
 static void usage()
 {
 	puts("This is pg_advise_index, the PostgreSQL index advisor frontend.\n");
@@ -294,22 +910,26 @@ static void usage()
 	puts("\t-o FILENAME name of output file for create index statements");
 	puts("\t-s SIZE     specify max size of space to be used for indexes "
 			"(in bytes, opt. with G, M or K)");
+	puts("\t-a ALGO     algorithm used to fit indexes into SIZE: auto, greedy,"
+			" dp, bb or fptas (default: auto)");
+	puts("\t-g SIZE     granularity of index sizes for the dp algorithm "
+			"(in bytes, opt. with G, M or K)");
+	puts("\t-e EPSILON  maximum relative error of the fptas algorithm "
+			"(default: 0.01)");
+	puts("\t-i ROUNDS   pick up to ROUNDS indexes one at a time, re-evaluating"
+			" the workload\n\t            after each pick to account for "
+			"redundant indexes");
+	puts("\t-D         also advise dropping the existing indexes the workload "
+			"does not need");
+	puts("\t-v         print what the algorithm fitting the indexes does");
 }
 
 /* return the size (-s option) converted into KBs */
 static long strtosize(const char *s)
 {
-	long size = 0;
+	long size = atol(s);
 	char l = s[strlen(s) - 1];
 
-	if (l == 'G' || l == 'M' || l == 'k' || l == 'K')
-	{
-		char *ns = (char *)malloc(strlen(s) - 1);
-		strncpy(ns, s, strlen(s) - 1);
-		size = atol(ns);
-		free(ns);
-	}
-
 	switch(l)
 	{
 		case 'G':
@@ -336,10 +956,17 @@ int main(int argc, char **argv)
 	int		port = 5432;
 	PGconn	*conn;
 	long	pool_size = 0;
+	long	granularity = 0;
+	double	epsilon = ADV_FPTAS_DEFAULT_EPSILON;
+	AdvOptimizer algorithm = ADV_OPT_AUTO;
 	FILE	*workload = stdin,
 			*sqlfile = NULL;
 	int		i,
-			num_indexes;
+			num_indexes,
+			num_stmts,
+			rounds = 0;
+	bool	drop_advice = false;
+	WorkloadStmt	*stmts;
 	char	*output_filename = NULL;
 
 	AdvIndexList	suggested_indexes;
@@ -347,7 +974,7 @@ int main(int argc, char **argv)
 	/* check arguments */
 	int ch;
 
-	while ((ch = getopt(argc, argv, "d:h:p:U:s:o:W:")) != -1)
+	while ((ch = getopt(argc, argv, "d:h:p:U:s:o:W:a:g:e:i:Dv")) != -1)
 		switch(ch)
 		{
 			case 'd': /* database name */
@@ -366,6 +993,38 @@ int main(int argc, char **argv)
 				pool_size = strtosize(optarg);
 				printf("poolsize = %ld KB\n", pool_size);
 				break;
+			case 'a': /* knapsack algorithm */
+				if (strcmp(optarg, "auto") == 0)
+					algorithm = ADV_OPT_AUTO;
+				else if (strcmp(optarg, "greedy") == 0)
+					algorithm = ADV_OPT_GREEDY;
+				else if (strcmp(optarg, "dp") == 0)
+					algorithm = ADV_OPT_DP;
+				else if (strcmp(optarg, "bb") == 0)
+					algorithm = ADV_OPT_BB;
+				else if (strcmp(optarg, "fptas") == 0)
+					algorithm = ADV_OPT_FPTAS;
+				else
+				{
+					usage();
+					return 1;
+				}
+				break;
+			case 'g': /* granularity of the dp algorithm */
+				granularity = strtosize(optarg);
+				break;
+			case 'e': /* error bound of the fptas algorithm */
+				epsilon = atof(optarg);
+				break;
+			case 'i': /* interaction-aware selection */
+				rounds = atoi(optarg);
+				break;
+			case 'D': /* drop advice */
+				drop_advice = true;
+				break;
+			case 'v': /* verbose */
+				verbose = true;
+				break;
 			case 'o': /* output file */
 				output_filename = optarg;
 				break;
@@ -417,24 +1076,70 @@ int main(int argc, char **argv)
 		return 1;
 	}
 
-	analyse_workload(conn, workload);
+	num_stmts = read_workload(workload, &stmts);
 
 	if (workload != stdin)
 		fclose(workload);
 
-	num_indexes = read_advisor_output(conn, &suggested_indexes);
+	if (num_stmts < 0)
+	{
+		PQfinish(conn);
+		return 1;
+	}
 
-	if (pool_size > 0 &&
-			compute_config_size(suggested_indexes, num_indexes) > pool_size)
+	/* the usage of the existing indexes needs to be tracked only once */
+	if (drop_advice
+		&& exec_command(conn, "SET index_adviser.track_index_usage TO on") != 0)
 	{
-		find_optimal_configuration_greedy(suggested_indexes, num_indexes,
-											pool_size / 4);
+		PQfinish(conn);
+		return 1;
+	}
+
+	analyse_workload(conn, stmts, num_stmts);
+
+	if (drop_advice)
+		exec_command(conn, "RESET index_adviser.track_index_usage");
+
+	if (rounds > 0)
+	{
+		num_indexes = select_interaction_aware(conn, stmts, num_stmts, rounds,
+												pool_size, algorithm,
+												granularity, epsilon,
+												&suggested_indexes);
 	}
 	else
 	{
-		for (i = 0; i < num_indexes; ++i)
-		suggested_indexes[i]->used = true;
+		num_indexes = read_advisor_output(conn, &suggested_indexes);
+	}
+
+	if (num_indexes < 0)
+	{
+		PQfinish(conn);
+		return 1;
+	}
+
+	if (rounds <= 0)
+	{
+		if (pool_size > 0 &&
+				compute_config_size(suggested_indexes, num_indexes) > pool_size)
+		{
+			find_optimal_configuration(suggested_indexes, num_indexes,
+										pool_size, algorithm, granularity,
+										epsilon);
+		}
+		else
+		{
+			for (i = 0; i < num_indexes; ++i)
+			suggested_indexes[i]->used = true;
+		}
+	}
+
+	for (i = 0; i < num_stmts; ++i)
+	{
+		free(stmts[i].query);
+		free(stmts[i].key);
 	}
+	free(stmts);
 
 	if (output_filename != NULL)
 		sqlfile = fopen(output_filename, "w");
@@ -443,6 +1148,9 @@ int main(int argc, char **argv)
 
 	output_recommendation(conn, suggested_indexes, num_indexes, sqlfile);
 
+	if (drop_advice)
+		output_drop_recommendation(conn, sqlfile);
+
 	if (output_filename != NULL)
 		fclose(sqlfile);
 
@@ -6,22 +6,97 @@ typedef unsigned char bool;
 #define true	1
 #define false	0
 
+#define ADV_MAX_COLS 32
+
+/* the ordering options of an index column, as in pg_index.indoption */
+#define ADV_INDOPTION_DESC			0x0001
+#define ADV_INDOPTION_NULLS_FIRST	0x0002
+
 typedef struct {
-	char	*table;
-	char	*col_ids;	/* space saparated column numbers */
+	unsigned int reloid;
+	char	*table;		/* schema qualified, quoted table name */
+	char	*relname;	/* bare table name, used for naming the index */
+	int		ncols;
+	int		attnums[ADV_MAX_COLS];
+	int		options[ADV_MAX_COLS];	/* ADV_INDOPTION_* of each column */
 	int		size;		/* in KBs */
-	double	benefit;
+	double	benefit;	/* net of maintenance */
+	double	maintenance;	/* cost of keeping the index up to date */
+	double	hot_ratio;		/* share of HOT updates on the table, or -1 */
+	double	projected_hot_ratio;	/* the same, with this index */
 	bool	used;
 } AdvIndexInfo;
 
 typedef AdvIndexInfo** AdvIndexList;
 
+typedef struct {
+	char	*query;		/* statement text, as in the workload */
+	char	*key;		/* the same, normalized; see normalize_statement() */
+	int		count;		/* number of occurrences in the workload */
+} WorkloadStmt;
+
+/* (reloid, attnum) -> column name map; open addressing */
+typedef struct {
+	unsigned int reloid;
+	int		attnum;
+	char	*name;		/* NULL for an empty slot */
+} ColumnName;
+
+typedef struct {
+	ColumnName	*slots;
+	int			nslots;		/* a power of 2 */
+	int			nentries;
+} ColumnNameCache;
+
+extern ColumnNameCache *colname_cache_create(int expected);
+
+extern void colname_cache_insert(ColumnNameCache *cache, unsigned int reloid,
+									int attnum, const char *name);
+
+extern const char *colname_cache_lookup(ColumnNameCache *cache,
+										unsigned int reloid, int attnum);
+
+extern void colname_cache_free(ColumnNameCache *cache);
+
+typedef enum {
+	ADV_OPT_AUTO,
+	ADV_OPT_GREEDY,
+	ADV_OPT_DP,
+	ADV_OPT_BB,
+	ADV_OPT_FPTAS
+} AdvOptimizer;
+
+/* memory bound for the tables of the DP and the FPTAS */
+#define ADV_DP_MAX_BYTES			(64L * 1024 * 1024)
+
+/* capacity columns of the DP when no granularity is specified */
+#define ADV_DP_DEFAULT_COLUMNS		65536
+
+/* largest problem ADV_OPT_AUTO solves by branch-and-bound */
+#define ADV_BB_MAX_INDEXES			32
+
+#define ADV_FPTAS_DEFAULT_EPSILON	0.01
+
+extern bool verbose;
+
 extern long compute_config_size(AdvIndexList index_list, int len);
 
+extern void find_optimal_configuration(AdvIndexList index_list, int len,
+										long size_limit,
+										AdvOptimizer algorithm,
+										long granularity, double epsilon);
+
 extern void find_optimal_configuration_greedy(AdvIndexList index_list, int len,
 												long size_limit);
 
-extern void find_optimal_configuration_dp(AdvIndexList index_list, int len,
+extern bool find_optimal_configuration_dp(AdvIndexList index_list, int len,
+											long size_limit, long granularity);
+
+extern void find_optimal_configuration_bb(AdvIndexList index_list, int len,
 											long size_limit);
 
+extern bool find_optimal_configuration_fptas(AdvIndexList index_list, int len,
+												long size_limit,
+												double epsilon);
+
 #endif /* ADVISE_INDEX_H */
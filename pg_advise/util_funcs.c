@@ -5,11 +5,102 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include "advise_index.h"
 
+/* print what the optimizers do; set by -v */
+bool verbose = false;
+
+static unsigned int colname_hash(unsigned int reloid, int attnum)
+{
+	return reloid * 2654435761u ^ (unsigned int)attnum * 40503u;
+}
+
+ColumnNameCache *colname_cache_create(int expected)
+{
+	ColumnNameCache *cache = (ColumnNameCache *)malloc(sizeof(ColumnNameCache));
+
+	/* keep the table at most half full */
+	for (cache->nslots = 16; cache->nslots < expected * 2; cache->nslots *= 2)
+		;
+
+	cache->slots = (ColumnName *)calloc(cache->nslots, sizeof(ColumnName));
+	cache->nentries = 0;
+
+	return cache;
+}
+
+static ColumnName *colname_cache_find(ColumnNameCache *cache,
+										unsigned int reloid, int attnum)
+{
+	unsigned int i;
+
+	for (i = colname_hash(reloid, attnum) & (cache->nslots - 1);
+			cache->slots[i].name != NULL;
+			i = (i + 1) & (cache->nslots - 1))
+	{
+		if (cache->slots[i].reloid == reloid
+			&& cache->slots[i].attnum == attnum)
+			break;
+	}
+
+	return &cache->slots[i];
+}
+
+void colname_cache_insert(ColumnNameCache *cache, unsigned int reloid,
+							int attnum, const char *name)
+{
+	ColumnName *slot;
+
+	if ((cache->nentries + 1) * 2 > cache->nslots)
+	{
+		ColumnName *old = cache->slots;
+		int nold = cache->nslots;
+		int i;
+
+		cache->nslots *= 2;
+		cache->slots = (ColumnName *)calloc(cache->nslots, sizeof(ColumnName));
+
+		for (i = 0; i < nold; ++i)
+			if (old[i].name != NULL)
+				*colname_cache_find(cache, old[i].reloid, old[i].attnum)
+					= old[i];
+
+		free(old);
+	}
+
+	slot = colname_cache_find(cache, reloid, attnum);
+
+	if (slot->name != NULL)
+		free(slot->name);
+	else
+		++cache->nentries;
+
+	slot->reloid = reloid;
+	slot->attnum = attnum;
+	slot->name = strdup(name);
+}
+
+const char *colname_cache_lookup(ColumnNameCache *cache, unsigned int reloid,
+									int attnum)
+{
+	return colname_cache_find(cache, reloid, attnum)->name;
+}
+
+void colname_cache_free(ColumnNameCache *cache)
+{
+	int i;
+
+	for (i = 0; i < cache->nslots; ++i)
+		free(cache->slots[i].name);
+
+	free(cache->slots);
+	free(cache);
+}
+
 long compute_config_size(AdvIndexList index_list, int len)
 {
-	int size = 0;
+	long size = 0;
 	int i;
 
 	for (i = 0; i < len; ++i)
@@ -22,71 +113,427 @@ long compute_config_size(AdvIndexList index_list, int len)
 void find_optimal_configuration_greedy(AdvIndexList index_list, int len,
 										long size_limit)
 {
-	int current_size = 0;
-	double sum_benefit = 0.0;
+	long current_size = 0;
 	int i = 0;
 
 	for (i = 0; i < len && current_size <= size_limit; ++i)
-		if (current_size + index_list[i]->size <= size_limit)
+		if (index_list[i]->benefit > 0
+			&& current_size + index_list[i]->size <= size_limit)
 		{
 			index_list[i]->used = true;
-			sum_benefit += index_list[i]->benefit;
 			current_size += index_list[i]->size;
 		}
 }
 
-/* TODO: not called from anywhere. Find a use for it */
-void find_optimal_configuration_dp(AdvIndexList index_list, int len,
+#define BIT_SET(bits, n)	((bits)[(n) >> 3] |= (unsigned char)(1 << ((n) & 7)))
+#define BIT_TEST(bits, n)	(((bits)[(n) >> 3] >> ((n) & 7)) & 1)
+
+/*
+ * The memory a DP over 'columns' entries takes: a row of choice bits per
+ * index, and the best value of each entry.
+ */
+static double dp_bytes(int len, long columns)
+{
+	return (double)len * (columns / 8 + 1) + (double)columns * sizeof(double);
+}
+
+/* frees the rows of choice bits allocated so far, and the array of them */
+static void free_keep(unsigned char **keep, int len)
+{
+	int i;
+
+	if (keep == NULL)
+		return;
+
+	for (i = 0; i < len; ++i)
+		free(keep[i]);
+
+	free(keep);
+}
+
+/*
+ * 0/1 knapsack by dynamic programming over the capacity.
+ *
+ * Sizes are rounded up to multiples of 'granularity' KB, so the capacity axis
+ * has size_limit/granularity + 1 entries; rounding up keeps every solution
+ * within the size limit. The best-benefit row is rolled in place, and only one
+ * bit per (index, capacity) is kept for reconstructing the choice. If these
+ * would need more than ADV_DP_MAX_BYTES, the granularity is made coarser.
+ * Passing a granularity <= 0 picks one that gives ADV_DP_DEFAULT_COLUMNS.
+ *
+ * Returns false, having picked nothing, if it runs out of memory.
+ *
+ * Note: it sets the 'used' member
+ */
+bool find_optimal_configuration_dp(AdvIndexList index_list, int len,
+									long size_limit, long granularity)
+{
+	double			*best;
+	unsigned char	**keep;
+	long			*weight;
+	long			capacity, w;
+	size_t			rowbytes;
+	int				i;
+
+	if (len == 0 || size_limit <= 0)
+		return true;
+
+	if (granularity <= 0)
+		granularity = (size_limit + ADV_DP_DEFAULT_COLUMNS - 1)
+						/ ADV_DP_DEFAULT_COLUMNS;
+	if (granularity <= 0)
+		granularity = 1;
+
+	/* coarsen the granularity until the tables fit the memory bound */
+	while (dp_bytes(len, size_limit / granularity + 1) > ADV_DP_MAX_BYTES)
+		granularity *= 2;
+
+	capacity = size_limit / granularity;
+	rowbytes = capacity / 8 + 1;
+
+	if (verbose)
+		printf("knapsack: %d indexes, capacity %ld x %ld KB\n",
+				len, capacity, granularity);
+
+	best = (double *)calloc(capacity + 1, sizeof(double));
+	weight = (long *)malloc(len * sizeof(long));
+	keep = (unsigned char **)calloc(len, sizeof(unsigned char *));
+
+	if (best == NULL || weight == NULL || keep == NULL)
+		goto OutOfMemory;
+
+	for (i = 0; i < len; ++i)
+	{
+		weight[i] = (index_list[i]->size + granularity - 1) / granularity;
+		keep[i] = (unsigned char *)calloc(rowbytes, 1);
+
+		if (keep[i] == NULL)
+			goto OutOfMemory;
+
+		if (index_list[i]->benefit <= 0 || weight[i] > capacity)
+			continue;
+
+		/* iterate downwards, so that each index is picked at most once */
+		for (w = capacity; w >= weight[i]; --w)
+		{
+			double with = best[w - weight[i]] + index_list[i]->benefit;
+
+			if (with > best[w])
+			{
+				best[w] = with;
+				BIT_SET(keep[i], w);
+			}
+		}
+	}
+
+	for (i = len - 1, w = capacity; i >= 0; --i)
+		if (BIT_TEST(keep[i], w))
+		{
+			index_list[i]->used = true;
+			w -= weight[i];
+		}
+
+	free_keep(keep, len);
+	free(weight);
+	free(best);
+
+	return true;
+
+OutOfMemory:
+	free_keep(keep, len);
+	free(weight);
+	free(best);
+
+	return false;
+}
+
+typedef struct {
+	AdvIndexInfo	**items;	/* sorted by benefit/size, descending */
+	int				len;
+	bool			*take;		/* current branch */
+	bool			*best_take;	/* best solution found so far */
+	double			best;
+	long			nodes;		/* number of branches explored */
+} BBState;
+
+static int compare_ratio(const void *a, const void *b)
+{
+	const AdvIndexInfo *i1 = *(AdvIndexInfo * const *)a;
+	const AdvIndexInfo *i2 = *(AdvIndexInfo * const *)b;
+	double r1 = i1->benefit / (i1->size > 0 ? i1->size : 1);
+	double r2 = i2->benefit / (i2->size > 0 ? i2->size : 1);
+
+	return r1 < r2 ? 1 : (r1 > r2 ? -1 : 0);
+}
+
+/* the fractional (LP relaxation) bound of the items from k onwards */
+static double bb_bound(BBState *st, int k, long room)
+{
+	double bound = 0;
+
+	for (; k < st->len && room > 0; ++k)
+	{
+		AdvIndexInfo *item = st->items[k];
+
+		if (item->benefit <= 0)
+			break;
+
+		if (item->size <= room)
+		{
+			room -= item->size;
+			bound += item->benefit;
+		}
+		else
+		{
+			bound += item->benefit * room / item->size;
+			room = 0;
+		}
+	}
+
+	return bound;
+}
+
+static void bb_search(BBState *st, int k, long room, double value)
+{
+	++st->nodes;
+
+	if (value > st->best)
+	{
+		st->best = value;
+		memcpy(st->best_take, st->take, st->len * sizeof(bool));
+	}
+
+	if (k == st->len || st->items[k]->benefit <= 0
+		|| value + bb_bound(st, k, room) <= st->best)
+		return;
+
+	if (st->items[k]->size <= room)
+	{
+		st->take[k] = true;
+		bb_search(st, k + 1, room - st->items[k]->size,
+					value + st->items[k]->benefit);
+		st->take[k] = false;
+	}
+
+	bb_search(st, k + 1, room, value);
+}
+
+/*
+ * 0/1 knapsack by branch-and-bound; exact, and independent of the size unit,
+ * but exponential in the worst case, so meant for small number of indexes.
+ *
+ * Note: it sets the 'used' member
+ */
+void find_optimal_configuration_bb(AdvIndexList index_list, int len,
 									long size_limit)
 {
-	int **cost;
-	int w, i;
+	BBState st;
+	int i;
+
+	if (len == 0)
+		return;
+
+	st.items = (AdvIndexInfo **)malloc(len * sizeof(AdvIndexInfo *));
+	memcpy(st.items, index_list, len * sizeof(AdvIndexInfo *));
+	qsort(st.items, len, sizeof(AdvIndexInfo *), compare_ratio);
+
+	st.len = len;
+	st.take = (bool *)calloc(len, sizeof(bool));
+	st.best_take = (bool *)calloc(len, sizeof(bool));
+	st.best = 0;
+	st.nodes = 0;
+
+	bb_search(&st, 0, size_limit, 0);
 
-	printf("w = %ld\n", size_limit);
-	cost = (int **)malloc(sizeof(int) * (len + 1));
+	if (verbose)
+		printf("knapsack: branch-and-bound explored %ld nodes\n", st.nodes);
 
-	for (i = 0; i < len+1; ++i)
-		cost[i] = (int *)malloc(sizeof(int *) * (size_limit * 1));
-	for (w = 0; w <= size_limit; ++w)
-		cost[0][w] = 0;
-	for (i = 1; i <= len; ++i)
+	for (i = 0; i < len; ++i)
+		if (st.best_take[i])
+			st.items[i]->used = true;
+
+	free(st.best_take);
+	free(st.take);
+	free(st.items);
+}
+
+/*
+ * 0/1 knapsack by the profit-scaling FPTAS: benefits are scaled down so that
+ * the sum of scaled benefits is at most len*len/epsilon, and a dynamic program
+ * over the scaled benefit finds the smallest total size reaching each benefit.
+ * The result is within (1 - epsilon) of the optimum, whatever the size unit.
+ * If the tables would need more than ADV_DP_MAX_BYTES, the benefits are
+ * scaled down further, and the error bound that is actually achieved is
+ * reported.
+ *
+ * Returns false, having picked nothing, if it runs out of memory.
+ *
+ * Note: it sets the 'used' member
+ */
+bool find_optimal_configuration_fptas(AdvIndexList index_list, int len,
+										long size_limit, double epsilon)
+{
+	double			maxbenefit = 0;
+	double			sumbenefit = 0;
+	double			scale;
+	double			maxunits;
+	long			*profit;
+	long			total = 0;
+	long			p;
+	double			*minsize;		/* smallest size reaching a profit */
+	unsigned char	**keep;
+	int				i;
+
+	for (i = 0; i < len; ++i)
+		if (index_list[i]->size <= size_limit && index_list[i]->benefit > 0)
+		{
+			sumbenefit += index_list[i]->benefit;
+			if (index_list[i]->benefit > maxbenefit)
+				maxbenefit = index_list[i]->benefit;
+		}
+
+	if (maxbenefit <= 0)
+		return true;
+
+	if (epsilon <= 0 || epsilon >= 1)
+		epsilon = ADV_FPTAS_DEFAULT_EPSILON;
+
+	scale = epsilon * maxbenefit / len;
+
+	/* bound the width of the tables; see dp_bytes() */
+	maxunits = (double)ADV_DP_MAX_BYTES / ((double)len / 8 + sizeof(double));
+	if (sumbenefit / scale > maxunits)
+	{
+		scale = sumbenefit / maxunits;
+		epsilon = scale * len / maxbenefit;
+	}
+
+	profit = (long *)malloc(len * sizeof(long));
+	if (profit == NULL)
+		return false;
+
+	for (i = 0; i < len; ++i)
 	{
-		cost[i][0] = 0;
+		if (index_list[i]->benefit <= 0 || index_list[i]->size > size_limit)
+			profit[i] = 0;
+		else
+			profit[i] = (long)(index_list[i]->benefit / scale);
+
+		total += profit[i];
+	}
+
+	if (verbose)
+		printf("knapsack: FPTAS with epsilon %g, %ld benefit units\n",
+				epsilon, total);
+
+	minsize = (double *)malloc((total + 1) * sizeof(double));
+	keep = (unsigned char **)calloc(len, sizeof(unsigned char *));
+
+	if (minsize == NULL || keep == NULL)
+		goto OutOfMemory;
+
+	minsize[0] = 0;
+	for (p = 1; p <= total; ++p)
+		minsize[p] = (double)size_limit + 1;	/* unreachable */
+
+	for (i = 0; i < len; ++i)
+	{
+		keep[i] = (unsigned char *)calloc(total / 8 + 1, 1);
+
+		if (keep[i] == NULL)
+			goto OutOfMemory;
+
+		if (profit[i] == 0)
+			continue;
 
-		for (w = 1; w <= size_limit; ++w)
+		for (p = total; p >= profit[i]; --p)
 		{
-			if (index_list[i-1]->size <= w)
+			double with = minsize[p - profit[i]] + index_list[i]->size;
+
+			if (with < minsize[p])
 			{
-				if (index_list[i-1]->benefit
-					+ cost[i-1][w - index_list[i-1]->size]
-					> cost[i-1][w])
-				{
-					cost[i][w] = index_list[i-1]->benefit +
-									cost[i-1][w - index_list[i-1]->size];
-				}
-				else
-					cost[i][w] = cost[i-1][w];
+				minsize[p] = with;
+				BIT_SET(keep[i], p);
 			}
-			else
-				cost[i][w] = cost[i-1][w];
 		}
 	}
 
-	for (	i = len, w = size_limit;
-			i > 0 && w > 0;
-			--i)
+	for (p = total; p > 0 && minsize[p] > size_limit; --p)
+		;
+
+	for (i = len - 1; i >= 0; --i)
+		if (p > 0 && BIT_TEST(keep[i], p))
+		{
+			index_list[i]->used = true;
+			p -= profit[i];
+		}
+
+	free_keep(keep, len);
+	free(minsize);
+	free(profit);
+
+	return true;
+
+OutOfMemory:
+	free_keep(keep, len);
+	free(minsize);
+	free(profit);
+
+	return false;
+}
+
+/*
+ * Pick the indexes that fit into size_limit KB, using the requested algorithm.
+ * ADV_OPT_AUTO solves small problems exactly by branch-and-bound, and others by
+ * the DP if it can work at the requested granularity, else by the FPTAS. If
+ * the DP or the FPTAS runs out of memory, the greedy algorithm is used.
+ */
+void find_optimal_configuration(AdvIndexList index_list, int len,
+								long size_limit, AdvOptimizer algorithm,
+								long granularity, double epsilon)
+{
+	bool solved = true;
+
+	if (algorithm == ADV_OPT_AUTO)
 	{
-		if (cost[i][w] != cost[i-1][w])
+		long g = granularity > 0 ? granularity : 1;
+
+		if (len <= ADV_BB_MAX_INDEXES)
+			algorithm = ADV_OPT_BB;
+		else if (dp_bytes(len, size_limit / g + 1) <= ADV_DP_MAX_BYTES)
 		{
-			index_list[i-1]->used = true;
-			w -= index_list[i-1]->size;
+			algorithm = ADV_OPT_DP;
+			granularity = g;
 		}
+		else
+			algorithm = ADV_OPT_FPTAS;
+	}
+
+	switch (algorithm)
+	{
+		case ADV_OPT_GREEDY:
+			find_optimal_configuration_greedy(index_list, len, size_limit);
+			break;
+		case ADV_OPT_DP:
+			solved = find_optimal_configuration_dp(index_list, len,
+													size_limit, granularity);
+			break;
+		case ADV_OPT_BB:
+			find_optimal_configuration_bb(index_list, len, size_limit);
+			break;
+		case ADV_OPT_FPTAS:
+		default:
+			solved = find_optimal_configuration_fptas(index_list, len,
+														size_limit, epsilon);
+			break;
+	}
+
+	if (!solved)
+	{
+		fprintf(stderr, "WARNING: out of memory fitting the indexes into the"
+						" size; using the greedy algorithm\n");
+		find_optimal_configuration_greedy(index_list, len, size_limit);
 	}
-	/*
-	for (i = 0; i < len+1; ++i)
-		free(cost[i]);
-	free(cost);
-	*/
 }
 
 #if DEBUG
@@ -105,6 +552,7 @@ void test_optimize() {
   conf[2]->benefit = 120;
   conf[2]->size = 3;
   conf[2]->used = false;
-  optimize_indexset(conf, 3, 5);
+  /* the optimum is {1, 2}; the greedy would pick {0, 1} */
+  find_optimal_configuration_dp(conf, 3, 5, 1);
 }
 #endif
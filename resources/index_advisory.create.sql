@@ -1,10 +1,388 @@
 
 create table index_advisory(	reloid		oid,
 								attrs		integer[],
+								coloptions	integer[],	/* null if ascending */
 								benefit		real,
 								index_size	integer,
 								backend_pid	integer,
-								timestamp	timestamptz);
+								timestamp	timestamptz,
+								fingerprint	bigint,
+								weight		integer not null default 1);
 
 create index IA_reloid on index_advisory( reloid );
 create index IA_backend_pid on index_advisory( backend_pid );
+create index IA_fingerprint on index_advisory( fingerprint );
+
+create table index_advisory_writes(	reloid			oid,
+									command			"char",	/* i, u or d */
+									rows			real,
+									updated_attrs	integer[],
+									hot_possible	boolean,
+									num_indexes		integer,
+									hot_ratio		real,
+									backend_pid		integer,
+									timestamp		timestamptz,
+									fingerprint		bigint,
+									weight			integer not null default 1);
+
+create index IAW_reloid on index_advisory_writes( reloid );
+create index IAW_backend_pid on index_advisory_writes( backend_pid );
+create index IAW_fingerprint on index_advisory_writes( fingerprint );
+
+create table index_advisory_usage(	indexrelid		oid,
+									reloid			oid,
+									attrs			integer[],
+									used			boolean,
+									redundant		boolean,
+									penalty			real,
+									index_size		integer,
+									backend_pid		integer,
+									timestamp		timestamptz,
+									fingerprint		bigint,
+									weight			integer not null default 1);
+
+create index IAU_indexrelid on index_advisory_usage( indexrelid );
+create index IAU_backend_pid on index_advisory_usage( backend_pid );
+create index IAU_fingerprint on index_advisory_usage( fingerprint );
+
+create table index_advisory_samples(	reloid		oid,
+										attrs		integer[],
+										sample		integer,
+										kind		"char",	/* b, g or m */
+										benefit		real,
+										backend_pid	integer,
+										timestamp	timestamptz,
+										fingerprint	bigint);
+
+create index IAS_backend_pid on index_advisory_samples( backend_pid );
+
+create table index_advisory_truncations(	reason		"char",	/* t, c, r or m */
+											elapsed_ms	integer,
+											replans		integer,
+											backend_pid	integer,
+											timestamp	timestamptz,
+											fingerprint	bigint,
+											weight		integer not null default 1);
+
+create index IAT_backend_pid on index_advisory_truncations( backend_pid );
+create index IAT_fingerprint on index_advisory_truncations( fingerprint );
+
+/*
+ * The benefit of each index over all the backends, kept up to date as advice
+ * is saved if index_adviser.benefit_half_life is set: the benefit decays to
+ * half in half_life seconds, the last setting it was updated with. An index
+ * has one row; see index_advisory_summary_add().
+ */
+create table index_advisory_summary(	reloid		oid,
+										attrs		integer[],
+										coloptions	integer[],
+										benefit		double precision,
+										index_size	integer,
+										half_life	integer,
+										last_update	timestamptz);
+
+create unique index IASU_index on index_advisory_summary( reloid, attrs,
+									coalesce( coloptions, '{}'::integer[] ) );
+
+/* and the benefit per hour, of the last day */
+create table index_advisory_hourly(	reloid		oid,
+									attrs		integer[],
+									coloptions	integer[],
+									hour		timestamptz,
+									benefit		double precision);
+
+create unique index IAH_index on index_advisory_hourly( reloid, attrs,
+									coalesce( coloptions, '{}'::integer[] ),
+									hour );
+create index IAH_hour on index_advisory_hourly( hour );
+
+/*
+ * Adds p_benefit to the row of an index in index_advisory_summary, after
+ * decaying what is there by the time since it was last updated, or inserts
+ * the row. A backend that loses the race to insert it updates the row the
+ * other one inserted.
+ */
+create or replace function index_advisory_summary_add(
+										p_reloid		oid,
+										p_attrs			integer[],
+										p_coloptions	integer[],
+										p_benefit		double precision,
+										p_index_size	integer,
+										p_half_life		integer)
+returns void as $$
+begin
+	loop
+		update	index_advisory_summary as x
+		set		benefit = x.benefit
+						* power( 0.5, greatest( 0, extract( epoch from now()
+													- x.last_update ) )
+									/ p_half_life )
+						+ p_benefit,
+				index_size = p_index_size,
+				half_life = p_half_life,
+				last_update = now()
+		where	x.reloid = p_reloid
+		and		x.attrs = p_attrs
+		and		coalesce( x.coloptions, '{}'::integer[] )
+					= coalesce( p_coloptions, '{}'::integer[] );
+
+		if found then
+			return;
+		end if;
+
+		begin
+			insert into index_advisory_summary( reloid, attrs, coloptions,
+												benefit, index_size,
+												half_life, last_update )
+			values( p_reloid, p_attrs, p_coloptions, p_benefit, p_index_size,
+					p_half_life, now() );
+
+			return;
+		exception when unique_violation then
+			/* inserted by another backend meanwhile; update it */
+		end;
+	end loop;
+end;
+$$ language plpgsql volatile;
+
+/* and to the bucket of this hour in index_advisory_hourly */
+create or replace function index_advisory_hourly_add(
+										p_reloid		oid,
+										p_attrs			integer[],
+										p_coloptions	integer[],
+										p_benefit		double precision)
+returns void as $$
+begin
+	loop
+		update	index_advisory_hourly as x
+		set		benefit = x.benefit + p_benefit
+		where	x.reloid = p_reloid
+		and		x.attrs = p_attrs
+		and		coalesce( x.coloptions, '{}'::integer[] )
+					= coalesce( p_coloptions, '{}'::integer[] )
+		and		x.hour = date_trunc( 'hour', now() );
+
+		if found then
+			return;
+		end if;
+
+		begin
+			insert into index_advisory_hourly( reloid, attrs, coloptions, hour,
+												benefit )
+			values( p_reloid, p_attrs, p_coloptions,
+					date_trunc( 'hour', now() ), p_benefit );
+
+			return;
+		exception when unique_violation then
+			/* inserted by another backend meanwhile; update it */
+		end;
+	end loop;
+end;
+$$ language plpgsql volatile;
+
+/*
+ * The cost of maintaining an index on p_attrs of p_reloid, for the writes
+ * recorded by a backend, in the planner's cost units. Every row inserted,
+ * deleted, or updated in a way that is not a HOT update, costs a descent of
+ * the index plus writing the index entry; the latter is scaled by the width of
+ * the entry, derived from the index size. An UPDATE is not charged if it can
+ * be a HOT update, that is, if it sets none of the columns of this index and
+ * of the existing indexes. An UPDATE that could be a HOT update, but sets a
+ * column of this index, is charged for new entries in all the existing indexes
+ * too, since it cannot be a HOT update anymore.
+ */
+create or replace function index_maintenance_cost(
+							p_backend_pid	index_advisory.backend_pid%type,
+							p_reloid		index_advisory.reloid%type,
+							p_attrs			index_advisory.attrs%type,
+							p_index_size	index_advisory.index_size%type)
+returns real as $$
+	select	(coalesce( sum( w.weight * w.rows
+							* case	when	w.command = 'u'
+									and		w.hot_possible
+									and		w.updated_attrs && $3
+									then	1 + w.num_indexes
+									else	1
+							  end ), 0 )
+			* ( current_setting( 'cpu_index_tuple_cost' )::real
+				+ current_setting( 'cpu_operator_cost' )::real
+					* ln( greatest( c.reltuples, 2 ) ) / ln( 2 )
+				+ current_setting( 'random_page_cost' )::real
+					* ( $4 * 1024.0 / greatest( c.reltuples, 1 ) )
+					/ current_setting( 'block_size' )::real ))::real
+	from	pg_class c
+			left join index_advisory_writes w
+				on	w.reloid = c.oid
+				and	w.backend_pid = $1
+				and	(	w.command <> 'u'
+					or	not w.hot_possible
+					or	w.updated_attrs && $3 )
+	where	c.oid = $2
+	group by c.reltuples;
+$$ language sql stable;
+
+/*
+ * The share of HOT updates on p_reloid now, and if an index on p_attrs were
+ * created; null if no UPDATEs were recorded. The current share is the one
+ * observed by the statistics collector, if index_adviser.use_hot_statistics
+ * recorded it, else that of the recorded UPDATEs. The projection removes the
+ * UPDATEs that set a column of the index from the HOT updates.
+ */
+create or replace function index_hot_ratio(
+							p_backend_pid	index_advisory.backend_pid%type,
+							p_reloid		index_advisory.reloid%type,
+							p_attrs			index_advisory.attrs%type,
+							out current_ratio	real,
+							out projected_ratio	real)
+as $$
+	select	current_ratio,
+			(current_ratio * (1 - coalesce( broken / nullif( hot, 0 ), 0 )))::real
+	from	(select	coalesce( avg( w.hot_ratio ),
+							  sum( case when w.hot_possible
+										then w.weight * w.rows else 0 end )
+								/ nullif( sum( w.weight * w.rows ), 0 ))::real
+								as current_ratio,
+					sum( case when w.hot_possible
+							  then w.weight * w.rows else 0 end ) as hot,
+					sum( case when w.hot_possible and w.updated_attrs && $3
+							  then w.weight * w.rows else 0 end ) as broken
+			from	index_advisory_writes w
+			where	w.backend_pid = $1
+			and		w.reloid = $2
+			and		w.command = 'u'
+			) as v;
+$$ language sql stable;
+
+/*
+ * The existing indexes that no statement recorded by p_backend_pid needs: every
+ * statement that touched the table re-planned without the index at no extra
+ * cost, either because it did not use the index, or because the index is
+ * redundant and a longer one took its place. Dropping one saves its size and
+ * the cost of maintaining it.
+ */
+create or replace function index_drop_candidates(
+							p_backend_pid	index_advisory_usage.backend_pid%type,
+							out indexrelid	oid,
+							out reloid		oid,
+							out attrs		integer[],
+							out index_size	integer,
+							out used		boolean,
+							out maintenance	real)
+returns setof record as $$
+	select	u.indexrelid,
+			u.reloid,
+			u.attrs,
+			u.index_size,
+			u.used,
+			index_maintenance_cost( $1, u.reloid, u.attrs, u.index_size )
+	from	(select	u.indexrelid,
+					u.reloid,
+					u.attrs,
+					max( u.index_size ) as index_size,
+					bool_or( u.used ) as used
+			from	index_advisory_usage u
+			where	u.backend_pid = $1
+			group by u.indexrelid, u.reloid, u.attrs
+			having	bool_and( u.penalty is not null and u.penalty <= 0 )
+			) as u
+	/* the index may have been dropped since */
+	where	exists (select 1 from pg_index i where i.indexrelid = u.indexrelid)
+	order by u.index_size desc;
+$$ language sql stable;
+
+/*
+ * How the benefit of an index on p_attrs of p_reloid varies with the values of
+ * the parameters of the statements, over the samples of parameter values taken
+ * by index_adviser.param_samples; the generic plans are summarized separately.
+ * Null if no parameterized statement used the index.
+ */
+create or replace function index_benefit_distribution(
+							p_backend_pid	index_advisory.backend_pid%type,
+							p_reloid		index_advisory.reloid%type,
+							p_attrs			index_advisory.attrs%type,
+							out samples			bigint,
+							out min_benefit		real,
+							out avg_benefit		real,
+							out max_benefit		real,
+							out stddev_benefit	real,
+							out generic_benefit	real)
+as $$
+	select	count( nullif( s.kind, 'g' ) ),
+			min( case when s.kind <> 'g' then s.benefit end ),
+			avg( case when s.kind <> 'g' then s.benefit end )::real,
+			max( case when s.kind <> 'g' then s.benefit end ),
+			stddev_pop( case when s.kind <> 'g' then s.benefit end )::real,
+			avg( case when s.kind = 'g' then s.benefit end )::real
+	from	index_advisory_samples s
+	where	s.backend_pid = $1
+	and		s.reloid = $2
+	and		s.attrs = $3
+	having	count(*) > 0;
+$$ language sql stable;
+
+/*
+ * Hide an existing index from the Index Adviser for the rest of the session:
+ * the plans it compares are generated as if the index did not exist. Use
+ * "reset index_adviser.hide_indexes" to bring all of them back.
+ */
+create or replace function index_adviser_hide_index( p_index regclass )
+returns text as $$
+	select set_config( 'index_adviser.hide_indexes',
+						case	when current_setting(
+											'index_adviser.hide_indexes' ) = ''
+								then ''
+								else current_setting(
+											'index_adviser.hide_indexes' ) || ','
+						end || $1::text,
+						false );
+$$ language sql volatile;
+
+/*
+ * The benefit of each index as of now, that is, decayed since it was last
+ * updated.
+ */
+create or replace view index_advisory_decayed as
+	select	reloid,
+			attrs,
+			coloptions,
+			index_size,
+			benefit
+				* power( 0.5, greatest( 0, extract( epoch from now()
+															- last_update ) )
+								/ half_life ) as benefit,
+			last_update
+	from	index_advisory_summary;
+
+/*
+ * The benefit of each index in the last p_window, up to a day. The benefit in
+ * an hour's bucket is taken to be spread evenly over the part of that hour
+ * that has passed, and is counted in the proportion of that part that falls
+ * in the window.
+ */
+create or replace function index_advisory_window(
+							p_window		interval,
+							out reloid		oid,
+							out attrs		integer[],
+							out coloptions	integer[],
+							out benefit		double precision)
+returns setof record as $$
+	select	h.reloid,
+			h.attrs,
+			h.coloptions,
+			sum( h.benefit
+				* greatest( 0, extract( epoch from
+										least( h.hour + interval '1 hour', now() )
+										- greatest( h.hour, now() - $1 ) ) )
+				/ greatest( 1, extract( epoch from
+										least( h.hour + interval '1 hour', now() )
+										- h.hour ) ) )
+	from	index_advisory_hourly h
+	where	h.hour + interval '1 hour' > now() - $1
+	group by h.reloid, h.attrs, h.coloptions;
+$$ language sql stable;
+
+create or replace view index_advisory_last_hour as
+	select * from index_advisory_window( interval '1 hour' );
+
+create or replace view index_advisory_last_day as
+	select * from index_advisory_window( interval '1 day' );
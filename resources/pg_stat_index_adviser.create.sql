@@ -0,0 +1,76 @@
+
+/*
+ * Cumulative statistics of the Index Adviser's activity in all the backends,
+ * kept in shared memory; available only if the plugin is loaded thru
+ * shared_preload_libraries, for eg.
+ *
+ *	shared_preload_libraries = '$libdir/plugins/libpg_index_adviser'
+ *
+ * The library named below must be the one that is preloaded. The *_time
+ * columns are in milliseconds, and the *_bytes columns count the memory
+ * allocated in each phase; time_histogram counts the statements advised in
+ * under 1, 10, 100, 1000 and 10000 milliseconds, and the rest.
+ */
+create or replace function index_adviser_stats(
+							out calls					bigint,
+							out advised					bigint,
+							out skipped_no_user_tables	bigint,
+							out skipped_repeated		bigint,
+							out skipped_cheap			bigint,
+							out skipped_by_plan			bigint,
+							out truncated_time			bigint,
+							out truncated_candidates	bigint,
+							out truncated_replans		bigint,
+							out truncated_memory		bigint,
+							out candidates_generated	bigint,
+							out candidates_relevant		bigint,
+							out candidates_used			bigint,
+							out replans					bigint,
+							out total_time				double precision,
+							out existing_time			double precision,
+							out scan_time				double precision,
+							out create_time				double precision,
+							out replan_time				double precision,
+							out mark_time				double precision,
+							out attribution_time		double precision,
+							out samples_time			double precision,
+							out save_time				double precision,
+							out total_bytes				bigint,
+							out existing_bytes			bigint,
+							out scan_bytes				bigint,
+							out create_bytes			bigint,
+							out replan_bytes			bigint,
+							out mark_bytes				bigint,
+							out attribution_bytes		bigint,
+							out samples_bytes			bigint,
+							out save_bytes				bigint,
+							out time_histogram			bigint[],
+							out stats_reset				timestamptz)
+returns record
+as '$libdir/plugins/libpg_index_adviser', 'index_adviser_stats'
+language C volatile;
+
+create or replace function index_adviser_stats_reset()
+returns void
+as '$libdir/plugins/libpg_index_adviser', 'index_adviser_stats_reset'
+language C volatile;
+
+create or replace view pg_stat_index_adviser as
+	select * from index_adviser_stats();
+
+/*
+ * The statements that needed the most memory to be advised, since the
+ * statistics were reset; peak_bytes is the most the adviser held at once.
+ */
+create or replace function index_adviser_memory_top(
+							out fingerprint		bigint,
+							out peak_bytes		bigint,
+							out allocated_bytes	bigint,
+							out advised_at		timestamptz,
+							out query			text)
+returns setof record
+as '$libdir/plugins/libpg_index_adviser', 'index_adviser_memory_top'
+language C volatile;
+
+create or replace view pg_stat_index_adviser_memory as
+	select * from index_adviser_memory_top();
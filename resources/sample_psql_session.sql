@@ -72,6 +72,28 @@ and		t1.a = 100
 	or t.b = 100
 		and t1.b = 100;
 
+/* the other clause shapes an index can serve */;
+
+/* a row comparison suggests its leading column, and its columns together */;
+explain select * from t where (a, b) > (99990, 0);
+
+/* the same, with the columns on the right */;
+explain select * from t where (99990, 0) < (a, b);
+
+explain select * from t where a in (1, 2, 3);
+
+explain select * from t where a is null;
+
+/* a column inside a CASE or a COALESCE cannot use an index */;
+explain select * from t where case when a > 0 then a else b end = 100;
+
+explain select * from t where coalesce(a, b) = 100;
+
+/* but the subqueries in them, and in the WHERE clause, are advised too */;
+explain select * from t where a = (select b from t as t2 where t2.a = 100);
+
+explain select * from t where b = coalesce((select a from t as t2 where t2.b = 100), 0);
+
 /* following are the contents of the advise_index table */;
 select * from index_advisory;
 
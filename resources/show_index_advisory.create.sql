@@ -10,6 +10,8 @@ declare
 	r_advice  record;
 	q_column  text;
 	r_column  record;
+	r_hot     record;
+	r_dist    record;
 	ret       text;
 
 	NAMEDATALEN	int := 64;
@@ -27,27 +29,65 @@ begin
 	ret :=	'/* Index Adviser */' || E'\n' ||
 			'/* ============= */' || E'\n';
 
-	q_advice :=	'SELECT	c.relname,
-						c.oid as reloid,
-						a.attrs AS colids,
-						MAX( a.index_size ) AS size_in_KB,
-						SUM( a.benefit ) AS benefit,
-						SUM( a.benefit )/MAX( a.index_size ) AS gain
-				FROM    index_advisory a,
-						pg_class c
-				WHERE   a.backend_pid = ' || pid || '
-				AND     a.reloid = c.oid
-				GROUP BY    c.relname, c.oid, a.attrs
+	q_advice :=	'SELECT	relname,
+						reloid,
+						colids,
+						coloptions,
+						size_in_KB,
+						benefit,
+						maintenance,
+						(benefit - maintenance)/size_in_KB AS gain
+				FROM	(SELECT	c.relname,
+								c.oid as reloid,
+								a.attrs AS colids,
+								a.coloptions,
+								MAX( a.index_size ) AS size_in_KB,
+								SUM( a.benefit * a.weight ) AS benefit,
+								index_maintenance_cost( ' || pid || ',
+														c.oid, a.attrs,
+														MAX( a.index_size ) )
+									AS maintenance
+						FROM    index_advisory a,
+								pg_class c
+						WHERE   a.backend_pid = ' || pid || '
+						AND     a.reloid = c.oid
+						GROUP BY    c.relname, c.oid, a.attrs, a.coloptions
+						) AS v
 				ORDER BY    gain
 					DESC';
-					
+
 	for r_advice in execute q_advice loop
 
 		ret := ret ||
 				E'\n/* size: ' || r_advice.size_in_KB || ' KB, '
 				|| 'benefit: ' || r_advice.benefit || ', '
+				|| 'maintenance: ' || r_advice.maintenance || ', '
 				|| 'gain: ' || r_advice.gain || E' */\n';
 
+		/* warn if this index would turn HOT updates into regular updates */
+		select * into r_hot
+		from index_hot_ratio( pid, r_advice.reloid, r_advice.colids );
+
+		if r_hot.projected_ratio < r_hot.current_ratio then
+			ret := ret || '/* HOT updates: ' || r_hot.current_ratio
+					|| ' -> ' || r_hot.projected_ratio || E' */\n';
+		end if;
+
+		/* how the benefit varies with the parameters of the statements */
+		select * into r_dist
+		from index_benefit_distribution( pid, r_advice.reloid,
+											r_advice.colids );
+
+		if r_dist.samples > 0 then
+			ret := ret || '/* benefit per parameter sample: min '
+					|| r_dist.min_benefit || ', avg ' || r_dist.avg_benefit
+					|| ', max ' || r_dist.max_benefit
+					|| ', stddev ' || r_dist.stddev_benefit
+					|| coalesce( ', generic plan ' || r_dist.generic_benefit,
+								'' )
+					|| E' */\n';
+		end if;
+
 		collist_w_C		:= '';
 		collist_w_U     := '';
 		colidlist_w_U	:= '';
@@ -78,6 +118,15 @@ begin
 			end if;
 
 			collist_w_C		:= collist_w_C		|| r_column.name;
+
+			/* the ordering, where it differs from the default */
+			if (coalesce( r_advice.coloptions[i], 0 ) & 1) <> 0 then
+				collist_w_C := collist_w_C ||
+					case when (r_advice.coloptions[i] & 2) <> 0
+						then ' desc' else ' desc nulls last' end;
+			elsif (coalesce( r_advice.coloptions[i], 0 ) & 2) <> 0 then
+				collist_w_C := collist_w_C || ' nulls first';
+			end if;
 			collist_w_U		:= collist_w_U		|| r_column.name;
 			colidlist_w_U	:= colidlist_w_U	|| r_column.id;
 
@@ -97,6 +146,18 @@ begin
 
 	end loop;
 
+	/* the existing indexes the statements can do without */
+	for r_advice in select * from index_drop_candidates( pid ) loop
+
+		ret := ret ||
+				E'\n/* size: ' || r_advice.index_size || ' KB, '
+				|| 'maintenance: ' || r_advice.maintenance || ', '
+				|| case when r_advice.used then 'redundant' else 'unused' end
+				|| E' */\n'
+				|| 'drop index ' || r_advice.indexrelid::regclass || E';\n';
+
+	end loop;
+
   return ret;
 end;
 $$ language plpgsql;